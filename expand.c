@@ -1,18 +1,62 @@
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lib/common.h"
+#include "lib/lexer.h"
 #include "lib/prep.h"
 
+// Returns whether the output ended a line
+static bool print_tokens(Token *t) {
+    bool eol = true;
+
+    for ( ; t != NULL; t = t->next) {
+        fwrite(t->span.ptr, 1, t->span.end - t->span.ptr, stdout);
+        if (t->span.end > t->span.ptr) eol = t->span.end[-1] == '\n';
+    }
+
+    return eol;
+}
+
+static void write_trace(char *path) {
+    if (path == NULL) return;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return;
+    }
+
+    prep_trace_write_json(f);
+    fclose(f);
+    prep_trace_write_summary(stderr);
+}
+
 int main(int argc, char *argv[]) {
     if (argc <= 1) {
-        fprintf(stderr, "Usage: %s src-file\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-l] [-t trace-file] src-file [snapshot-file [includes]]\n", argv[0]);
+        fprintf(stderr, "       %s [-l] [-t trace-file] -b src-file...\n", argv[0]);
     }
 
-    pool_init(2 * 1024 * 1024);
-    char *path = argv[1];
+    char *trace_path = NULL;
 
-    int outsz = 10 * 1024;
-    char *expanded_src = pool_alloc(outsz, char);
+    for ( ; argc >= 2; argv++, argc--) {
+        if (strcmp(argv[1], "-l") == 0) { // #line markers
+            prep_line_markers_set(true);
+        } else if (strcmp(argv[1], "-t") == 0 && argc >= 3) { // Include tree trace, its summary goes to stderr
+            trace_path = argv[2];
+            prep_trace_set(true);
+            argv++;
+            argc--;
+        } else {
+            break;
+        }
+    }
+
+    pool_init(32 * 1024 * 1024); // Every file is kept lexed for the whole run
+    lexer_init();
+    char *path = argv[1];
 
     char *spaths[] = {
         "/usr/lib/gcc/x86_64-linux-gnu/13/include",
@@ -22,10 +66,25 @@ int main(int argc, char *argv[]) {
     };
 
     prep_search_paths_set(spaths, sizeof(spaths) / sizeof(spaths[0]));
-    DefineTable *def_table = prep_define_newtable();
+    prep_prefetch_set(4);
+
+    if (argc >= 2 && strcmp(argv[1], "-b") == 0) { // Files with the same leading #includes share them
+        prep_shared_prefix_set(INT_MAX);
 
-    char *srcend = prep_expand(path, def_table, expanded_src, &outsz);
-    *srcend = '\0';
+        for (int i = 2, eol = true; i < argc; i++) {
+            printf(eol ? "# 1 \"%s\"\n" : "\n# 1 \"%s\"\n", argv[i]);
+            eol = print_tokens(prep_expand_tokens(argv[i], prep_define_newtable()));
+        }
 
-    printf("%s", expanded_src);
+        write_trace(trace_path);
+        return 0;
+    }
+
+    if (argc >= 3) { // Every leading #include by default
+        prep_snapshot_set(argv[2], argc >= 4 ? atoi(argv[3]) : INT_MAX);
+    }
+
+    DefineTable *def_table = prep_define_newtable();
+    print_tokens(prep_expand_tokens(path, def_table));
+    write_trace(trace_path);
 }
@@ -0,0 +1,206 @@
+#include "ast_cache.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A cache file is the header, the tokens as offsets into the source, the node arrays one type after the
+// other, the symbol definitions and their uses. Numbers are native 32-bit words and nodes are kept as
+// they are in memory, so AST_CACHE_VERSION goes up whenever TokenType, NodeType, a node or the layout
+// changes. The version goes into the key along with the source.
+#define AST_CACHE_MAGIC "ZHBAST"
+#define AST_CACHE_VERSION 3
+
+typedef struct {
+    char magic[sizeof(AST_CACHE_MAGIC)];
+    uint32_t version;
+    uint32_t src_len;
+    uint32_t nlines;
+    uint32_t ntokens;
+    uint32_t nnodes[NODE_TYPE_COUNT];
+    NodeRef first_element;
+    uint32_t ndefs;
+    uint32_t nuses;
+} CacheHeader;
+
+#define NO_TEXT UINT32_MAX // For the span of the stub tokens at the end, which points nowhere
+
+typedef struct {
+    uint32_t type;
+    uint32_t start; // Offsets into the source, or NO_TEXT
+    uint32_t end;
+    uint32_t line;
+    uint32_t column;
+} CachedToken;
+
+static char *cache_dir;
+
+static byte no_text[1];
+static Token end_of_file = {EOF_TOKEN, {no_text, no_text}};
+
+// No caching with NULL
+void ast_cache_dir_set(char *dir) {
+    cache_dir = dir;
+}
+
+// Named after a 64-bit hash of the version and the source, and the length of the source
+static char *cache_path(byte *src, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    uint32_t version = AST_CACHE_VERSION;
+
+    for (size_t i = 0; i < sizeof(version); i++) {
+        hash ^= ((byte *) &version)[i];
+        hash *= 1099511628211ull;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= src[i];
+        hash *= 1099511628211ull;
+    }
+
+    char name[48];
+    snprintf(name, sizeof(name), "%016llx-%zx.ast", (unsigned long long) hash, len);
+    return path_join(2, cache_dir, name);
+}
+
+static size_t cache_size(CacheHeader *h) {
+    size_t size = sizeof(CacheHeader) + (size_t) h->ntokens * sizeof(CachedToken);
+
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        size += (size_t) h->nnodes[type] * ast_node_size(type);
+    }
+
+    return size + (size_t) h->ndefs * sizeof(SymbolDef) + (size_t) h->nuses * sizeof(SymbolUse);
+}
+
+// The parse of src if it was cached. Once the header and the size check out the rest is trusted, only the
+// tokens are checked against the source.
+CachedAst *ast_cache_load(byte *src, size_t len) {
+    if (cache_dir == NULL) return NULL;
+
+    FILE *f = fopen(cache_path(src, len), "rb");
+    if (f == NULL) return NULL;
+
+    struct stat st;
+    byte *map = MAP_FAILED;
+
+    if (fstat(fileno(f), &st) == 0 && st.st_size >= (off_t) sizeof(CacheHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    }
+
+    fclose(f);
+    if (map == MAP_FAILED) return NULL;
+
+    CacheHeader *h = (CacheHeader *) map;
+    bool ok = memcmp(h->magic, AST_CACHE_MAGIC, sizeof(AST_CACHE_MAGIC)) == 0 && h->version == AST_CACHE_VERSION;
+    ok = ok && h->src_len == len && cache_size(h) == (size_t) st.st_size;
+
+    CachedToken *cached_tokens = (CachedToken *) (map + sizeof(CacheHeader));
+    for (uint32_t i = 0; i < h->ntokens && ok; i++) {
+        CachedToken *ct = &cached_tokens[i];
+        ok = ct->start == NO_TEXT ? ct->end == NO_TEXT : ct->start <= ct->end && ct->end <= len;
+    }
+
+    if (!ok) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    // Made like tokenize() and parse() make them, in the pool
+    Token *tokens = pool_alloc(h->ntokens * sizeof(Token) + 1, Token);
+    Token **refs = pool_alloc((h->ntokens + 1) * sizeof(Token *), Token *);
+
+    for (uint32_t i = 0; i < h->ntokens; i++) {
+        CachedToken *ct = &cached_tokens[i];
+        Token *next = i + 1 < h->ntokens ? &tokens[i + 1] : NULL;
+        Span span = ct->start == NO_TEXT ? (Span) {0} : (Span) {src + ct->start, src + ct->end};
+        tokens[i] = (Token) {ct->type, span, ct->line, ct->column, next};
+        refs[i] = &tokens[i];
+    }
+
+    refs[h->ntokens] = &end_of_file;
+
+    CachedAst *cached = malloc(sizeof(CachedAst));
+    assert(cached);
+    *cached = (CachedAst) {{refs, h->ntokens}, h->nlines, map, st.st_size};
+
+    byte *pos = (byte *) (cached_tokens + h->ntokens);
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        cached->ast.nodes[type] = (NodeArray) {pos, h->nnodes[type], h->nnodes[type]};
+        pos += (size_t) h->nnodes[type] * ast_node_size(type);
+    }
+
+    cached->ast.first_element = h->first_element;
+    cached->ast.defs = (SymbolDef *) pos;
+    cached->ast.ndefs = cached->ast.defs_cap = h->ndefs;
+    cached->ast.uses = (SymbolUse *) (cached->ast.defs + h->ndefs);
+    cached->ast.nuses = cached->ast.uses_cap = h->nuses;
+    return cached;
+}
+
+// Parses that gave up on something are left out, whether they do depends on parser_recovery_set(). So
+// are token lists with text from elsewhere than src.
+void ast_cache_store(byte *src, size_t len, int nlines, Ast *ast) {
+    if (cache_dir == NULL || ast->nerrors > 0) return;
+
+    for (uint32_t i = 0; i < ast->ntokens; i++) {
+        Span span = ast->tokens[i]->span;
+        if (span.ptr == NULL && span.end == NULL) continue;
+        if (span.ptr < src || span.end < span.ptr || span.end > src + len) return;
+    }
+
+    if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "render: cannot write cache %s\n", cache_dir);
+        return;
+    }
+
+    char *path = cache_path(src, len);
+    char *tmp_path = pool_alloc(strlen(path) + 5, char);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "render: cannot write cache %s\n", tmp_path);
+        return;
+    }
+
+    CacheHeader h = {AST_CACHE_MAGIC, AST_CACHE_VERSION, len, nlines, ast->ntokens};
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) h.nnodes[type] = ast->nodes[type].size;
+    h.first_element = ast->first_element;
+    h.ndefs = ast->ndefs;
+    h.nuses = ast->nuses;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (uint32_t i = 0; i < ast->ntokens; i++) {
+        Token *t = ast->tokens[i];
+        CachedToken ct = {t->type, NO_TEXT, NO_TEXT, t->line, t->column};
+
+        if (t->span.ptr != NULL) {
+            ct.start = t->span.ptr - src;
+            ct.end = t->span.end - src;
+        }
+
+        fwrite(&ct, sizeof(ct), 1, f);
+    }
+
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        fwrite(ast->nodes[type].ptr, ast_node_size(type), ast->nodes[type].size, f);
+    }
+
+    fwrite(ast->defs, sizeof(SymbolDef), ast->ndefs, f);
+    fwrite(ast->uses, sizeof(SymbolUse), ast->nuses, f);
+
+    bool failed = ferror(f);
+    if (fclose(f) != 0 || failed || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "render: cannot write cache %s\n", path);
+        remove(tmp_path);
+    }
+}
+
+void ast_cache_close(CachedAst *cached) {
+    munmap(cached->map, cached->size);
+    free(cached);
+}
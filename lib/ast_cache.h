@@ -0,0 +1,20 @@
+#ifndef ZHABA_AST_CACHE_H
+#define ZHABA_AST_CACHE_H
+
+#include "parser.h"
+
+// A parse read back from the cache. Its nodes and symbols are used in place from a mapping of the file,
+// the tokens are made again over the source it was looked up with.
+typedef struct {
+    Ast ast;
+    int nlines;
+    byte *map;
+    size_t size;
+} CachedAst;
+
+void ast_cache_dir_set(char *dir);
+CachedAst *ast_cache_load(byte *src, size_t len);
+void ast_cache_store(byte *src, size_t len, int nlines, Ast *);
+void ast_cache_close(CachedAst *);
+
+#endif //ZHABA_AST_CACHE_H
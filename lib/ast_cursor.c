@@ -0,0 +1,89 @@
+#include "ast_cursor.h"
+#include <assert.h>
+#include <stdlib.h>
+
+static CursorFrame *push(AstCursor *c, NodeRef node, TokenRef pos) {
+    if (c->depth == c->cap) {
+        c->cap = c->cap == 0 ? 16 : c->cap * 2;
+        c->stack = realloc(c->stack, c->cap * sizeof(CursorFrame));
+        assert(c->stack);
+    }
+
+    CursorFrame *f = &c->stack[c->depth++];
+    *f = (CursorFrame) {node, 0, 0, pos};
+    return f;
+}
+
+static bool tokens(AstCursor *c, CursorFrame *f, TokenRef to) {
+    c->event = CURSOR_TOKENS;
+    c->node = f->node;
+    c->parent = c->depth > 1 ? c->stack[c->depth - 2].node : 0;
+    c->from = f->pos;
+    c->to = to;
+    f->pos = to;
+    return true;
+}
+
+void cursor_init(AstCursor *c, Ast *ast, NodeRef first) {
+    *c = (AstCursor) {0};
+    c->ast = ast;
+    push(c, 0, NO_TOKEN)->child = first;
+}
+
+// The next event, false when the list is done
+bool cursor_next(AstCursor *c) {
+    if (c->entered) {
+        c->entered = false;
+        push(c, c->node, ast_header(c->ast, c->node)->start_token);
+    }
+
+    CursorFrame *f = &c->stack[c->depth - 1];
+
+    if (f->child == 0 && f->node != 0) {
+        const uint8_t *fields = ast_ref_fields(NODE_REF_TYPE(f->node));
+        uint8_t *node = ast_node(c->ast, f->node);
+
+        while (f->child == 0 && fields[f->field] != 0) {
+            f->child = *(NodeRef *) (node + fields[f->field++]);
+        }
+    }
+
+    if (f->child != 0) {
+        NodeHeader *child = ast_header(c->ast, f->child);
+        if (f->pos != NO_TOKEN && f->pos < child->start_token) return tokens(c, f, child->start_token);
+
+        c->event = CURSOR_ENTER;
+        c->node = f->child;
+        c->parent = f->node;
+        c->entered = true;
+        f->pos = child->end_token;
+        f->child = child->next;
+        return true;
+    }
+
+    if (f->node == 0) return false;
+
+    TokenRef end = ast_header(c->ast, f->node)->end_token;
+    if (f->pos < end) return tokens(c, f, end);
+
+    c->depth--;
+    c->event = CURSOR_EXIT;
+    c->node = f->node;
+    c->parent = c->stack[c->depth - 1].node;
+    return true;
+}
+
+// Right after CURSOR_ENTER: goes on with the exit of the node, for a renderer that wrote it whole
+void cursor_skip(AstCursor *c) {
+    assert(c->entered);
+    c->entered = false;
+
+    CursorFrame *f = push(c, c->node, ast_header(c->ast, c->node)->end_token);
+    const uint8_t *fields = ast_ref_fields(NODE_REF_TYPE(f->node));
+    while (fields[f->field] != 0) f->field++;
+}
+
+void cursor_free(AstCursor *c) {
+    free(c->stack);
+    *c = (AstCursor) {0};
+}
@@ -0,0 +1,41 @@
+#ifndef ZHABA_AST_CURSOR_H
+#define ZHABA_AST_CURSOR_H
+
+#include "parser.h"
+
+typedef enum {
+    CURSOR_ENTER,  // node starts, its children and tokens follow unless cursor_skip()
+    CURSOR_TOKENS, // from..to of node not covered by any of its children
+    CURSOR_EXIT,   // node is done
+} CursorEvent;
+
+typedef struct {
+    NodeRef node;
+    uint8_t field;   // Next of its ref fields to look at
+    NodeRef child;   // Next in the list of the field looked at last
+    TokenRef pos;    // Up to where the tokens are given out
+} CursorFrame;
+
+// Walks a list of nodes and everything under them depth first in source order with a stack of its own,
+// so nothing recurses however deep the tree is. Between the nodes of the list itself no tokens are given
+// out before the first or after the last, there is no parent to hold them.
+typedef struct {
+    Ast *ast;
+    CursorFrame *stack;
+    uint32_t depth;
+    uint32_t cap;
+    bool entered; // The last event entered node, whose frame is pushed on the next call
+
+    CursorEvent event;
+    NodeRef node;   // 0 for the tokens between the nodes of the list
+    NodeRef parent; // Holding node, 0 for the list walked
+    TokenRef from;
+    TokenRef to;
+} AstCursor;
+
+void cursor_init(AstCursor *, Ast *, NodeRef first);
+bool cursor_next(AstCursor *);
+void cursor_skip(AstCursor *);
+void cursor_free(AstCursor *);
+
+#endif //ZHABA_AST_CURSOR_H
@@ -9,9 +9,10 @@
 #include <string.h>
 #include <sys/stat.h>
 
-static void *pool_base;
-static void *pool_current;
-static size_t pool_size;
+// Every thread has its own pool, set up with pool_init()
+static _Thread_local void *pool_base;
+static _Thread_local void *pool_current;
+static _Thread_local size_t pool_size;
 
 int pool_init(size_t size) {
     pool_size = size;
@@ -49,6 +50,17 @@ char *pool_alloc_copy_str(char *str) {
     return as;
 }
 
+uint hash(Span key, size_t tsize) {
+    uint hash = 2166136261;
+
+    for (byte *cp = key.ptr; cp < key.end; cp++) {
+        hash ^= (uint)(*cp);
+        hash *= 16777619;
+    }
+
+    return hash % tsize;
+}
+
 int binsearchs(char *target, char *arr[], size_t size) {
     int low = 0;
     int high = size - 1;
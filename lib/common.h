@@ -18,6 +18,7 @@ int binsearchs(char *target, char *arr[], size_t size);
 int binsearchi(int target, int arr[], size_t size);
 int spanstrcmp(Span sp, char *str);
 int spancmp(Span sp1, Span sp2);
+uint hash(Span key, size_t tsize);
 
 int pool_init(size_t);
 void pool_close();
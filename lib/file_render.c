@@ -1,5 +1,5 @@
-#include <assert.h>
 #include <stdio.h>
+#include "ast_cursor.h"
 #include "parser.h"
 
 typedef enum {
@@ -23,101 +23,46 @@ static void colored(Span sp, SyntaxColor color, FILE *file) {
     fprintf(file, "\x1b[0m");
 }
 
-static void colored_token_span(Token *tokenp, Token *end_token, SyntaxColor color, FILE *file) {
+static void colored_token_span(Ast *ast, TokenRef tokenp, TokenRef end_token, SyntaxColor color, FILE *file) {
     for (; tokenp < end_token; tokenp++) {
-        colored(tokenp->span, color, file);
+        colored(ast_token(ast, tokenp)->span, color, file);
     }
 }
 
-static void print_ws(Token *token, FILE *file) {
-    for (; token != NULL && token->type == WHITESPACE_TOKEN; token = token->next) {
-        colored(token->span, NO_COLOR, file);
+// The color of a token given out by the cursor as its node's own
+static SyntaxColor token_color(Ast *ast, AstCursor *c, TokenRef t) {
+    if (c->node == 0) return NO_COLOR;
+    if (ast_token(ast, t)->type == KEYWORD_TOKEN) return KEYWORD_COLOR;
+
+    NodeHeader *node = ast_header(ast, c->node);
+
+    switch (NODE_REF_TYPE(c->node)) {
+        case INCLUDE_DIRECTIVE:
+        case DEFINE_DIRECTIVE:
+        case PREP_DIRECTIVE: return t == node->start_token ? PREP_INST_COLOR : NO_COLOR;
+        case FUNC_SIGNATURE: return t == ((FuncSignature *) node)->name ? FUNC_NAME_DEF_COLOR : NO_COLOR;
+        case STRING_LITERAL: return STR_LIT_COLOR;
+        case INT_LITERAL: return NUM_LIT_COLOR;
+        default: return NO_COLOR;
     }
 }
 
-static void print_ws_after(Token *token, FILE *file) {
-    for (token = token->next; token != NULL && token->type == WHITESPACE_TOKEN; token = token->next) {
-        colored(token->span, NO_COLOR, file);
-    }
-}
-
-static void render_statement_expr(NodeHeader *st, FILE *file) {
-    switch (st->type) {
-        case FUNC_INVOKE: {
-            FuncInvoke *invoke = (FuncInvoke*) st;
-            colored(invoke->name->span, DEFAULT_COLOR, file);
-            colored_token_span(invoke->name->next, invoke->last_arg->start_token, NO_COLOR, file);
-
-            NodeHeader *last_arg = NULL;
-            for (NodeHeader *arg = invoke->last_arg; arg != NULL; arg = arg->next) {
-                render_statement_expr(arg, file);
-                if (arg->next != NULL) {
-                    colored_token_span(arg->end_token, arg->next->start_token, NO_COLOR, file);
-                }
-                last_arg = arg;
-            }
-
-            if (last_arg != NULL) { // TODO: Handle no args
-                colored_token_span(last_arg->end_token, invoke->header.end_token, NO_COLOR, file);
-            }
-        } break;
-        case RETURN_STATEMENT: {
-            ReturnStatement *ret = (ReturnStatement*) st;
-            colored(ret->header.start_token->span, KEYWORD_COLOR, file);
-            print_ws_after(ret->header.start_token, file);
-            render_statement_expr(ret->expr, file);
-        } break;
-        case STRING_LITERAL: {
-            StringLiteral *literal = (StringLiteral*) st;
-            colored(literal->str->span, STR_LIT_COLOR, file);
-        } break;
-        case INT_LITERAL: {
-            IntLiteral *literal = (IntLiteral*) st;
-            colored(literal->num->span, NUM_LIT_COLOR, file);
-        } break;
-        default: {
-            assert(0);
-        } break;
-    }
-
-    if (st->next != NULL) {
-        colored_token_span(st->end_token, st->next->start_token, NO_COLOR, file);
-    }
-}
-
-void render_file(NodeHeader *node, FILE *file) {
-    NodeHeader *last_node = node;
-
-    while (node != NULL) {
-        if (node->type == INCLUDE_DIRECTIVE) {
-            Include *inc = (Include *) node;
-            colored(inc->header.start_token->span, PREP_INST_COLOR, file);
-            print_ws_after(inc->header.start_token, file);
-            // colored(inc->name->span, STR_LIT_COLOR, file);
-            // print_ws_after(inc->name, file);
-        } else if (node->type == FUNC_DEF) {
-            FuncDef *def = (FuncDef *) node;
-            DataType *return_type = def->signature->return_type;
-            colored_token_span(return_type->start_token, return_type->end_token, KEYWORD_COLOR, file);
-            print_ws(return_type->end_token, file);
-            colored(def->signature->name->span, FUNC_NAME_DEF_COLOR, file);
-            colored_token_span(def->signature->name->next, def->last_stmt->start_token, NO_COLOR, file);
-
-            NodeHeader *st, *last = NULL;
+void render_file(Ast *ast, FILE *file) {
+    AstCursor c;
+    NodeRef last = 0;
+    cursor_init(&c, ast, ast->first_element);
 
-            for (st = def->last_stmt; st != NULL; st = st->next) {
-                render_statement_expr(st, file);
-                last = st;
-            }
-
-            if (last != NULL) {
-                colored_token_span(last->end_token, def->header.end_token, NO_COLOR, file);
-            }
+    while (cursor_next(&c)) {
+        if (c.event == CURSOR_TOKENS) {
+            for (TokenRef t = c.from; t != c.to; t++) colored(ast_token(ast, t)->span, token_color(ast, &c, t), file);
+        } else if (c.event == CURSOR_EXIT && c.parent == 0) {
+            last = c.node;
         }
-
-        last_node = node;
-        node = node->next;
     }
 
-    colored_token_span(last_node->end_token, last_node->end_token->next, NO_COLOR, file);
-}
\ No newline at end of file
+    cursor_free(&c);
+    if (last == 0) return;
+
+    TokenRef end = ast_header(ast, last)->end_token;
+    colored_token_span(ast, end, end + 1, NO_COLOR, file);
+}
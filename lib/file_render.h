@@ -2,8 +2,8 @@
 #define ZHABA_FILE_RENDER_H
 
 #include <stdio.h>
-#include "../parser.h"
+#include "parser.h"
 
-void render_file(NodeHeader *, FILE *);
+void render_file(Ast *, FILE *);
 
 #endif //ZHABA_FILE_RENDER_H
\ No newline at end of file
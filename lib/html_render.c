@@ -1,15 +1,19 @@
 #include <assert.h>
 #include <stdio.h>
+#include "ast_cursor.h"
 #include "parser.h"
 #include "html_writer.h"
-
-static void write_serial(HtmlHandle *html, NodeHeader *last);
-static void write_params(HtmlHandle *html, Declaration *last_param);
-static void write_decl(HtmlHandle *html, Declaration *decl, bool is_struct_member);
-static void write_statement(HtmlHandle *html, NodeHeader *st);
-static void write_member_decls(HtmlHandle *html, Declaration *last_decl);
-static void write_func_sign(HtmlHandle *html, NodeHeader *node);
-static void write_data_type(HtmlHandle *html, DataType *dt);
+#include "symbols.h"
+
+// What the writers below work with: the output and the tree it renders, with how far the tokens
+// written have got in the symbols
+typedef struct {
+    HtmlHandle *html;
+    Ast *ast;
+    SymbolIndex *symbols;
+    uint32_t def;
+    uint32_t use;
+} Render;
 
 static void write_head(HtmlHandle *html, char *filename) {
     html_open_tag(html, "head");
@@ -43,350 +47,189 @@ static void write_head(HtmlHandle *html, char *filename) {
     html_close_tag(html);
 }
 
-static void write_ws_after(HtmlHandle *html, Token *token) {
-    for (token = token->next; token != NULL && token->type == WHITESPACE_TOKEN; token = token->next) {
-        html_write_token(html, token);
-    }
-}
+#define NODE(r, type, ref) ((type *) ast_node((r)->ast, (ref)))
+#define HEADER(r, ref) ast_header((r)->ast, (ref))
 
-static void write_ws(HtmlHandle *html, Token *token) {
-    for (; token != NULL && token->type == WHITESPACE_TOKEN; token = token->next) {
-        html_write_token(html, token);
-    }
+static Token *token(Render *r, TokenRef ref) {
+    return ast_token(r->ast, ref);
 }
 
-static void write_token_span(HtmlHandle *html, Token *tokenp, Token *end_token) {
-    for (; tokenp != end_token; tokenp = tokenp->next) {
-        html_write_token(html, tokenp);
-    }
+static void write_token(Render *r, TokenRef ref) {
+    html_write_token(r->html, token(r, ref));
 }
 
-static void write_tokenc(HtmlHandle *html, Token *token, char *class) {
-    html_open_tag(html, "span");
-        html_add_attr(html, "class", class);
-        html_write_token(html, token);
-    html_close_tag(html);
-}
-
-static void write_token_spanc(HtmlHandle *html, Token *tokenp, Token *end_token, char *class) {
-    html_open_tag(html, "span");
-    for (; tokenp != end_token; tokenp = tokenp->next) {
-        html_add_attr(html, "class", class);
-        html_write_token(html, tokenp);
+static void write_token_span(Render *r, TokenRef ref, TokenRef end_token) {
+    for (; ref != end_token; ref++) {
+        write_token(r, ref);
     }
-    html_close_tag(html);
 }
 
-static void write_params(HtmlHandle *html, Declaration *last_param) {
-    NodeHeader *head = last_param->header.next;
-    NodeHeader *param = head;
-
-    for (param = param->next; param != head; param = param->next) {
-        write_decl(html, (Declaration *)param, false);
-        if (param->next != head) write_token_span(html, param->end_token, param->next->start_token);
-    }
+static void write_tokenc(Render *r, TokenRef ref, char *class) {
+    html_open_tag(r->html, "span");
+        html_add_attr(r->html, "class", class);
+        write_token(r, ref);
+    html_close_tag(r->html);
 }
 
-static void write_decl(HtmlHandle *html, Declaration *decl, bool is_struct_member) {
-    if (decl->var_arg) {
-        write_token_span(html, decl->header.start_token, decl->header.end_token);
-        return;
-    }
-
-    write_data_type(html, decl->data_type);
-
-    write_ws(html, decl->data_type->end_token);
-
-    if (is_struct_member) {
-        write_tokenc(html, decl->id, "member");
-    } else {
-        html_write_token(html, decl->id);
-    }
-
-
-    write_ws_after(html, decl->id);
-
-    if (decl->assign != NULL) {
-        html_write_token(html, decl->assign->equal_sign);
-        write_ws_after(html, decl->assign->equal_sign);
-        write_statement(html, decl->assign->expr);
-    }
-}
-
-static void write_member_decls(HtmlHandle *html, Declaration *last_decl) {
-    NodeHeader *head = last_decl->header.next;
-    NodeHeader *param = head;
-
-    for (param = param->next; param != head; param = param->next) {
-        write_decl(html, (Declaration *) param, true);
-        if (param->next != head) write_token_span(html, param->end_token, param->next->start_token);
-    }
-}
-
-static void write_data_type(HtmlHandle *html, DataType *dt) {
-    for (Token *t = dt->start_token; t != dt->end_token; t = t->next) {
-        if (t->type == KEYWORD_TOKEN) {
-            write_tokenc(html, t, "keyword");
-        } else if (t == dt->struct_id || t == dt->typedef_id) {
-            write_tokenc(html, t, "typename");
-        } else {
-            html_write_token(html, t);
-        }
-    }
-}
-
-static void write_func_sign(HtmlHandle *html, NodeHeader *node) {
-    FuncDecl *decl = (FuncDecl *) node;
-    DataType *return_type = decl->signature->return_type;
-    write_token_spanc(html, return_type->start_token, return_type->end_token, "keyword");
-    write_ws(html, return_type->end_token);
-    write_token_spanc(html, decl->signature->name, decl->signature->name->next, "func-name");
-    Declaration *last_param = decl->signature->last_param;
-    Declaration *head_param = (Declaration *) last_param->header.next;
-    write_token_span(html, decl->signature->name->next, head_param->header.next->start_token);
-
-    write_params(html, last_param);
-    write_token_span(html, decl->signature->last_param->header.end_token, decl->signature->header.end_token);
-}
-
-static void write_serial(HtmlHandle *html, NodeHeader *last) {
-    NodeHeader *head = last->next;
-    NodeHeader *st = head;
-
-    for (st = st->next; st != head; st = st->next) {
-        write_statement(html, st);
-        if (st->next != head) write_token_span(html, st->end_token, st->next->start_token);
-    }
-}
-
-static void write_statement(HtmlHandle *html, NodeHeader *st) {
-    switch (st->type) {
-        case FUNC_INVOKE: {
-            FuncInvoke *invoke = (FuncInvoke*) st;
-            NodeHeader *head_arg = invoke->last_arg->next;
-            write_token_span(html, invoke->name, head_arg->start_token);
-            write_serial(html, invoke->last_arg);
-            write_token_span(html, invoke->last_arg->end_token, invoke->header.end_token);
-        } break;
-        case RETURN_STATEMENT: {
-            ReturnStatement *ret = (ReturnStatement*) st;
-            write_token_spanc(html, ret->header.start_token, ret->header.start_token->next, "keyword");
-            write_ws_after(html, ret->header.start_token);
-            write_statement(html, ret->expr);
-        } break;
-        case STRING_LITERAL: {
-            StringLiteral *literal = (StringLiteral*) st;
-            write_token_spanc(html, literal->str, literal->str->next, "str");
-        } break;
-        case INT_LITERAL: {
-            IntLiteral *literal = (IntLiteral*) st;
-            write_token_spanc(html, literal->num, literal->num->next, "num");
-        } break;
-        case DECLARATION: {
-            write_decl(html, (Declaration *) st, false);
-        } break;
-        case IF_STATEMENT: {
-            IfStatement *ifst = (IfStatement *) st;
-            write_token_spanc(html, ifst->header.start_token, ifst->header.start_token->next, "keyword");
-            write_token_span(html, ifst->header.start_token->next, ifst->cond->start_token);
-            write_statement(html, ifst->cond);
-
-            write_token_span(html, ifst->cond->end_token, ifst->then_statement->next->start_token);
-            write_serial(html, ifst->then_statement);
+// The class of a token given out by the cursor as its node's own, NULL for none
+static char *token_class(Render *r, AstCursor *c, TokenRef t) {
+    if (c->node == 0) return NULL; // Between the nodes of the list
 
-            write_token_span(html, ifst->then_statement->end_token, ifst->else_token ? ifst->else_token : ifst->header.end_token);
+    NodeHeader *node = HEADER(r, c->node);
+    TokenType type = token(r, t)->type;
+    bool first = t == node->start_token;
 
-            if (ifst->else_token) {
-                write_token_spanc(html, ifst->else_token, ifst->else_token->next, "keyword");
-                write_token_span(html, ifst->else_token->next, ifst->else_statement->start_token);
-                write_serial(html, ifst->else_statement);
-                write_token_span(html, ifst->else_statement->end_token, ifst->header.end_token);
-            }
+    switch (NODE_REF_TYPE(c->node)) {
+        case INCLUDE_DIRECTIVE: {
+            if (first) return "prep";
+            if (t == ((Include *) node)->pathOrHeader) return "str";
         } break;
-        case UNARY_OP: {
-            UnaryOp *op = (UnaryOp *) st;
-            write_token_span(html, op->header.start_token, op->expr->start_token);
-            write_statement(html, op->expr);
+        case DEFINE_DIRECTIVE: {
+            if (first) return "prep";
+            if (t == ((Define *) node)->id) return "prepid";
         } break;
-        case BINARY_OP: {
-            BinaryOp *op = (BinaryOp *) st;
-            write_statement(html, op->lhs);
-            write_token_span(html, op->lhs->end_token, op->rhs->start_token);
-            write_statement(html, op->rhs);
+        case PREP_DIRECTIVE: {
+            if (first) return "prep";
         } break;
-        case VAR_REFERENCE: {
-            VarReference *ref = (VarReference *) st;
-            write_token_span(html, ref->id, ref->id->next);
+        case FUNC_SIGNATURE: {
+            if (t == ((FuncSignature *) node)->name) return "func-name";
         } break;
-        case DEFINE_REFERENCE: {
-            DefineReference *ref = (DefineReference *) st;
-            write_token_spanc(html, ref->header.start_token, ref->header.end_token, "prepid");
+        case STRUCT_DECL: {
+            if (first) return "keyword";
+            if (t == ((StructDecl *) node)->id) return "typename";
         } break;
-        case ARRAY_ACCESS: {
-            ArrAccess *access = (ArrAccess *) st;
-            write_token_span(html, access->id, access->id->next);
-            write_token_span(html, access->id->next, access->index_expr->start_token);
-            write_statement(html, access->index_expr);
-            write_token_span(html, access->index_expr->end_token, access->header.end_token);
+        case TYPEDEF_DECL: {
+            if (first) return "keyword";
+            if (t == ((TypedefDecl *) node)->id) return "typename";
         } break;
-        case GOTO_STATEMENT: {
-            GotoStatement *got = (GotoStatement *) st;
-            write_tokenc(html, got->header.start_token, "keyword");
-            write_token_span(html, got->header.start_token->next, got->header.end_token);
+        case DECLARATION: {
+            Declaration *decl = (Declaration *) node;
+            if (!decl->var_arg && t == decl->id && NODE_REF_TYPE(c->parent) == STRUCT_DECL) return "member";
         } break;
-        case LABEL_DECL: {
-            write_token_span(html, st->start_token, st->end_token);
+        case DATA_TYPE: {
+            if (type == KEYWORD_TOKEN) return "keyword";
+            if (t == ((DataType *) node)->name) return "typename";
         } break;
-        case STRUCT_INIT: {
-            StructInit *init = (StructInit *) st;
-            NodeHeader *head = init->last_expr->next;
-
-            for (Token *t = st->start_token; t != head->start_token; t = t->next) {
-                if (t->type == OPEN_CURLY_TOKEN) {
-                    write_tokenc(html, t, "init");
-                } else {
-                    html_write_token(html, t);
-                }
-            }
-
-            write_serial(html, init->last_expr);
-            for (Token *t = init->last_expr->end_token; t != st->end_token; t = t->next) {
-                if (t->type == CLOSE_CURLY_TOKEN) {
-                    write_tokenc(html, t, "init");
-                } else {
-                    html_write_token(html, t);
-                }
-            }
+        case UNARY_OP: {
+            if (t == ((UnaryOp *) node)->op && type == KEYWORD_TOKEN) return "keyword";
         } break;
         case MEMBER_ACCESS: {
-            MemberAccess *op = (MemberAccess *) st;
-            write_token_span(html, op->lhs->start_token, op->member);
-            write_tokenc(html, op->member, "member");
+            if (t == ((MemberAccess *) node)->member) return "member";
         } break;
-        case LINE_COMMENT:
-        case MULTI_COMMENT: {
-            write_token_spanc(html, st->start_token, st->end_token, "comment");
+        case STRUCT_INIT: {
+            if (type == OPEN_CURLY_TOKEN || type == CLOSE_CURLY_TOKEN) return "init";
         } break;
-        case ASSIGNMENT: {
-            Assignment *assign = (Assignment *) st;
-            write_token_span(html, st->start_token, assign->expr->start_token);
-            write_statement(html, assign->expr);
+        case IF_STATEMENT: {
+            if (first || t == ((IfStatement *) node)->else_token) return "keyword";
         } break;
-        case BREAK_STATEMENT: {
-            write_token_spanc(html, st->start_token, st->end_token, "keyword");
+        case SWITCH_BLOCK: {
+            if (first) return "keyword";
+            if (t == ((SwitchBlock *) node)->label_token && type == NUM_LITERAL_TOKEN) return "num";
         } break;
+        case RETURN_STATEMENT:
+        case GOTO_STATEMENT:
         case SWITCH_STATEMENT: {
-            SwitchStatement *swtch = (SwitchStatement *) st;
-            write_tokenc(html, st->start_token, "keyword");
-            write_token_span(html, st->start_token->next, swtch->expr->start_token);
-            write_statement(html, swtch->expr);
-
-            NodeHeader *head_block = swtch->last_block->header.next;
-            write_token_span(html, swtch->expr->end_token, head_block->start_token);
-
-            NodeHeader *block = head_block;
+            if (first) return "keyword";
+        } break;
+        case BREAK_STATEMENT: return "keyword";
+        case STRING_LITERAL: return "str";
+        case INT_LITERAL: return "num";
+        case DEFINE_REFERENCE: return "prepid";
+        case LINE_COMMENT:
+        case MULTI_COMMENT: return "comment";
+        default: break;
+    }
 
-            for (block = block->next; block != head_block; block = block->next) {
-                write_tokenc(html, block->start_token, "keyword");
-                SwitchBlock *blk = (SwitchBlock *) block;
-                if (blk->label_token != NULL) write_token_span(html, block->start_token->next, blk->label_token);
+    return NULL;
+}
 
-                if (blk->label_token != NULL) {
-                    if (blk->label_token->type == NUM_LITERAL_TOKEN) {
-                        write_tokenc(html, blk->label_token, "num");
-                    } else {
-                        html_write_token(html, blk->label_token);
-                    }
-                }
+// An identifier no node gives a class to by the kind of symbol it declares or refers to
+static char *symbol_classes[] = {
+    [VARIABLE_SYMBOL] = "local",
+    [GLOBAL_SYMBOL] = "global",
+    [PARAM_SYMBOL] = "param",
+    [FUNCTION_SYMBOL] = "func-name",
+    [TYPEDEF_SYMBOL] = "typename",
+    [STRUCT_SYMBOL] = "typename",
+    [LABEL_SYMBOL] = "label",
+    [MACRO_SYMBOL] = "prepid",
+};
+
+// A declared identifier as an anchor, one resolved to a declaration as a link to it, classed by the symbol
+// unless plain. The tokens come in source order, so the symbols are gone through once.
+static void write_symbol_token(Render *r, TokenRef t, char *class, bool plain) {
+    SymbolIndex *symbols = r->symbols;
+    while (r->def < symbols->ndefs && symbols->defs[r->def].token < t) r->def++;
+    while (r->use < symbols->nuses && symbols->uses[r->use].token < t) r->use++;
+
+    bool def = r->def < symbols->ndefs && symbols->defs[r->def].token == t;
+    bool use = r->use < symbols->nuses && symbols->uses[r->use].token == t;
+    char anchor[16];
+
+    if (class == NULL && !plain && (def || use)) {
+        SymbolDef *symbol = &symbols->defs[def ? r->def : symbols->use_defs[r->use]];
+        class = symbol_classes[symbol->kind];
+    }
 
-                NodeHeader *head_s = blk->last_stmt->next;
-                NodeHeader *s = head_s;
-                Token *token_before = blk->colon_token;
+    if (def) {
+        snprintf(anchor, sizeof(anchor), "s%u", t);
+        html_open_tag(r->html, "a");
+        html_add_attr(r->html, "id", anchor);
+    } else if (use) {
+        snprintf(anchor, sizeof(anchor), "#s%u", symbols->uses[r->use].def);
+        html_open_tag(r->html, "a");
+        html_add_attr(r->html, "href", anchor);
+    }
 
-                for (s = s->next; s != head_s; s = s->next) {
-                    write_token_span(html, token_before, s->start_token);
-                    write_statement(html, s);
-                    token_before = s->end_token;
-                }
+    if (class != NULL) write_tokenc(r, t, class);
+    else write_token(r, t);
 
-                write_token_span(html, token_before, block->next != head_block ? block->next->start_token : st->end_token);
-            }
-        } break;
-        case TYPE_CAST: {
-            TypeCast *cast = (TypeCast *) st;
-            write_token_span(html, st->start_token, cast->data_type->start_token);
-            write_data_type(html, cast->data_type);
-            write_token_span(html, cast->data_type->end_token, cast->expr->start_token);
-            write_statement(html, cast->expr);
-            write_token_span(html, cast->expr->end_token, st->end_token);
-        } break;
-        default: {
-            assert(0);
-        } break;
-    }
+    if (def || use) html_close_tag(r->html);
 }
 
-static void write_code(HtmlHandle *html, NodeHeader *node) {
-    NodeHeader *prev_node = node;
+static bool is_return_type(Render *r, AstCursor *c) {
+    return NODE_REF_TYPE(c->parent) == FUNC_SIGNATURE && c->node == NODE(r, FuncSignature, c->parent)->return_type;
+}
 
-    while (node != NULL) {
-        switch (node->type) {
-            case INCLUDE_DIRECTIVE: {
-                Include *inc = (Include *) node;
-                write_token_spanc(html, inc->header.start_token, inc->header.start_token->next, "prep");
-                write_ws_after(html, inc->header.start_token);
-                write_token_spanc(html, inc->pathOrHeader, inc->pathOrHeader->next, "str");
-            } break;
-            case DEFINE_DIRECTIVE: {
-                Define *def = (Define *) node;
-                write_token_spanc(html, def->header.start_token, def->header.start_token->next, "prep");
-                write_ws_after(html, def->header.start_token);
-                write_token_spanc(html, def->id, def->id->next, "prepid");
-                write_ws_after(html, def->id);
-                write_statement(html, def->expr);
-            } break;
-            case FUNC_DECL: {
-                write_func_sign(html, node);
+// The tokens between the nodes of the list too, and the one that follows the last
+static void write_code(Render *r, NodeRef first) {
+    AstCursor c;
+    NodeRef last = 0;
+    cursor_init(&c, r->ast, first);
+
+    while (cursor_next(&c)) {
+        switch (c.event) {
+            case CURSOR_ENTER: {
+                // A return type is one span, the keywords in it are not told apart
+                if (is_return_type(r, &c)) {
+                    html_open_tag(r->html, "span");
+                    html_add_attr(r->html, "class", "keyword");
+                }
             } break;
-            case FUNC_DEF: {
-                FuncDef *def = (FuncDef *) node;
-                write_func_sign(html, node);
+            case CURSOR_TOKENS: {
+                bool return_type = is_return_type(r, &c);
 
-                write_token_span(html, def->signature->header.end_token, def->last_stmt->next->start_token);
-
-                write_serial(html, def->last_stmt);
-                write_token_span(html, def->last_stmt->end_token, def->header.end_token);
-            } break;
-            case STRUCT_DECL: {
-                StructDecl *decl = (StructDecl *) node;
-                write_tokenc(html, node->start_token, "keyword");
-                write_ws_after(html, node->start_token);
-                NodeHeader *head_decl = decl->last_decl->header.next;
-                write_tokenc(html, decl->id, "typename");
-                write_token_span(html, decl->id->next, head_decl->start_token);
-                write_member_decls(html, decl->last_decl);
-                write_token_span(html, decl->last_decl->header.end_token, node->end_token);
-            } break;
-            case LINE_COMMENT:
-            case MULTI_COMMENT: {
-                write_token_spanc(html, node->start_token, node->end_token, "comment");
+                for (TokenRef t = c.from; t != c.to; t++) {
+                    write_symbol_token(r, t, return_type ? NULL : token_class(r, &c, t), return_type);
+                }
             } break;
-            default: {
-                assert(0);
+            case CURSOR_EXIT: {
+                if (is_return_type(r, &c)) html_close_tag(r->html);
+                if (c.parent == 0) last = c.node;
             } break;
         }
-
-        prev_node = node;
-        node = node->next;
-
-        if (node != NULL) write_token_span(html, prev_node->end_token, node->start_token);
     }
 
-    write_token_span(html, prev_node->end_token, prev_node->end_token->next);
+    cursor_free(&c);
+    if (last == 0) return;
+
+    TokenRef end = HEADER(r, last)->end_token;
+    if (end < r->ast->ntokens) write_token_span(r, end, end + 1);
 }
 
-void gen_html(NodeHeader *node, char *filename, int nlines, FILE *filep) {
+void gen_html(Ast *ast, char *filename, int nlines, FILE *filep) {
     HtmlHandle *html = html_new(filep);
+    Render r = {html, ast, symbols_index(ast)};
 
     html_add_doctype(html);
     html_open_tag(html, "html");
@@ -399,18 +242,19 @@ void gen_html(NodeHeader *node, char *filename, int nlines, FILE *filep) {
                 html_open_tag(html, "div");
                     html_add_attr(html, "class", "panel");
                     for (int i = 1; i <= nlines; i++) {
-                        html_write_textf(html, "%d", i);
+                        html_write_uint(html, i);
                         html_open_tag(html, "br");
                         html_close_tag(html);
                     }
                 html_close_tag(html);
                 html_open_tag(html, "div");
                     html_add_attr(html, "class", "source");
-                    write_code(html, node);
+                    write_code(&r, ast->first_element);
                 html_close_tag(html);
             html_close_tag(html);
         html_close_tag(html);
     html_close_tag(html);
 
     html_close(html);
+    symbols_free(r.symbols);
 }
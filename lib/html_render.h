@@ -4,6 +4,6 @@
 #include <stdio.h>
 #include "parser.h"
 
-void gen_html(NodeHeader *node, char *filename, int nlines, FILE *);
+void gen_html(Ast *ast, char *filename, int nlines, FILE *);
 
 #endif //ZHABA_HTML_RENDER_H
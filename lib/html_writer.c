@@ -1,8 +1,13 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
+#include <sys/uio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 #include "lexer.h"
@@ -13,28 +18,76 @@ static char *no_close_tags[] = {
 
 #define NO_CLOSE_TAGS_SIZE (sizeof(no_close_tags) / sizeof(no_close_tags[0]))
 
-typedef struct attr {
-    char *name;
-    char *value;
-    bool isflag;
-    struct attr *next;
-} Attr;
-
+// The open tag is written as far as its attributes go until something comes in it, then closed with '>'.
+// Only the name is kept, to close the tag with.
 typedef struct {
-    char *name;
-    Attr *tail_attr;
+    const char *name;
+    bool no_close;
     bool open_tag_written;
 } Tag;
 
+#define MAX_DEPTH 32
+
+// Output goes into buf and out with write calls of its own, stdio only for a stream with no descriptor
+#define OUT_BUF_SIZE (64 * 1024)
+
 struct HtmlHandle {
     FILE *filep;
-    Tag *stack;
-    size_t stack_size;
+    int fd;
+    size_t len;
     Tag *stack_top;
+    Tag stack[MAX_DEPTH];
+    char buf[OUT_BUF_SIZE];
 };
 
+// Writes out the buffer and then size bytes of data, in one call if the descriptor takes it all
+static void flush(struct HtmlHandle *h, const char *data, size_t size) {
+    struct iovec iov[2] = {{h->buf, h->len}, {(void *) data, size}};
+    struct iovec *v = iov;
+    int nv = size > 0 ? 2 : 1;
+
+    if (h->fd < 0) {
+        fwrite(h->buf, 1, h->len, h->filep);
+        fwrite(data, 1, size, h->filep);
+        nv = 0;
+    }
+
+    while (nv > 0) {
+        ssize_t n = writev(h->fd, v, nv);
+        if (n < 0) {
+            fprintf(stderr, "Could not write the html\n");
+            break;
+        }
+
+        for (; nv > 0 && (size_t) n >= v->iov_len; v++, nv--) n -= v->iov_len;
+
+        if (nv > 0) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    h->len = 0;
+}
+
+static inline void put(struct HtmlHandle *h, const char *data, size_t size) {
+    if (h->len + size > OUT_BUF_SIZE) {
+        flush(h, data, size);
+        return;
+    }
+
+    memcpy(h->buf + h->len, data, size);
+    h->len += size;
+}
+
+static inline void put_str(struct HtmlHandle *h, const char *str) {
+    put(h, str, strlen(str));
+}
+
+#define put_lit(h, lit) put((h), (lit), sizeof(lit) - 1)
+
 static Tag *push(struct HtmlHandle *h) {
-    assert(h->stack_top < h->stack + h->stack_size);
+    assert(h->stack_top < h->stack + MAX_DEPTH);
     return h->stack_top++;
 }
 
@@ -42,66 +95,49 @@ static Tag *peek(struct HtmlHandle *h) {
     assert(h->stack_top > h->stack);
     return h->stack_top - 1;
 }
+
 static Tag *pop(struct HtmlHandle *h) {
     assert(h->stack_top > h->stack);
     return --h->stack_top;
 }
 
-static bool is_empty(struct HtmlHandle *h) {
-    return h->stack_top == h->stack;
-}
-
-static void ensure_open_tag_written(struct HtmlHandle *h);
-
-static void write_open_tag(struct HtmlHandle *h, Tag *tag) {
-    fprintf(h->filep, "<%s", tag->name);
-
-    Attr *head = tag->tail_attr->next;
-    char *first_sep = " ", *sep = "";
-
-    // TODO: Attribute escaping
-    for (Attr *attr = head->next; attr != head; attr = attr->next) {
-        fprintf(h->filep, "%s", first_sep);
-        fprintf(h->filep, "%s", sep);
-
-        if (attr->isflag) {
-            fprintf(h->filep, "%s", attr->name);
-        } else {
-            fprintf(h->filep, "%s=\"%s\"", attr->name, attr->value);
-        }
-
-        first_sep = "";
-        sep = " ";
+static void ensure_open_tag_written(struct HtmlHandle *h) {
+    if (h->stack_top > h->stack && !peek(h)->open_tag_written) {
+        put_lit(h, ">");
+        peek(h)->open_tag_written = true;
     }
-
-    fprintf(h->filep, ">");
-    tag->open_tag_written = true;
 }
 
+// What was written to fp before goes out first. The handle is all the memory a render takes, however
+// long the file.
 struct HtmlHandle *html_new(FILE *fp) {
-    struct HtmlHandle *h = pool_alloc_struct(struct HtmlHandle);
+    struct HtmlHandle *h = malloc(sizeof(struct HtmlHandle));
+    assert(h);
+    fflush(fp);
     h->filep = fp;
-    h->stack_size = 32;
-    h->stack = pool_alloc(sizeof(Tag) * h->stack_size, Tag);
+    h->fd = fileno(fp);
+    h->len = 0;
     h->stack_top = h->stack;
     return h;
 }
 
 void html_close(struct HtmlHandle *h) {
     // TODO: Check all tags closed
-    // fclose(h->filep);
+    flush(h, NULL, 0);
+    free(h);
 }
 
-void html_open_tag(struct HtmlHandle *h, char *tag_name) {
+// The name is kept until the tag is closed, so it has to stay valid until then, like a literal does
+void html_open_tag(struct HtmlHandle *h, const char *tag_name) {
     ensure_open_tag_written(h);
 
     Tag *tag = push(h);
-    tag->name = pool_alloc_copy_str(tag_name);
-
-    tag->tail_attr = pool_alloc_struct(Attr);
-    tag->tail_attr->next = tag->tail_attr;
-
+    tag->name = tag_name;
+    tag->no_close = binsearchs((char *) tag_name, no_close_tags, NO_CLOSE_TAGS_SIZE) >= 0;
     tag->open_tag_written = false;
+
+    put_lit(h, "<");
+    put_str(h, tag_name);
 }
 
 void html_close_tag(struct HtmlHandle *h) {
@@ -109,87 +145,107 @@ void html_close_tag(struct HtmlHandle *h) {
 
     Tag *tag = pop(h);
 
-    if (binsearchs(tag->name, no_close_tags, NO_CLOSE_TAGS_SIZE) < 0) {
-        fprintf(h->filep, "</%s>", tag->name);
+    if (!tag->no_close) {
+        put_lit(h, "</");
+        put_str(h, tag->name);
+        put_lit(h, ">");
     }
 }
 
-static Attr *alloc_add_attr(struct HtmlHandle *h) {
-    Tag *tag = peek(h);
-
-    Attr *attr = pool_alloc_struct(Attr);
+// Attributes go straight out, so they are taken only while nothing has been written in the tag.
+// TODO: Attribute escaping
+void html_add_attr(struct HtmlHandle *h, const char *name, const char *value) {
+    if (peek(h)->open_tag_written) return;
 
-    Attr *head = tag->tail_attr->next;
-    tag->tail_attr->next = attr;
-    attr->next = head;
-    tag->tail_attr = attr;
-    return attr;
+    put_lit(h, " ");
+    put_str(h, name);
+    put_lit(h, "=\"");
+    put_str(h, value);
+    put_lit(h, "\"");
 }
 
-void html_add_attr(struct HtmlHandle *h, char *name, char *value) {
-    Attr *attr = alloc_add_attr(h);
-    attr->name = pool_alloc_copy_str(name);
-    attr->value = pool_alloc_copy_str(value);
-    attr->isflag = false;
-}
+void html_add_flag(struct HtmlHandle *h, const char *name) {
+    if (peek(h)->open_tag_written) return;
 
-void html_add_flag(struct HtmlHandle *h, char *name) {
-    Attr *attr = alloc_add_attr(h);
-    attr->name = pool_alloc_copy_str(name);
-    attr->isflag = true;
+    put_lit(h, " ");
+    put_str(h, name);
 }
 
-void html_write_text_raw(struct HtmlHandle *h, char *text) {
+void html_write_text_raw(struct HtmlHandle *h, const char *text) {
     ensure_open_tag_written(h);
-    fwrite(text, strlen(text), 1, h->filep);
+    put_str(h, text);
 }
 
-void html_write_textf(struct HtmlHandle *h, char *fmt, ...) {
+void html_write_uint(struct HtmlHandle *h, unsigned int n) {
     ensure_open_tag_written(h);
 
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(h->filep, fmt, ap);
-    va_end(ap);
+    char digits[16];
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char) ('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+
+    put(h, p, digits + sizeof(digits) - p);
+}
+
+static const bool needs_escape[256] = {
+    [' '] = true, ['\n'] = true, ['<'] = true, ['>'] = true, ['&'] = true,
+};
+
+// The first character in [p, end) to escape, end for none. With SSE2 16 bytes are looked at a time, what is
+// left after the last 16 a byte at a time.
+static byte *next_to_escape(byte *p, byte *end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, amp));
+
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+#endif
+
+    while (p < end && !needs_escape[*p]) p++;
+    return p;
 }
 
+// The text between the characters to escape goes in whole
 void html_write_token(struct HtmlHandle *h, Token *t) {
     ensure_open_tag_written(h);
+    byte *run = t->span.ptr, *end = t->span.end;
 
-    for (byte *cp = t->span.ptr; cp < t->span.end; cp++) {
-        char c = (char) *cp;
+    for (byte *cp; (cp = next_to_escape(run, end)) < end; ) {
+        put(h, (char *) run, cp - run);
+        run = cp + 1;
 
-        switch (c) {
+        switch (*cp) {
             case ' ': {
-                html_write_text_raw(h, "&nbsp;");
+                put_lit(h, "&nbsp;");
             } break;
             case '\n': {
-                html_open_tag(h, "br");
-                html_close_tag(h);
+                put_lit(h, "<br>");
             } break;
             case '<': {
-                html_write_text_raw(h, "&lt;");
+                put_lit(h, "&lt;");
             } break;
             case '>': {
-                html_write_text_raw(h, "&gt;");
+                put_lit(h, "&gt;");
             } break;
             case '&': {
-                html_write_text_raw(h, "&amp;");
-            } break;
-            default: {
-                fputc(c, h->filep);
+                put_lit(h, "&amp;");
             } break;
         }
     }
+
+    put(h, (char *) run, end - run);
 }
 
 void html_add_doctype(struct HtmlHandle *h) {
-    fprintf(h->filep, "<!DOCTYPE html>\n");
+    put_lit(h, "<!DOCTYPE html>\n");
 }
-
-static void ensure_open_tag_written(struct HtmlHandle *h) {
-    if (!is_empty(h)) {
-        Tag *tag = peek(h);
-        if (!tag->open_tag_written) write_open_tag(h, peek(h));
-    }
-}
\ No newline at end of file
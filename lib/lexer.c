@@ -52,15 +52,21 @@ static Span read_until_after_inc(LexerState *st, char c);
 static Span read_until_char_inc(LexerState *st, char c);
 static Span read_until_char(LexerState *st, char c);
 static Span read_until_str_inc(LexerState *, char *str);
+static Span read_literal(LexerState *st);
+static Span read_pp_number(LexerState *st);
+static bool has_newline(Span sp);
 static int isid(int c);
 static int notid(int c);
-static int notdigit(int c);
+static int notblank(int c);
 static int binsearch_lex_span(Span target, Tokenizer *arr, size_t size);
 
-static void tokenize_nothing(LexerState *lex, Span kw) {}
+// The whole directive name, '#' included, is one token. The rest of the line is tokenized as usual
+static void tokenize_directive(LexerState *lex, Span directive) {
+    insert_token(PREP_DIRECTIVE_TOKEN, directive);
+}
 
-static void tokenize_include(LexerState *lex, Span kw) {
-    insert_token(INCLUDE_TOKEN, (Span) {kw.ptr-1, kw.end});
+static void tokenize_include(LexerState *lex, Span directive) {
+    insert_token(INCLUDE_TOKEN, directive);
     insert_token(WHITESPACE_TOKEN, read_spaces(lex));
 
     char c = read(lex);
@@ -71,28 +77,30 @@ static void tokenize_include(LexerState *lex, Span kw) {
     } else if (c == '"') {
         lex->pos--;
         insert_token(INCLUDE_PATH_TOKEN, read_until_after_inc(lex, '"'));
+    } else if (!lex->eof) {
+        lex->pos--;
     }
 }
 
-static void tokenize_define(LexerState *lex, Span kw) {
-    insert_token(DEFINE_TOKEN, (Span) {kw.ptr-1, kw.end});
+static void tokenize_define(LexerState *lex, Span directive) {
+    insert_token(DEFINE_TOKEN, directive);
     insert_token(WHITESPACE_TOKEN, read_spaces(lex));
-    insert_token(IDENTIFIER_TOKEN, read_until(lex, isspace));
+    insert_token(IDENTIFIER_TOKEN, read_until(lex, notid));
 }
 
 static Tokenizer prep_directives[] = {
     (Tokenizer) {"define", tokenize_define},
-    (Tokenizer) {"elif", tokenize_nothing},
-    (Tokenizer) {"else", tokenize_nothing},
-    (Tokenizer) {"endif", tokenize_nothing},
-    (Tokenizer) {"error", tokenize_nothing},
-    (Tokenizer) {"if", tokenize_nothing},
-    (Tokenizer) {"ifdef", tokenize_nothing},
-    (Tokenizer) {"ifndef", tokenize_nothing},
+    (Tokenizer) {"elif", tokenize_directive},
+    (Tokenizer) {"else", tokenize_directive},
+    (Tokenizer) {"endif", tokenize_directive},
+    (Tokenizer) {"error", tokenize_directive},
+    (Tokenizer) {"if", tokenize_directive},
+    (Tokenizer) {"ifdef", tokenize_directive},
+    (Tokenizer) {"ifndef", tokenize_directive},
     (Tokenizer) {"include", tokenize_include},
-    (Tokenizer) {"line", tokenize_nothing},
-    (Tokenizer) {"pragma", tokenize_nothing},
-    (Tokenizer) {"undef", tokenize_nothing},
+    (Tokenizer) {"line", tokenize_directive},
+    (Tokenizer) {"pragma", tokenize_directive},
+    (Tokenizer) {"undef", tokenize_directive},
 };
 
 #define PREP_DIRECTIVE_SIZE (sizeof(prep_directives) / sizeof(prep_directives[0]))
@@ -108,6 +116,7 @@ static char *lang_keywords[] = {
 
 static Token *first_token = NULL, *token = NULL;
 static int current_line, current_column;
+static bool line_start;     // Only blanks and comments so far on the current line
 
 typedef struct {
     char *token_str;
@@ -145,9 +154,37 @@ static SimpleTokenDef simple_token_defs[] = {
     (SimpleTokenDef){"*", STAR_TOKEN},
     (SimpleTokenDef){".", DOT_TOKEN},
     (SimpleTokenDef){"...", ELLIPSIS_TOKEN},
+    (SimpleTokenDef){"+", PLUS_TOKEN},
+    (SimpleTokenDef){"+=", PLUS_EQUAL_TOKEN},
+    (SimpleTokenDef){"++", INCREMENT_TOKEN},
+    (SimpleTokenDef){"%", PERCENT_TOKEN},
+    (SimpleTokenDef){"%=", PERCENT_EQUAL_TOKEN},
+    (SimpleTokenDef){"*=", STAR_EQUAL_TOKEN},
+    (SimpleTokenDef){"/=", DIVISION_EQUAL_TOKEN},
+    (SimpleTokenDef){"<<", SHL_TOKEN},
+    (SimpleTokenDef){"<<=", SHL_EQUAL_TOKEN},
+    (SimpleTokenDef){">>", SHR_TOKEN},
+    (SimpleTokenDef){">>=", SHR_EQUAL_TOKEN},
+    (SimpleTokenDef){"&=", AMPERSAND_EQUAL_TOKEN},
+    (SimpleTokenDef){"^", CARET_TOKEN},
+    (SimpleTokenDef){"^=", CARET_EQUAL_TOKEN},
+    (SimpleTokenDef){"|", PIPE_TOKEN},
+    (SimpleTokenDef){"|=", PIPE_EQUAL_TOKEN},
+    (SimpleTokenDef){"&&", AND_TOKEN},
+    (SimpleTokenDef){"||", OR_TOKEN},
+    (SimpleTokenDef){"~", TILDE_TOKEN},
+    (SimpleTokenDef){"?", QUESTION_TOKEN},
+    (SimpleTokenDef){"#", HASH_TOKEN},
+    (SimpleTokenDef){"##", HASH_HASH_TOKEN},
+    (SimpleTokenDef){"<:", OPEN_BRACKET_TOKEN},
+    (SimpleTokenDef){":>", CLOSE_BRACKET_TOKEN},
+    (SimpleTokenDef){"<%", OPEN_CURLY_TOKEN},
+    (SimpleTokenDef){"%>", CLOSE_CURLY_TOKEN},
+    (SimpleTokenDef){"%:", HASH_TOKEN},
+    (SimpleTokenDef){"%:%:", HASH_HASH_TOKEN},
 };
 
-#define MAX_TOKEN_LEN 3
+#define MAX_TOKEN_LEN 4
 
 #define SIMPLE_TOKEN_DEFS_SIZE (sizeof(simple_token_defs) / sizeof(simple_token_defs[0]))
 
@@ -167,80 +204,110 @@ void lexer_init() {
     qsort(prep_directives, PREP_DIRECTIVE_SIZE, sizeof(prep_directives[0]), token_def_cmp);
 }
 
-Token *tokenize(byte *buf, size_t bufsize, int *nlines, LexerError *err) {
+static bool is_literal_prefix(Span word) {
+    return spanstrcmp(word, "L") == 0 || spanstrcmp(word, "u") == 0 || spanstrcmp(word, "U") == 0 || spanstrcmp(word, "u8") == 0;
+}
+
+// Scans the token at the current position. A '#' is a directive only when it starts a line
+static bool scan_token(LexerState *lex, LexerError *err) {
     int i;
-    LexerState *lex = lexer_new(buf, bufsize);
-    current_column = current_line = 1;
-    first_token = token = NULL;
+    char c = read(lex);
 
-    while (!lex->eof) {
-        if (lex->eof) break;
+    if (c == '#' && line_start) {
+        byte *hash = lex->pos - 1;
+        read_until(lex, notblank);
+        Span kw = read_until(lex, notid);
+        i = binsearch_lex_span(kw, prep_directives, PREP_DIRECTIVE_SIZE);
 
-        char c = read(lex);
+        if (i >= 0) {
+            prep_directives[i].tokenize(lex, (Span) {hash, kw.end});
+        } else {
+            tokenize_directive(lex, (Span) {hash, kw.end});
+        }
+    } else if (c == '"') {
+        lex->pos--;
+        insert_token(S_CHAR_SEQ_TOKEN, read_literal(lex));
+    } else if (c == '\'') {
+        lex->pos--;
+        insert_token(CHAR_LITERAL_TOKEN, read_literal(lex));
+    } else if (isspace(c) || (c == '\\' && lex->pos < lex->srcspan.end && *lex->pos == '\n')) {
+        lex->pos--;
+        insert_token(WHITESPACE_TOKEN, read_spaces(lex));
+    } else if (isdigit(c) || (c == '.' && lex->pos < lex->srcspan.end && isdigit(*lex->pos))) {
+        lex->pos--;
+        insert_token(NUM_LITERAL_TOKEN, read_pp_number(lex));
+    } else if (isalpha(c) || c == '_') {
+        lex->pos--;
 
-        if (c == '#') {
-            Span kw = read_until(lex, isspace);
-            i = binsearch_lex_span(kw, prep_directives, PREP_DIRECTIVE_SIZE);
+        Span word = read_until(lex, notid);
+        if (lex->pos < lex->srcspan.end && (*lex->pos == '"' || *lex->pos == '\'') && is_literal_prefix(word)) {
+            TokenType type = *lex->pos == '"' ? S_CHAR_SEQ_TOKEN : CHAR_LITERAL_TOKEN;
+            insert_token(type, (Span) {word.ptr, read_literal(lex).end});
+        } else if (binsearch_span(word, lang_keywords, LANG_KEYWORD_SIZE) >= 0) {
+            insert_token(KEYWORD_TOKEN, word);
+        } else {
+            insert_token(IDENTIFIER_TOKEN, word);
+        }
+    } else {
+        lex->pos--;
+        int simple_ind;
+        int token_delta = -1;
+        Span simple_span = {lex->pos, lex->pos + 1};
+        int token_len;
 
+        for (token_len = MAX_TOKEN_LEN, simple_ind = -1; simple_span.end <= lex->srcspan.end && token_len > 0; token_len--) {
+            i = binsearch_tokendef(simple_span, simple_token_defs, SIMPLE_TOKEN_DEFS_SIZE);
             if (i >= 0) {
-                prep_directives[i].tokenize(lex, kw);
+                simple_ind = i;
+                token_delta = token_len;
             }
-        } else if (c == '"') {
-            lex->pos--;
-            insert_token(S_CHAR_SEQ_TOKEN, read_until_after_inc(lex, '"'));
-        } else if (isspace(c)) {
-            lex->pos--;
-            insert_token(WHITESPACE_TOKEN, read_spaces(lex));
-        } else if (isdigit(c)) {
-            lex->pos--;
-            insert_token(NUM_LITERAL_TOKEN, read_until(lex, notdigit));
-        } else if (isalpha(c) || c == '_') {
-            lex->pos--;
-
-            Span word = read_until(lex, notid);
-            if (binsearch_span(word, lang_keywords, LANG_KEYWORD_SIZE) >= 0) {
-                insert_token(KEYWORD_TOKEN, word);
+            simple_span.end++;
+        }
+
+        simple_span.end -= token_delta;
+        if (simple_span.end < lex->pos + 1) simple_span.end = lex->pos + 1;
+
+        assert(simple_span.end >= lex->pos + 1);
+        lex->pos = simple_span.end;
+
+        if (simple_ind >= 0) {
+            TokenType token_type = simple_token_defs[simple_ind].token_type;
+
+            if (token_type == LINE_COMMENT_TOKEN) {
+                insert_token(token_type, (Span) {simple_span.ptr, read_until_char(lex, '\n').end});
+            } else if (token_type == MULTI_COMMENT_TOKEN) {
+                insert_token(token_type, (Span) {simple_span.ptr, read_until_str_inc(lex, "*/").end});
             } else {
-                insert_token(IDENTIFIER_TOKEN, word);
+                insert_token(token_type, simple_span);
             }
         } else {
-            lex->pos--;
-            int simple_ind;
-            int token_delta = -1;
-            Span simple_span = {lex->pos, lex->pos + 1};
-            int token_len;
-
-            for (token_len = MAX_TOKEN_LEN, simple_ind = -1; simple_span.end <= lex->srcspan.end && token_len > 0; token_len--) {
-                i = binsearch_tokendef(simple_span, simple_token_defs, SIMPLE_TOKEN_DEFS_SIZE);
-                if (i >= 0) {
-                    simple_ind = i;
-                    token_delta = token_len;
-                }
-                simple_span.end++;
-            }
+            err->token = c;
+            err->column = current_column;
+            err->line = current_line;
+            return false;
+        }
+    }
 
-            simple_span.end -= token_delta;
-            if (simple_span.end < lex->pos + 1) simple_span.end = lex->pos + 1;
+    if (token->type == WHITESPACE_TOKEN) {
+        if (has_newline(token->span)) line_start = true;
+    } else if (token->type != LINE_COMMENT_TOKEN && token->type != MULTI_COMMENT_TOKEN) {
+        line_start = false;
+    }
 
-            assert(simple_span.end >= lex->pos + 1);
-            lex->pos = simple_span.end;
+    return true;
+}
 
-            if (simple_ind >= 0) {
-                TokenType token_type = simple_token_defs[simple_ind].token_type;
+Token *tokenize(byte *buf, size_t bufsize, int *nlines, LexerError *err) {
+    int i;
+    LexerState *lex = lexer_new(buf, bufsize);
+    current_column = current_line = 1;
+    first_token = token = NULL;
+    line_start = true;
 
-                if (token_type == LINE_COMMENT_TOKEN) {
-                    insert_token(token_type, (Span) {simple_span.ptr, read_until_char(lex, '\n').end});
-                } else if (token_type == MULTI_COMMENT_TOKEN) {
-                    insert_token(token_type, (Span) {simple_span.ptr, read_until_str_inc(lex, "*/").end});
-                } else {
-                    insert_token(token_type, simple_span);
-                }
-            } else {
-                err->token = c;
-                err->column = current_column;
-                err->line = current_line;
-                return NULL;
-            }
+    while (lex->pos < lex->srcspan.end) {
+        if (!scan_token(lex, err)) {
+            lexer_free(lex);
+            return NULL;
         }
     }
 
@@ -254,6 +321,21 @@ Token *tokenize(byte *buf, size_t bufsize, int *nlines, LexerError *err) {
     return first_token;
 }
 
+// Lexes text that has to make up exactly one token, like the result of pasting two tokens. NULL if it doesn't
+Token *lex_token(byte *buf, size_t bufsize) {
+    LexerState *lex = lexer_new(buf, bufsize);
+    LexerError err;
+    current_column = current_line = 1;
+    first_token = token = NULL;
+    line_start = false;
+
+    bool single = bufsize > 0 && scan_token(lex, &err) && lex->pos == lex->srcspan.end && first_token == token &&
+                  token->type != WHITESPACE_TOKEN && token->type != LINE_COMMENT_TOKEN && token->type != MULTI_COMMENT_TOKEN;
+
+    lexer_free(lex);
+    return single ? first_token : NULL;
+}
+
 static int binsearch_lex_span(Span target, Tokenizer *arr, size_t size) {
     int low = 0;
     int high = (int) size - 1;
@@ -333,6 +415,8 @@ static Span read_until_char_inc(LexerState *st, char c) {
 
 static Span read_until_char(LexerState *st, char c) {
     Span sp = read_until_char_inc(st, c);
+    if (st->eof) return sp;
+
     return (Span) {sp.ptr, --st->pos};
 }
 
@@ -352,22 +436,61 @@ static Span read_until_str_inc(LexerState *lex, char *str) {
     return sp;
 }
 
+// Line continuations count as whitespace
 static Span read_spaces(LexerState *st) {
     Span span = {st->pos};
-    byte *current = st->pos;
 
-    while (isspace(read(st)) && !st->eof) {
-        current++;
+    while (st->pos < st->srcspan.end) {
+        if (isspace(*st->pos)) {
+            st->pos++;
+        } else if (*st->pos == '\\' && st->pos + 1 < st->srcspan.end && *(st->pos + 1) == '\n') {
+            st->pos += 2;
+        } else {
+            break;
+        }
     }
 
-    if (!st->eof) {
-        st->pos--;
+    span.end = st->pos;
+    return span;
+}
+
+// String or character literal with an escaped quote inside. An unterminated one ends with the line
+static Span read_literal(LexerState *st) {
+    Span span = {st->pos};
+    byte quote = *st->pos++;
+
+    for ( ; st->pos < st->srcspan.end && *st->pos != quote && *st->pos != '\n'; st->pos++) {
+        if (*st->pos == '\\' && st->pos + 1 < st->srcspan.end) st->pos++;
     }
 
-    span.end = current;
+    if (st->pos < st->srcspan.end && *st->pos == quote) st->pos++;
+
+    span.end = st->pos;
+    return span;
+}
+
+// pp-number: digits, letters, '_' and '.', with a sign allowed after an exponent
+static Span read_pp_number(LexerState *st) {
+    Span span = {st->pos++};
+
+    for ( ; st->pos < st->srcspan.end; st->pos++) {
+        byte c = *st->pos;
+        if ((c == '+' || c == '-') && strchr("eEpP", *(st->pos - 1)) != NULL) continue;
+        if (!isalnum(c) && c != '_' && c != '.') break;
+    }
+
+    span.end = st->pos;
     return span;
 }
 
+static bool has_newline(Span sp) {
+    for (byte *cp = sp.ptr; cp < sp.end; cp++) {
+        if (*cp == '\n' && (cp == sp.ptr || *(cp - 1) != '\\')) return true;
+    }
+
+    return false;
+}
+
 static Span read_until_after_inc(LexerState *st, char c) {
     Span span = {st->pos++};
     byte *current = st->pos;
@@ -407,6 +530,6 @@ static int isid(int c) {
     return isalnum(c) || c == '_';
 }
 
-static int notdigit(int c) {
-    return !isdigit(c);
+static int notblank(int c) {
+    return c != ' ' && c != '\t';
 }
@@ -11,6 +11,7 @@ typedef enum {
     PREP_DIRECTIVE_TOKEN,
     WHITESPACE_TOKEN,
     S_CHAR_SEQ_TOKEN,
+    CHAR_LITERAL_TOKEN,
     KEYWORD_TOKEN,
     COMMA_TOKEN,
     COLON_TOKEN,
@@ -32,6 +33,13 @@ typedef enum {
     NOT_EQUAL_TOKEN, DOUBLE_EQUAL_TOKEN,
     GREATER_TOKEN, GREATER_OR_EQUAL_TOKEN,
     LESSER_TOKEN, LESSER_OR_EQUAL_TOKEN, MINUS_TOKEN, DIVISION_TOKEN,
+    // punctuators only the preprocessor looks at for now
+    PLUS_TOKEN, PLUS_EQUAL_TOKEN, INCREMENT_TOKEN,
+    PERCENT_TOKEN, PERCENT_EQUAL_TOKEN, STAR_EQUAL_TOKEN, DIVISION_EQUAL_TOKEN,
+    SHL_TOKEN, SHL_EQUAL_TOKEN, SHR_TOKEN, SHR_EQUAL_TOKEN,
+    AMPERSAND_EQUAL_TOKEN, CARET_TOKEN, CARET_EQUAL_TOKEN, PIPE_TOKEN, PIPE_EQUAL_TOKEN,
+    AND_TOKEN, OR_TOKEN, TILDE_TOKEN, QUESTION_TOKEN,
+    HASH_TOKEN, HASH_HASH_TOKEN,
 
     IDENTIFIER_TOKEN,
     STUB_TOKEN,
@@ -69,6 +77,7 @@ char read(LexerState *st);
 LexerState *lexer_new(byte *src, size_t srcsize);
 void lexer_free(LexerState *st);
 Token *tokenize(byte *buf, size_t bufsize, int *nlines, LexerError *err);
+Token *lex_token(byte *buf, size_t bufsize);
 void lexer_init();
 
 #endif //ZHABA_LEXER_H
\ No newline at end of file
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 
+#include "ast_cache.h"
 #include "common.h"
 #include "html_render.h"
 #include "lexer.h"
@@ -16,6 +17,13 @@
 
 void write_css(unsigned char *data, unsigned int data_len, char *filename, char *dir);
 
+// Gets the definitions of every file rendered when set
+static SymbolDb *symbol_db;
+
+void render_symbols_set(SymbolDb *db) {
+    symbol_db = db;
+}
+
 RenderErrorType render(char *srcfile, char *dstdir, RenderError *err) {
     FILE *srcfp = fopen(srcfile, "r");
 
@@ -35,16 +43,29 @@ RenderErrorType render(char *srcfile, char *dstdir, RenderError *err) {
     fread(srcbuf, 1, srclen, srcfp);
     fclose(srcfp);
 
-    LexerError *lerr = pool_alloc_struct(LexerError);
+    // The same source parsed before goes straight to rendering
     int nlines;
-    Token *tokenp = tokenize(srcbuf, srclen, &nlines, lerr);
-
-    if (tokenp == NULL) {
-        err->error = (void *) lerr;
-        return LEXER_ERROR;
+    Ast *ast;
+    CachedAst *cached = ast_cache_load(srcbuf, srclen);
+
+    if (cached != NULL) {
+        ast = &cached->ast;
+        nlines = cached->nlines;
+    } else {
+        LexerError *lerr = pool_alloc_struct(LexerError);
+        Token *tokenp = tokenize(srcbuf, srclen, &nlines, lerr);
+
+        if (tokenp == NULL) {
+            err->error = (void *) lerr;
+            return LEXER_ERROR;
+        }
+
+        ast = &parse(tokenp)->ast;
+        ast_cache_store(srcbuf, srclen, nlines, ast);
     }
 
-    NodeHeader *node = parse(tokenp);
+    ast_print_errors(ast, srcfile, stderr);
+    if (symbol_db != NULL) symdb_add(symbol_db, srcfile, ast);
 
     int direrr = mkdir(dstdir, 0777);
     assert(direrr == 0 || errno == EEXIST);
@@ -61,7 +82,10 @@ RenderErrorType render(char *srcfile, char *dstdir, RenderError *err) {
     write_css(res_reset_css, res_reset_css_len, "reset.css", dstdir);
     write_css(res_style_css, res_style_css_len, "style.css", dstdir);
 
-    gen_html(node, srcfile, nlines, html_filep);
+    gen_html(ast, srcfile, nlines, html_filep);
+
+    if (cached != NULL) ast_cache_close(cached);
+    else ast_free(ast);
     fclose(html_filep);
     // pool_close();
     return SUCCESS;
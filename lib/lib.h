@@ -1,6 +1,8 @@
 #ifndef LIB_H
 #define LIB_H
 
+#include "symbol_db.h"
+
 typedef enum {
     SUCCESS = 0,
     OPEN_SRC_FILE_ERROR = -1,
@@ -14,5 +16,6 @@ typedef struct {
 } RenderError;
 
 RenderErrorType render(char *srcfile, char *dstdir, RenderError *);
+void render_symbols_set(SymbolDb *);
 
 #endif // LIB_H
@@ -1,5 +1,8 @@
 #include "parser.h"
 #include <assert.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -22,62 +25,211 @@ static Primitive primitive_types[] = {
 
 #define PRIMITIVE_COUNT (sizeof(primitive_types) / sizeof(primitive_types[0]))
 
-// TODO: Sort once
-static TokenType binary_operations[] = {
-    NOT_EQUAL_TOKEN, DOUBLE_EQUAL_TOKEN,
-    GREATER_TOKEN, GREATER_OR_EQUAL_TOKEN,
-    LESSER_TOKEN, LESSER_OR_EQUAL_TOKEN, MINUS_TOKEN,
+// Binding powers of the operators following an operand, the higher the tighter. They are even so a
+// right-associative operator can parse its rhs at one less and take in another of its own.
+typedef enum {
+    NO_POWER,
+    COMMA_POWER = 2,
+    ASSIGN_POWER = 4,
+    CONDITIONAL_POWER = 6,
+    OR_POWER = 8,
+    AND_POWER = 10,
+    BIT_OR_POWER = 12,
+    BIT_XOR_POWER = 14,
+    BIT_AND_POWER = 16,
+    EQUALITY_POWER = 18,
+    RELATIONAL_POWER = 20,
+    SHIFT_POWER = 22,
+    ADDITIVE_POWER = 24,
+    MULTIPLICATIVE_POWER = 26,
+    PREFIX_POWER = 28,
+    POSTFIX_POWER = 30,
+} BindingPower;
+
+static uint8_t infix_powers[COUNT_TOKEN] = {
+    [COMMA_TOKEN] = COMMA_POWER,
+    [EQUAL_TOKEN] = ASSIGN_POWER, [PLUS_EQUAL_TOKEN] = ASSIGN_POWER, [MINUS_EQUAL_TOKEN] = ASSIGN_POWER,
+    [STAR_EQUAL_TOKEN] = ASSIGN_POWER, [DIVISION_EQUAL_TOKEN] = ASSIGN_POWER, [PERCENT_EQUAL_TOKEN] = ASSIGN_POWER,
+    [SHL_EQUAL_TOKEN] = ASSIGN_POWER, [SHR_EQUAL_TOKEN] = ASSIGN_POWER, [AMPERSAND_EQUAL_TOKEN] = ASSIGN_POWER,
+    [CARET_EQUAL_TOKEN] = ASSIGN_POWER, [PIPE_EQUAL_TOKEN] = ASSIGN_POWER,
+    [QUESTION_TOKEN] = CONDITIONAL_POWER,
+    [OR_TOKEN] = OR_POWER,
+    [AND_TOKEN] = AND_POWER,
+    [PIPE_TOKEN] = BIT_OR_POWER,
+    [CARET_TOKEN] = BIT_XOR_POWER,
+    [AMPERSAND_TOKEN] = BIT_AND_POWER,
+    [DOUBLE_EQUAL_TOKEN] = EQUALITY_POWER, [NOT_EQUAL_TOKEN] = EQUALITY_POWER,
+    [LESSER_TOKEN] = RELATIONAL_POWER, [LESSER_OR_EQUAL_TOKEN] = RELATIONAL_POWER,
+    [GREATER_TOKEN] = RELATIONAL_POWER, [GREATER_OR_EQUAL_TOKEN] = RELATIONAL_POWER,
+    [SHL_TOKEN] = SHIFT_POWER, [SHR_TOKEN] = SHIFT_POWER,
+    [PLUS_TOKEN] = ADDITIVE_POWER, [MINUS_TOKEN] = ADDITIVE_POWER,
+    [STAR_TOKEN] = MULTIPLICATIVE_POWER, [DIVISION_TOKEN] = MULTIPLICATIVE_POWER, [PERCENT_TOKEN] = MULTIPLICATIVE_POWER,
+    [OPEN_PAREN_TOKEN] = POSTFIX_POWER, [OPEN_BRACKET_TOKEN] = POSTFIX_POWER,
+    [DOT_TOKEN] = POSTFIX_POWER, [ARROW_TOKEN] = POSTFIX_POWER,
+    [INCREMENT_TOKEN] = POSTFIX_POWER, [DECREMENT_TOKEN] = POSTFIX_POWER,
 };
 
-#define BINARY_OP_COUNT (sizeof(binary_operations) / sizeof(binary_operations[0]))
-
-// TODO: Sort once
-static TokenType unary_operations[] = {
-    AMPERSAND_TOKEN, STAR_TOKEN
+static bool prefix_operators[COUNT_TOKEN] = {
+    [AMPERSAND_TOKEN] = true, [STAR_TOKEN] = true, [PLUS_TOKEN] = true, [MINUS_TOKEN] = true,
+    [NOT_TOKEN] = true, [TILDE_TOKEN] = true, [INCREMENT_TOKEN] = true, [DECREMENT_TOKEN] = true,
 };
 
-#define UNARY_OP_COUNT (sizeof(unary_operations) / sizeof(unary_operations[0]))
-
-typedef NodeHeader *(*ParseFunc)(void);
+typedef NodeRef (*ParseFunc)(Parser *);
 
 typedef struct {
     char *keyword;
     ParseFunc parse;
 } KeywordParser;
 
-static void skip_token(TokenType token_type);
-static void skip_white();
-static void next_token();
-static bool is_next_skipws(TokenType token_type);
-static Token *nonws_token();
-static FuncSignature *parse_func_signature();
-static DataType *parse_data_type();
-static NodeHeader *parse_block();
-static NodeHeader *parse_func_body();
-static NodeHeader *parse_statement();
-static FuncInvoke *parse_func_invoke();
-static NodeHeader *parse_expr();
-static StructDecl *parse_struct_decl();
-static Declaration *parse_decl_block();
-static SwitchStatement *parse_switch();
-static ReturnStatement *parse_return();
-static GotoStatement *parse_goto();
-static LabelDecl *parse_label();
-static NodeHeader *parse_comment();
-static Declaration *parse_decl();
-static NodeHeader *parse_expr_list(TokenType open_token_type, TokenType close_token_type);
-static Assignment *parse_assign();
-static NodeHeader *parse_break();
-static IfStatement *parse_if();
+// Head and tail of a list being built, the nodes are chained through their header.next
+typedef struct {
+    NodeRef first;
+    NodeRef last;
+} NodeList;
+
+// Struct tags and macros are looked up apart from the ordinary names and typedefs
+typedef enum {
+    UNKNOWN_NAME, // Not declared in the file, e.g. a typedef from a header that is not parsed
+    ORDINARY_NAME,
+    TYPEDEF_NAME,
+    TAG_NAME,
+    MACRO_NAME,
+} NameKind;
+
+typedef struct {
+    struct Name *name;
+    NameKind kind;
+    uint32_t serial; // Counts the file scope bindings from 1, 0 in inner scopes
+    uint32_t prev;   // Shadowed by this one, like Name.binding
+    TokenRef def;
+} Binding;
+
+// Each distinct identifier once, with its binding in the innermost scope declaring it
+typedef struct Name {
+    Span id;
+    uint32_t binding; // Index into bound plus one, 0 when unbound
+    struct Name *next;
+} Name;
+
+struct NameTable {
+    Name **buckets;
+    size_t size;
+    size_t count;
+    Binding *bound;   // In binding order, popped with their scope or a rollback
+    uint32_t nbound;
+    uint32_t bound_cap;
+    uint32_t *scopes; // Where each open scope starts in bound
+    uint32_t depth;
+    uint32_t scopes_cap;
+    uint32_t serial;
+    uint32_t limit;            // File scope bindings from this serial on are not seen yet
+    struct NameTable *parent;  // Looked up after this one, never changed through it
+};
+
+#define NAME_TABLE_SIZE 256
+
+// What skip_token() reports it missed
+static char *expected_tokens[COUNT_TOKEN] = {
+    [IDENTIFIER_TOKEN] = "instead of an identifier",
+    [KEYWORD_TOKEN] = "instead of a keyword",
+    [SEMICOLON_TOKEN] = "instead of ';'",
+    [COLON_TOKEN] = "instead of ':'",
+    [COMMA_TOKEN] = "instead of ','",
+    [EQUAL_TOKEN] = "instead of '='",
+    [ELLIPSIS_TOKEN] = "instead of '...'",
+    [OPEN_PAREN_TOKEN] = "instead of '('",
+    [CLOSE_PAREN_TOKEN] = "instead of ')'",
+    [OPEN_CURLY_TOKEN] = "instead of '{'",
+    [CLOSE_CURLY_TOKEN] = "instead of '}'",
+    [CLOSE_BRACKET_TOKEN] = "instead of ']'",
+};
+
+static byte no_text[1];
+static Token end_of_file = {EOF_TOKEN, {no_text, no_text}};
+
+static uint32_t node_sizes[NODE_TYPE_COUNT] = {
+    [UNKNOWN_NODE] = sizeof(NodeHeader),
+    [INCLUDE_DIRECTIVE] = sizeof(Include),
+    [DEFINE_DIRECTIVE] = sizeof(Define),
+    [PREP_DIRECTIVE] = sizeof(NodeHeader),
+    [FUNC_DEF] = sizeof(FuncDef),
+    [FUNC_DECL] = sizeof(FuncDecl),
+    [FUNC_INVOKE] = sizeof(FuncInvoke),
+    [FUNC_SIGNATURE] = sizeof(FuncSignature),
+    [STRING_LITERAL] = sizeof(StringLiteral),
+    [INT_LITERAL] = sizeof(IntLiteral),
+    [LINE_COMMENT] = sizeof(NodeHeader),
+    [MULTI_COMMENT] = sizeof(NodeHeader),
+    [DECLARATION] = sizeof(Declaration),
+    [ASSIGNMENT] = sizeof(Assignment),
+    [BREAK_STATEMENT] = sizeof(NodeHeader),
+    [VAR_REFERENCE] = sizeof(VarReference),
+    [DEFINE_REFERENCE] = sizeof(DefineReference),
+    [TYPE_CAST] = sizeof(TypeCast),
+    [ARRAY_ACCESS] = sizeof(ArrAccess),
+    [STRUCT_INIT] = sizeof(StructInit),
+    [UNARY_OP] = sizeof(UnaryOp),
+    [BINARY_OP] = sizeof(BinaryOp),
+    [MEMBER_ACCESS] = sizeof(MemberAccess),
+    [CONDITIONAL_OP] = sizeof(ConditionalOp),
+    [PAREN_EXPR] = sizeof(ParenExpr),
+    [LABEL_DECL] = sizeof(LabelDecl),
+    [STRUCT_DECL] = sizeof(StructDecl),
+    [TYPEDEF_DECL] = sizeof(TypedefDecl),
+    [IF_STATEMENT] = sizeof(IfStatement),
+    [GOTO_STATEMENT] = sizeof(GotoStatement),
+    [SWITCH_STATEMENT] = sizeof(SwitchStatement),
+    [SWITCH_BLOCK] = sizeof(SwitchBlock),
+    [STUB] = sizeof(NodeHeader),
+    [RETURN_STATEMENT] = sizeof(ReturnStatement),
+    [STATEMENT] = sizeof(NodeHeader),
+    [DATA_TYPE] = sizeof(DataType),
+    [UNPARSED] = sizeof(NodeHeader),
+};
+
+static void skip_token(Parser *p, TokenType token_type);
+static void skip_white(Parser *p);
+static void next_token(Parser *p);
+static bool is_next_skipws(Parser *p, TokenType token_type);
+static bool is_next_skipws_at(Parser *p, TokenRef t, TokenType token_type);
+static TokenRef skipws_at(Parser *p, TokenRef t);
+static Token *nonws_token(Parser *p);
+static Token *tok(Parser *p);
+static NodeRef parse_func_signature(Parser *p);
+static NodeRef parse_data_type(Parser *p);
+static NodeList parse_block(Parser *p);
+static NodeList parse_func_body(Parser *p);
+static NodeRef parse_statement(Parser *p);
+static NodeRef parse_expr(Parser *p);
+static NodeRef parse_expr_bp(Parser *p, BindingPower min_power);
+static NodeRef parse_struct_decl(Parser *p);
+static NodeRef parse_decl_block(Parser *p);
+static NodeRef parse_switch(Parser *p);
+static NodeRef parse_return(Parser *p);
+static NodeRef parse_goto(Parser *p);
+static NodeRef parse_label(Parser *p);
+static NodeRef parse_comment(Parser *p);
+static NodeRef parse_directive(Parser *p);
+static NodeRef parse_decl(Parser *p);
+static NodeRef parse_param(Parser *p);
+static NodeRef parse_whole_decl(Parser *p);
+static NodeRef parse_member(Parser *p);
+static NodeRef parse_typedef(Parser *p);
+static NodeRef parse_expr_list(Parser *p, TokenType open_token_type, TokenType close_token_type);
+static NodeRef parse_init(Parser *p, TokenRef id);
+static NodeRef parse_break(Parser *p);
+static NodeRef parse_if(Parser *p);
 static int binsearch_primitive(Span, Primitive *, size_t);
 static int binsearch_parser(Span target, KeywordParser *arr, size_t size);
 
 static KeywordParser keyword_parsers[] = {
-    (KeywordParser) {"goto", (ParseFunc) parse_goto},
-    (KeywordParser) {"if", (ParseFunc) parse_if},
-    (KeywordParser) {"return", (ParseFunc) parse_return},
-    (KeywordParser) {"switch", (ParseFunc) parse_switch},
-    (KeywordParser) {"break", (ParseFunc) parse_break},
+    (KeywordParser) {"goto", parse_goto},
+    (KeywordParser) {"if", parse_if},
+    (KeywordParser) {"return", parse_return},
+    (KeywordParser) {"switch", parse_switch},
+    (KeywordParser) {"break", parse_break},
+    (KeywordParser) {"sizeof", parse_expr},
+    (KeywordParser) {"typedef", parse_typedef},
 };
 
 #define KEYWORD_PARSER_COUNT (sizeof(keyword_parsers) / sizeof(keyword_parsers[0]))
@@ -90,675 +242,1570 @@ void parser_init() {
     qsort(keyword_parsers, KEYWORD_PARSER_COUNT, sizeof(keyword_parsers[0]), kw_parser_cmp);
 }
 
-static Token *token;
-static NodeHeader *first_element = NULL, *element = NULL;
+void *ast_node(Ast *ast, NodeRef ref) {
+    assert(ref != 0);
+    NodeType type = NODE_REF_TYPE(ref);
+    return ast->nodes[type].ptr + (size_t) NODE_REF_INDEX(ref) * node_sizes[type];
+}
+
+Token *ast_token(Ast *ast, TokenRef ref) {
+    return ref < ast->ntokens ? ast->tokens[ref] : NULL;
+}
+
+// The array of a type holds every node of it in the tree and nothing else, what a failed speculation or
+// statement added goes with the rollback. So going through the nodes of a type takes as long as there are
+// of them. They come in the order they were finished, children before their parent.
+uint32_t ast_count(Ast *ast, NodeType type) {
+    return ast->nodes[type].size;
+}
+
+NodeRef ast_nth(Ast *ast, NodeType type, uint32_t index) {
+    assert(index < ast->nodes[type].size && type != UNKNOWN_NODE);
+    return NODE_REF(type, index);
+}
+
+// The next call of a function or function-like macro by that name after the one given, 0 to start
+NodeRef ast_next_call(Ast *ast, Span name, NodeRef after) {
+    uint32_t from = after != 0 ? NODE_REF_INDEX(after) + 1 : 0;
+
+    for (uint32_t i = from; i < ast_count(ast, FUNC_INVOKE); i++) {
+        NodeRef callee = ((FuncInvoke *) ast_node(ast, ast_nth(ast, FUNC_INVOKE, i)))->callee;
+        if (NODE_REF_TYPE(callee) == DEFINE_REFERENCE) callee = ((DefineReference *) ast_node(ast, callee))->expr;
+
+        if (NODE_REF_TYPE(callee) == VAR_REFERENCE) {
+            TokenRef id = ((VarReference *) ast_node(ast, callee))->id;
+            if (spancmp(ast->tokens[id]->span, name) == 0) return ast_nth(ast, FUNC_INVOKE, i);
+        }
+    }
+
+    return 0;
+}
+
+void ast_free(Ast *ast) {
+    for (int i = 0; i < NODE_TYPE_COUNT; i++) {
+        free(ast->nodes[i].ptr);
+        ast->nodes[i] = (NodeArray) {0};
+    }
 
-static DefineTable *define_table;
+    free(ast->errors);
+    free(ast->defs);
+    free(ast->uses);
+    ast->errors = NULL;
+    ast->defs = NULL;
+    ast->uses = NULL;
+    ast->nerrors = ast->errors_cap = 0;
+    ast->ndefs = ast->defs_cap = 0;
+    ast->nuses = ast->uses_cap = 0;
+}
 
-static void insert(NodeHeader *el) {
-    NodeHeader *prev = element;
+// Copies a finished node into the array of its type
+static NodeRef add_node(Parser *p, NodeType type, void *node) {
+    NodeArray *arr = &p->ast.nodes[type];
+    uint32_t size = node_sizes[type];
+
+    if (arr->size == arr->cap) {
+        if (arr->cap == 1u << NODE_REF_INDEX_BITS) {
+            fprintf(stderr, "parse: too many nodes of type %d\n", type);
+            assert(0);
+        }
 
-    element = el;
+        arr->cap = arr->cap == 0 ? 16 : arr->cap * 2;
+        arr->ptr = realloc(arr->ptr, (size_t) arr->cap * size);
+        assert(arr->ptr);
+    }
 
-    if (first_element == NULL) first_element = el;
-    else prev->next = element;
+    memcpy(arr->ptr + (size_t) arr->size * size, node, size);
+    return NODE_REF(type, arr->size++);
 }
 
-NodeHeader *parse(Token *first_token) {
-    first_element = element = NULL;
-    Token *start_token;
-    define_table = prep_define_newtable();
+static NodeHeader *header(Parser *p, NodeRef ref) {
+    return ast_header(&p->ast, ref);
+}
 
-    for (token = first_token; nonws_token() != NULL; ) {
-        switch (nonws_token()->type) {
-            case INCLUDE_DIRECTIVE: {
-                start_token = nonws_token();
-                next_token();
+static void list_append(Parser *p, NodeList *list, NodeRef ref) {
+    if (list->first == 0) list->first = ref;
+    else header(p, list->last)->next = ref;
 
-                Include *inc = pool_alloc_struct(Include);
+    list->last = ref;
+}
 
-                assert(nonws_token()->type == HEADER_NAME_TOKEN || nonws_token()->type == INCLUDE_PATH_TOKEN);
-                inc->pathOrHeader = nonws_token();
-                inc->include_type = nonws_token()->type == HEADER_NAME_TOKEN ? IncludeHeaderType : IncludePathType;
-                next_token();
-                inc->header = (NodeHeader) {INCLUDE_DIRECTIVE, start_token, token};
-                insert((NodeHeader *) inc);
-            } break;
-            case DEFINE_TOKEN: {
-                start_token = nonws_token();
-                next_token();
-
-                Define *def = pool_alloc_struct(Define);
-                def->id = nonws_token();
-                next_token();
-                def->expr = parse_expr();
-                def->header = (NodeHeader) {DEFINE_DIRECTIVE, start_token, token};
-                insert((NodeHeader *) def);
-
-                prep_define_set(define_table, def->id->span, def->expr);
-            } break;
-            case STUB_TOKEN: {
-                next_token();
-            } break;
-            case LINE_COMMENT_TOKEN:
-            case MULTI_COMMENT_TOKEN: {
-                insert(parse_comment());
-            } break;
-            case KEYWORD_TOKEN: {
-                start_token = nonws_token();
+static NameTable *names_new() {
+    NameTable *names = pool_alloc_struct(NameTable);
+    names->size = NAME_TABLE_SIZE;
+    names->buckets = pool_alloc(names->size * sizeof(Name *), Name *);
+    names->limit = UINT32_MAX;
+    return names;
+}
 
-                if (spanstrcmp(token->span, "struct") == 0) {
-                    insert((NodeHeader *) parse_struct_decl());
-                    nonws_token();
-                    skip_token(SEMICOLON_TOKEN);
-                } else {
-                    FuncSignature *sign = parse_func_signature();
-
-                    if (nonws_token()->type == SEMICOLON_TOKEN) { // Func declaration
-                        FuncDecl *decl = pool_alloc_struct(FuncDecl);
-                        decl->signature = sign;
-                        decl->header = (NodeHeader) {FUNC_DECL, start_token, token};
-                        nonws_token();
-                        skip_token(SEMICOLON_TOKEN);
-                        insert((NodeHeader *)decl);
-                    } else if (nonws_token()->type == OPEN_CURLY_TOKEN) { // Func definition
-                        FuncDef *def = pool_alloc_struct(FuncDef);
-                        def->signature = sign;
-                        def->last_stmt = parse_func_body();
-                        def->header = (NodeHeader) {FUNC_DEF, start_token, token};
-                        insert((NodeHeader *)def);
+static void grow_names(NameTable *names) {
+    size_t size = names->size * 4;
+    Name **buckets = pool_alloc(size * sizeof(Name *), Name *);
+
+    for (size_t i = 0; i < names->size; i++) {
+        for (Name *name = names->buckets[i], *next; name != NULL; name = next) {
+            next = name->next;
+            uint h = hash(name->id, size);
+            name->next = buckets[h];
+            buckets[h] = name;
+        }
+    }
+
+    names->buckets = buckets;
+    names->size = size;
+}
+
+// The entry of an identifier, made on first sight when add is set
+static Name *intern(NameTable *names, Span id, bool add) {
+    uint h = hash(id, names->size);
+
+    for (Name *name = names->buckets[h]; name != NULL; name = name->next) {
+        if (spancmp(name->id, id) == 0) return name;
+    }
+
+    if (!add) return NULL;
+
+    Name *name = pool_alloc_struct(Name);
+    name->id = id;
+    name->next = names->buckets[h];
+    names->buckets[h] = name;
+
+    if (++names->count > names->size * 2) grow_names(names);
+    return name;
+}
+
+static bool same_space(NameKind kind, NameKind space) {
+    return kind == space || (kind <= TYPEDEF_NAME && space <= TYPEDEF_NAME);
+}
+
+// The binding of the identifier at t among the names of space, NULL when it has none
+static Binding *lookup(Parser *p, TokenRef t, NameKind space) {
+    uint32_t limit = p->names->limit;
+
+    for (NameTable *names = p->names; names != NULL; names = names->parent) {
+        Name *name = intern(names, p->ast.tokens[t]->span, false);
+
+        for (uint32_t b = name != NULL ? name->binding : 0; b != 0; b = names->bound[b - 1].prev) {
+            Binding *binding = &names->bound[b - 1];
+            if (binding->serial < limit && same_space(binding->kind, space)) return binding;
+        }
+    }
+
+    return NULL;
+}
+
+static NameKind name_kind(Parser *p, TokenRef t) {
+    Binding *binding = lookup(p, t, ORDINARY_NAME);
+    return binding != NULL ? binding->kind : UNKNOWN_NAME;
+}
+
+static void bind_name(Parser *p, TokenRef t, NameKind kind) {
+    NameTable *names = p->names;
+    Name *name = intern(names, p->ast.tokens[t]->span, true);
+
+    if (names->nbound == names->bound_cap) { // The old array stays in the pool
+        names->bound_cap = names->bound_cap == 0 ? 64 : names->bound_cap * 2;
+        Binding *bound = pool_alloc(names->bound_cap * sizeof(Binding), Binding);
+        if (names->nbound > 0) memcpy(bound, names->bound, names->nbound * sizeof(Binding));
+        names->bound = bound;
+    }
+
+    uint32_t serial = names->depth == 0 ? ++names->serial : 0;
+    names->bound[names->nbound++] = (Binding) {name, kind, serial, name->binding, t};
+    name->binding = names->nbound;
+}
+
+static void *grow(void *arr, uint32_t *cap, size_t size) {
+    *cap = *cap == 0 ? 16 : *cap * 2;
+    arr = realloc(arr, *cap * size);
+    assert(arr);
+    return arr;
+}
+
+static void add_def(Ast *ast, TokenRef t, SymbolKind kind) {
+    if (ast->ndefs == ast->defs_cap) ast->defs = grow(ast->defs, &ast->defs_cap, sizeof(SymbolDef));
+    ast->defs[ast->ndefs++] = (SymbolDef) {t, kind};
+}
+
+static void add_use(Ast *ast, TokenRef t, TokenRef def) {
+    if (ast->nuses == ast->uses_cap) ast->uses = grow(ast->uses, &ast->uses_cap, sizeof(SymbolUse));
+    ast->uses[ast->nuses++] = (SymbolUse) {t, def};
+}
+
+static NameKind symbol_names[] = {
+    [VARIABLE_SYMBOL] = ORDINARY_NAME,
+    [GLOBAL_SYMBOL] = ORDINARY_NAME,
+    [PARAM_SYMBOL] = ORDINARY_NAME,
+    [FUNCTION_SYMBOL] = ORDINARY_NAME,
+    [TYPEDEF_SYMBOL] = TYPEDEF_NAME,
+    [STRUCT_SYMBOL] = TAG_NAME,
+    [MACRO_SYMBOL] = MACRO_NAME,
+};
+
+// Binds the identifier at t and records it as a symbol
+static void declare(Parser *p, TokenRef t, SymbolKind kind) {
+    bind_name(p, t, symbol_names[kind]);
+    add_def(&p->ast, t, kind);
+}
+
+// Records the identifier at t as a use of what it is bound to in space, if anything
+static void use_name(Parser *p, TokenRef t, NameKind space) {
+    Binding *binding = lookup(p, t, space);
+    if (binding != NULL) add_use(&p->ast, t, binding->def);
+}
+
+// A #define over the one it replaced, so a body parsed after the outline finds the one it came after
+typedef struct MacroDef {
+    TokenRef at;
+    NodeRef expr;
+    struct MacroDef *prev;
+} MacroDef;
+
+static void define_macro(Parser *p, TokenRef at, TokenRef id, NodeRef expr) {
+    Span name = ast_token(&p->ast, id)->span;
+    MacroDef *def = pool_alloc_struct(MacroDef);
+    *def = (MacroDef) {at, expr, prep_define_get(p->define_table, name)};
+    prep_define_set(p->define_table, name, def);
+}
+
+// The replacement of the macro name is defined to where it is, 0 if none
+static NodeRef macro_expr(Parser *p, Span name) {
+    MacroDef *def = prep_define_get(p->define_table, name);
+    while (def != NULL && def->at >= p->macros_limit) def = def->prev;
+    return def != NULL ? def->expr : 0;
+}
+
+// Unbinds everything bound from start on, uncovering what it shadowed
+static void unbind_to(NameTable *names, uint32_t start) {
+    while (names->nbound > start) {
+        Binding *binding = &names->bound[--names->nbound];
+        binding->name->binding = binding->prev;
+    }
+}
+
+static void scope_push(Parser *p) {
+    NameTable *names = p->names;
+
+    if (names->depth == names->scopes_cap) {
+        names->scopes_cap = names->scopes_cap == 0 ? 16 : names->scopes_cap * 2;
+        uint32_t *scopes = pool_alloc(names->scopes_cap * sizeof(uint32_t), uint32_t);
+        if (names->depth > 0) memcpy(scopes, names->scopes, names->depth * sizeof(uint32_t));
+        names->scopes = scopes;
+    }
+
+    names->scopes[names->depth++] = names->nbound;
+}
+
+static void scope_pop(Parser *p) {
+    NameTable *names = p->names;
+    assert(names->depth > 0);
+    unbind_to(names, names->scopes[--names->depth]);
+}
+
+// All a failed attempt can have changed: nodes are only ever appended to their arrays and bindings to
+// the log, so cutting both back to their lengths undoes it. Names interned meanwhile are kept unbound,
+// errors are kept.
+typedef struct {
+    TokenRef pos;
+    NodeRef element;
+    uint32_t sizes[NODE_TYPE_COUNT];
+    uint32_t nbound;
+    uint32_t depth;
+    uint32_t serial;
+    uint32_t ndefs;
+    uint32_t nuses;
+} Checkpoint;
+
+struct Speculation {
+    jmp_buf fail;
+};
+
+struct Recovery {
+    jmp_buf fail;
+    Recovery *outer;
+};
+
+static bool parse_recover = false;
+
+// When set a statement or declaration that cannot be parsed is recorded in Ast.errors and kept as an
+// UNPARSED node, otherwise the process is aborted
+void parser_recovery_set(bool recover) {
+    parse_recover = recover;
+}
+
+static void add_error(Ast *ast, TokenRef token, const char *context) {
+    if (ast->nerrors == ast->errors_cap) ast->errors = grow(ast->errors, &ast->errors_cap, sizeof(ParseError));
+    ast->errors[ast->nerrors++] = (ParseError) {token, context};
+}
+
+static void print_error(FILE *f, char *filename, Token *token, const char *context) {
+    if (token->type == EOF_TOKEN) {
+        fprintf(f, "parse: %s: unexpected end of file %s\n", filename, context);
+    } else {
+        fprintf(f, "parse: %s:%d:%d: unexpected token '%.*s' %s\n", filename, token->line, token->column,
+                (int) (token->span.end - token->span.ptr), token->span.ptr, context);
+    }
+}
+
+void ast_print_errors(Ast *ast, char *filename, FILE *f) {
+    for (uint32_t i = 0; i < ast->nerrors; i++) {
+        print_error(f, filename, ast->tokens[ast->errors[i].token], ast->errors[i].context);
+    }
+}
+
+static void checkpoint_save(Parser *p, Checkpoint *cp) {
+    cp->pos = p->pos;
+    cp->element = p->element;
+    for (int i = 0; i < NODE_TYPE_COUNT; i++) cp->sizes[i] = p->ast.nodes[i].size;
+    cp->nbound = p->names->nbound;
+    cp->depth = p->names->depth;
+    cp->serial = p->names->serial;
+    cp->ndefs = p->ast.ndefs;
+    cp->nuses = p->ast.nuses;
+}
+
+static void checkpoint_restore(Parser *p, const Checkpoint *cp) {
+    p->pos = cp->pos;
+    for (int i = 0; i < NODE_TYPE_COUNT; i++) p->ast.nodes[i].size = cp->sizes[i];
+
+    p->element = cp->element;
+    if (p->element != 0) header(p, p->element)->next = 0;
+    else p->ast.first_element = 0;
+
+    unbind_to(p->names, cp->nbound);
+    p->names->depth = cp->depth;
+    p->names->serial = cp->serial;
+    p->ast.ndefs = cp->ndefs;
+    p->ast.nuses = cp->nuses;
+}
+
+// Gives up on the construct being parsed: back to the innermost try_parse(), or to the innermost
+// statement or declaration with an error in recovery mode, or out with the error
+static void parse_fail(Parser *p, const char *context) {
+    if (p->speculation != NULL) longjmp(p->speculation->fail, 1);
+
+    if (p->recovery != NULL) {
+        add_error(&p->ast, p->pos, context);
+        longjmp(p->recovery->fail, 1);
+    }
+
+    print_error(stderr, "input", tok(p), context);
+    abort();
+}
+
+// Parses with one interpretation, returning 0 with the parser as it was when that does not fit. The
+// attempt must build its own subtree only, nodes from before it are not restored.
+static NodeRef try_parse(Parser *p, NodeRef (*parse)(Parser *)) {
+    Checkpoint cp;
+    checkpoint_save(p, &cp);
+
+    Speculation speculation, *outer = p->speculation;
+    p->speculation = &speculation;
+    volatile NodeRef node = 0;
+
+    if (setjmp(speculation.fail) == 0) node = parse(p);
+    else checkpoint_restore(p, &cp);
+
+    p->speculation = outer;
+    return node;
+}
+
+// Whether t ends a directive line, escaped newlines don't
+static bool is_line_end(Token *t) {
+    if (t->type == EOF_TOKEN) return true;
+    if (t->type != WHITESPACE_TOKEN) return false;
+
+    for (byte *nl = t->span.ptr; (nl = memchr(nl, '\n', t->span.end - nl)) != NULL; nl++) {
+        if (nl == t->span.ptr || nl[-1] != '\\') return true;
+    }
+
+    return false;
+}
+
+static bool is_directive(TokenType type) {
+    return type == INCLUDE_TOKEN || type == DEFINE_TOKEN || type == PREP_DIRECTIVE_TOKEN;
+}
+
+// Where parsing can go on after a failure in what starts at start: past the next semicolon or the braces
+// opened since start, before a closing brace of an enclosing block or a directive outside the braces, at
+// least one token on
+static TokenRef resync(Parser *p, TokenRef start) {
+    TokenRef t = start;
+    int depth = 0;
+
+    for (; p->ast.tokens[t]->type != EOF_TOKEN; t++) {
+        TokenType type = p->ast.tokens[t]->type;
+
+        if (is_directive(type) && depth == 0 && t != start) {
+            break;
+        } else if (type == OPEN_CURLY_TOKEN) {
+            depth++;
+        } else if (type == CLOSE_CURLY_TOKEN) {
+            if (depth == 0) break;
+            if (--depth > 0) continue;
+
+            TokenRef after = skipws_at(p, t + 1);
+            return p->ast.tokens[after]->type == SEMICOLON_TOKEN ? after + 1 : t + 1;
+        } else if (type == SEMICOLON_TOKEN && depth == 0) {
+            return t + 1;
+        }
+    }
+
+    return t == start && p->ast.tokens[t]->type != EOF_TOKEN ? t + 1 : t;
+}
+
+// Parses a statement or declaration with parse, in recovery mode keeping what it could not parse as an
+// UNPARSED node. Out of tokens the failure goes on to the enclosing one.
+static NodeRef parse_recovering(Parser *p, NodeRef (*parse)(Parser *)) {
+    if (!parse_recover || p->speculation != NULL) return parse(p);
+
+    nonws_token(p);
+    TokenRef start = p->pos;
+    Checkpoint cp;
+    checkpoint_save(p, &cp);
+
+    Recovery recovery = {.outer = p->recovery};
+    p->recovery = &recovery;
+    volatile NodeRef node = 0;
+
+    if (setjmp(recovery.fail) == 0) {
+        node = parse(p);
+    } else {
+        checkpoint_restore(p, &cp);
+        TokenRef end = resync(p, start);
+        p->recovery = recovery.outer;
+
+        if (end == start) {
+            assert(recovery.outer != NULL);
+            longjmp(recovery.outer->fail, 1);
+        }
+
+        NodeHeader unparsed = {start, end};
+        p->pos = end;
+        node = add_node(p, UNPARSED, &unparsed);
+    }
+
+    p->recovery = recovery.outer;
+    return node;
+}
+
+// Decides on the first token, only an identifier never declared in the file needs to look at the next
+static bool is_decl_start(Parser *p) {
+    switch (name_kind(p, p->pos)) {
+        case TYPEDEF_NAME: return true;
+        case ORDINARY_NAME: return false;
+        default: return is_next_skipws(p, IDENTIFIER_TOKEN);
+    }
+}
+
+// An undeclared identifier before a star, tried as a declaration first: `FILE *f;` is far more likely
+// than a multiplication thrown away, and one that goes on like `a * b + c;` fails and is parsed again
+static bool is_maybe_decl_start(Parser *p) {
+    return name_kind(p, p->pos) == UNKNOWN_NAME && is_next_skipws(p, STAR_TOKEN);
+}
+
+static void insert(Parser *p, NodeRef el) {
+    if (p->ast.first_element == 0) p->ast.first_element = el;
+    else header(p, p->element)->next = el;
+
+    p->element = el;
+}
+
+// Moves past the body without parsing it, only counting braces
+static void skip_body(Parser *p) {
+    skip_token(p, OPEN_CURLY_TOKEN);
+    int depth = 1;
+
+    for (; depth > 0 && tok(p)->type != EOF_TOKEN; next_token(p)) {
+        if (tok(p)->type == OPEN_CURLY_TOKEN) depth++;
+        else if (tok(p)->type == CLOSE_CURLY_TOKEN) depth--;
+    }
+
+    if (depth > 0) parse_fail(p, "in function body");
+}
+
+// A declaration or directive of the file scope, 0 for what makes no node
+static NodeRef parse_element(Parser *p) {
+    TokenType type = nonws_token(p)->type;
+    TokenRef start_token = p->pos;
+    NodeRef node = 0;
+
+    switch (type) {
+        case INCLUDE_DIRECTIVE: {
+            next_token(p);
+
+            Include inc = {0};
+            type = nonws_token(p)->type;
+
+            if (type != HEADER_NAME_TOKEN && type != INCLUDE_PATH_TOKEN) parse_fail(p, "in #include");
+            inc.pathOrHeader = p->pos;
+            inc.include_type = type == HEADER_NAME_TOKEN ? IncludeHeaderType : IncludePathType;
+            next_token(p);
+            inc.header = (NodeHeader) {start_token, p->pos};
+            node = add_node(p, INCLUDE_DIRECTIVE, &inc);
+        } break;
+        case DEFINE_TOKEN: {
+            next_token(p);
+
+            Define def = {0};
+            nonws_token(p);
+            def.id = p->pos;
+            next_token(p);
+            def.expr = is_line_end(tok(p)) ? 0 : parse_expr(p); // Guards define nothing
+            def.header = (NodeHeader) {start_token, p->pos};
+            node = add_node(p, DEFINE_DIRECTIVE, &def);
+            declare(p, def.id, MACRO_SYMBOL);
+
+            define_macro(p, start_token, def.id, def.expr);
+        } break;
+        case PREP_DIRECTIVE_TOKEN: {
+            node = parse_directive(p);
+        } break;
+        case STUB_TOKEN: {
+            next_token(p);
+        } break;
+        case LINE_COMMENT_TOKEN:
+        case MULTI_COMMENT_TOKEN: {
+            node = parse_comment(p);
+        } break;
+        case IDENTIFIER_TOKEN:
+        case KEYWORD_TOKEN: {
+            if (spanstrcmp(tok(p)->span, "struct") == 0) {
+                node = parse_struct_decl(p);
+                nonws_token(p);
+                skip_token(p, SEMICOLON_TOKEN);
+            } else if (spanstrcmp(tok(p)->span, "typedef") == 0) {
+                node = parse_typedef(p);
+                nonws_token(p);
+                skip_token(p, SEMICOLON_TOKEN);
+            } else if ((node = try_parse(p, parse_whole_decl)) != 0) { // A variable
+                nonws_token(p);
+                skip_token(p, SEMICOLON_TOKEN);
+            } else {
+                NodeRef sign = parse_func_signature(p);
+
+                if (nonws_token(p)->type == SEMICOLON_TOKEN) { // Func declaration
+                    FuncDecl decl = {0};
+                    decl.signature = sign;
+                    decl.header = (NodeHeader) {start_token, p->pos};
+                    skip_token(p, SEMICOLON_TOKEN);
+                    node = add_node(p, FUNC_DECL, &decl);
+                } else if (nonws_token(p)->type == OPEN_CURLY_TOKEN) { // Func definition
+                    FuncDef def = {0};
+                    def.signature = sign;
+                    def.names_mark = p->names->serial + 1;
+
+                    if (p->outline) {
+                        skip_body(p);
+                    } else {
+                        def.first_stmt = parse_func_body(p).first;
+                        def.parsed = true;
                     }
+
+                    def.header = (NodeHeader) {start_token, p->pos};
+                    node = add_node(p, FUNC_DEF, &def);
+                } else {
+                    parse_fail(p, "after function signature");
                 }
-            } break;
-            default: {
+
+                scope_pop(p);
+            }
+        } break;
+        default: {
+            parse_fail(p, "at file scope");
+        } break;
+    }
+
+    return node;
+}
+
+static Parser *parse_file(Token *first_token, bool outline) {
+    Parser *p = pool_alloc_struct(Parser);
+    p->define_table = prep_define_newtable();
+    p->macros_limit = UINT32_MAX;
+    p->names = names_new();
+    p->outline = outline;
+
+    uint32_t ntokens = 0;
+    for (Token *t = first_token; t != NULL; t = t->next) ntokens++;
+
+    p->ast.tokens = pool_alloc((ntokens + 1) * sizeof(Token *), Token *);
+    p->ast.ntokens = ntokens;
+    ntokens = 0;
+    for (Token *t = first_token; t != NULL; t = t->next) p->ast.tokens[ntokens++] = t;
+    p->ast.tokens[ntokens] = &end_of_file;
+
+    for (p->pos = 0; nonws_token(p)->type != EOF_TOKEN; ) {
+        NodeRef node = parse_recovering(p, parse_element);
+        if (node != 0) insert(p, node);
+    }
+
+    return p;
+}
+
+Parser *parse_outline(Token *first_token) {
+    return parse_file(first_token, true);
+}
+
+// Parses the body of a FuncDef of outline into p. The file scope is seen as it was at the body, the
+// params are rebound over it.
+static NodeRef parse_body_of(Parser *p, Ast *outline, NodeRef func_def) {
+    FuncDef *def = ast_node(outline, func_def);
+    FuncSignature *sign = ast_node(outline, def->signature);
+    p->names->limit = def->names_mark;
+    p->macros_limit = def->header.start_token;
+    scope_push(p);
+
+    for (NodeRef param = sign->first_param; param != 0; param = ast_header(outline, param)->next) {
+        Declaration *decl = ast_node(outline, param);
+        if (!decl->var_arg) bind_name(p, decl->id, ORDINARY_NAME);
+    }
+
+    p->pos = sign->header.end_token;
+    NodeRef first_stmt = parse_func_body(p).first;
+    scope_pop(p);
+    p->names->limit = UINT32_MAX;
+    p->macros_limit = UINT32_MAX;
+
+    return first_stmt;
+}
+
+NodeRef parse_body(Parser *p, NodeRef func_def) {
+    FuncDef *def = ast_node(&p->ast, func_def);
+    if (def->parsed) return def->first_stmt;
+
+    NodeRef first_stmt = parse_body_of(p, &p->ast, func_def);
+
+    def = ast_node(&p->ast, func_def); // The arrays may have moved
+    def->first_stmt = first_stmt;
+    def->parsed = true;
+    return first_stmt;
+}
+
+// Offsets of the NodeRef fields of each node type but header.next, in the order their nodes come in the
+// source: the children, a list by its first node. DefineReference.expr is left out, it points at a
+// #define of the file scope.
+#define MAX_REF_FIELDS 3
+
+static uint8_t ref_fields[NODE_TYPE_COUNT][MAX_REF_FIELDS + 1] = {
+    [DEFINE_DIRECTIVE] = {offsetof(Define, expr)},
+    [FUNC_DEF] = {offsetof(FuncDef, signature), offsetof(FuncDef, first_stmt)},
+    [FUNC_DECL] = {offsetof(FuncDecl, signature)},
+    [FUNC_INVOKE] = {offsetof(FuncInvoke, callee), offsetof(FuncInvoke, first_arg)},
+    [FUNC_SIGNATURE] = {offsetof(FuncSignature, return_type), offsetof(FuncSignature, first_param)},
+    [DECLARATION] = {offsetof(Declaration, data_type), offsetof(Declaration, assign)},
+    [ASSIGNMENT] = {offsetof(Assignment, lhs), offsetof(Assignment, expr)},
+    [TYPE_CAST] = {offsetof(TypeCast, data_type), offsetof(TypeCast, expr)},
+    [ARRAY_ACCESS] = {offsetof(ArrAccess, array), offsetof(ArrAccess, index_expr)},
+    [STRUCT_INIT] = {offsetof(StructInit, first_expr)},
+    [UNARY_OP] = {offsetof(UnaryOp, expr)},
+    [BINARY_OP] = {offsetof(BinaryOp, lhs), offsetof(BinaryOp, rhs)},
+    [MEMBER_ACCESS] = {offsetof(MemberAccess, lhs)},
+    [CONDITIONAL_OP] = {offsetof(ConditionalOp, cond), offsetof(ConditionalOp, then_expr),
+                        offsetof(ConditionalOp, else_expr)},
+    [PAREN_EXPR] = {offsetof(ParenExpr, expr)},
+    [STRUCT_DECL] = {offsetof(StructDecl, first_decl)},
+    [TYPEDEF_DECL] = {offsetof(TypedefDecl, type)},
+    [IF_STATEMENT] = {offsetof(IfStatement, cond), offsetof(IfStatement, then_statement),
+                      offsetof(IfStatement, else_statement)},
+    [SWITCH_STATEMENT] = {offsetof(SwitchStatement, expr), offsetof(SwitchStatement, first_block)},
+    [SWITCH_BLOCK] = {offsetof(SwitchBlock, first_stmt)},
+    [RETURN_STATEMENT] = {offsetof(ReturnStatement, expr)},
+};
+
+const uint8_t *ast_ref_fields(NodeType type) {
+    return ref_fields[type];
+}
+
+uint32_t ast_node_size(NodeType type) {
+    return node_sizes[type];
+}
+
+static NodeRef move_ref(NodeRef ref, uint32_t *offsets) {
+    return ref == 0 ? 0 : NODE_REF(NODE_REF_TYPE(ref), NODE_REF_INDEX(ref) + offsets[NODE_REF_TYPE(ref)]);
+}
+
+// Appends the nodes and errors of from, offsets gets where each type's nodes start
+static void move_nodes(Ast *to, Ast *from, uint32_t *offsets) {
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        offsets[type] = to->nodes[type].size;
+    }
+
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        NodeArray *src = &from->nodes[type], *dst = &to->nodes[type];
+        uint32_t size = node_sizes[type];
+        if (src->size == 0) continue;
+
+        if (dst->size + src->size > dst->cap) {
+            if ((size_t) dst->size + src->size > 1u << NODE_REF_INDEX_BITS) {
+                fprintf(stderr, "parse: too many nodes of type %d\n", type);
                 assert(0);
-            } break;
+            }
+
+            while (dst->size + src->size > dst->cap) dst->cap = dst->cap == 0 ? 16 : dst->cap * 2;
+            dst->ptr = realloc(dst->ptr, (size_t) dst->cap * size);
+            assert(dst->ptr);
+        }
+
+        byte *node = dst->ptr + (size_t) dst->size * size;
+        memcpy(node, src->ptr, (size_t) src->size * size);
+        dst->size += src->size;
+
+        for (uint32_t i = 0; i < src->size; i++, node += size) {
+            NodeHeader *h = (NodeHeader *) node;
+            h->next = move_ref(h->next, offsets);
+
+            for (uint8_t *field = ref_fields[type]; *field != 0; field++) {
+                NodeRef *ref = (NodeRef *) (node + *field);
+                *ref = move_ref(*ref, offsets);
+            }
         }
     }
 
-    return first_element;
+    for (uint32_t i = 0; i < from->nerrors; i++) add_error(to, from->errors[i].token, from->errors[i].context);
+    for (uint32_t i = 0; i < from->ndefs; i++) add_def(to, from->defs[i].token, from->defs[i].kind);
+    for (uint32_t i = 0; i < from->nuses; i++) add_use(to, from->uses[i].token, from->uses[i].def);
+}
+
+static int parse_threads = 1;
+
+static int error_cmp(const void *e1, const void *e2) {
+    TokenRef t1 = ((ParseError *) e1)->token, t2 = ((ParseError *) e2)->token;
+    return t1 < t2 ? -1 : t1 > t2;
+}
+
+// Above 1 parse() parses the function bodies on that many threads
+void parser_threads_set(int nthreads) {
+    parse_threads = nthreads;
 }
 
-static Token *nonws_token() {
-    if (token && token->type == WHITESPACE_TOKEN) token = token->next;
-    return token;
+// A run of consecutive bodies parsed on a thread into its own nodes
+typedef struct {
+    Parser *outline;
+    NodeRef *defs;
+    uint32_t ndefs;
+    NodeRef *first_stmts;
+    Ast ast;
+} BodyJob;
+
+#define BODY_POOL_SIZE (64 * 1024 * 1024)
+
+// The outline is only read, the names are bound in a table of the thread's own pool
+static void *parse_bodies(void *arg) {
+    BodyJob *job = arg;
+    int err = pool_init(BODY_POOL_SIZE);
+    assert(err == 0);
+
+    Parser *outline = job->outline;
+    Parser p = {0};
+    p.ast.tokens = outline->ast.tokens;
+    p.ast.ntokens = outline->ast.ntokens;
+    p.define_table = outline->define_table;
+    p.names = names_new();
+    p.names->parent = outline->names;
+
+    for (uint32_t i = 0; i < job->ndefs; i++) {
+        job->first_stmts[i] = parse_body_of(&p, &outline->ast, job->defs[i]);
+    }
+
+    job->ast = p.ast;
+    pool_close();
+    return NULL;
 }
 
-static void next_token() {
-    token = token->next;
+// Splits the bodies in runs of about the same number of tokens, one per thread, and links their
+// statements in source order
+static void parse_bodies_parallel(Parser *p, int nthreads) {
+    uint32_t ndefs = 0;
+    size_t ntokens = 0;
+
+    for (NodeRef node = p->ast.first_element; node != 0; node = header(p, node)->next) {
+        if (NODE_REF_TYPE(node) == FUNC_DEF) ndefs++;
+    }
+
+    NodeRef *defs = malloc(2 * ndefs * sizeof(NodeRef) + 1);
+    NodeRef *first_stmts = defs + ndefs;
+    BodyJob *jobs = calloc(nthreads, sizeof(BodyJob));
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    assert(defs && jobs && threads);
+
+    ndefs = 0;
+    for (NodeRef node = p->ast.first_element; node != 0; node = header(p, node)->next) {
+        if (NODE_REF_TYPE(node) != FUNC_DEF) continue;
+
+        defs[ndefs++] = node;
+        ntokens += header(p, node)->end_token - header(p, node)->start_token;
+    }
+
+    int njobs = 0;
+    size_t taken = 0;
+
+    for (uint32_t i = 0; i < ndefs; njobs++) {
+        BodyJob *job = &jobs[njobs];
+        job->outline = p;
+        job->defs = defs + i;
+        job->first_stmts = first_stmts + i;
+
+        size_t until = ntokens * (njobs + 1) / nthreads;
+
+        do {
+            taken += header(p, defs[i])->end_token - header(p, defs[i])->start_token;
+            i++;
+            job->ndefs++;
+        } while (i < ndefs && (taken < until || njobs == nthreads - 1));
+    }
+
+    for (int i = 0; i < njobs; i++) {
+        int err = pthread_create(&threads[i], NULL, parse_bodies, &jobs[i]);
+        assert(err == 0);
+    }
+
+    for (int i = 0; i < njobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    uint32_t offsets[NODE_TYPE_COUNT];
+
+    for (int i = 0; i < njobs; i++) {
+        move_nodes(&p->ast, &jobs[i].ast, offsets);
+        ast_free(&jobs[i].ast);
+
+        for (uint32_t j = 0; j < jobs[i].ndefs; j++) {
+            FuncDef *def = ast_node(&p->ast, jobs[i].defs[j]);
+            def->first_stmt = move_ref(jobs[i].first_stmts[j], offsets);
+            def->parsed = true;
+        }
+    }
+
+    // Those of the file scope came first
+    if (p->ast.nerrors > 1) qsort(p->ast.errors, p->ast.nerrors, sizeof(ParseError), error_cmp);
+
+    free(defs);
+    free(jobs);
+    free(threads);
 }
 
-static void skip_token(TokenType token_type) {
-    assert(nonws_token()->type == token_type);
-    next_token();
+Parser *parse(Token *first_token) {
+    if (parse_threads <= 1) return parse_file(first_token, false);
+
+    Parser *p = parse_file(first_token, true);
+    parse_bodies_parallel(p, parse_threads);
+    return p;
 }
 
-static bool is_next_skipws(TokenType token_type) {
-    Token *next = token->next;
-    return token_type == (next->type == WHITESPACE_TOKEN ? next->next : next)->type;
+static Token *tok(Parser *p) {
+    return p->ast.tokens[p->pos];
 }
 
-static void skip_white() {
-    if (token && token->type == WHITESPACE_TOKEN) token = token->next;
+static Token *nonws_token(Parser *p) {
+    if (tok(p)->type == WHITESPACE_TOKEN) p->pos++;
+    return tok(p);
 }
 
-static DataType *parse_data_type() {
-    DataType *data_type = pool_alloc(sizeof(DataType), DataType);
-    data_type->start_token = nonws_token();
+static void next_token(Parser *p) {
+    p->pos++;
+}
 
-    Token *end_token;
+static void skip_token(Parser *p, TokenType token_type) {
+    Token *token = nonws_token(p);
 
-    if (token->type == IDENTIFIER_TOKEN) { // typedef
-        data_type->kind = DATA_TYPE_TYPEDEF;
-        data_type->typedef_id = token;
-        next_token();
-        end_token = token;
-    } else if (token->type == KEYWORD_TOKEN) {
-        if (spanstrcmp(token->span, "struct") == 0) {
-            skip_token(KEYWORD_TOKEN);
-            data_type->kind = DATA_TYPE_STRUCT;
-            data_type->struct_id = nonws_token();
-            skip_token(IDENTIFIER_TOKEN);
-            end_token = token;
+    if (token->type != token_type) {
+        char *expected = expected_tokens[token_type];
+        parse_fail(p, expected != NULL ? expected : "instead of another");
+    }
+
+    next_token(p);
+}
+
+static TokenRef skipws_at(Parser *p, TokenRef t) {
+    return p->ast.tokens[t]->type == WHITESPACE_TOKEN ? t + 1 : t;
+}
+
+static bool is_next_skipws_at(Parser *p, TokenRef t, TokenType token_type) {
+    Token *token = p->ast.tokens[skipws_at(p, t)];
+    return token->type == token_type;
+}
+
+static bool is_next_skipws(Parser *p, TokenType token_type) {
+    return is_next_skipws_at(p, p->pos + 1, token_type);
+}
+
+static void skip_white(Parser *p) {
+    if (tok(p)->type == WHITESPACE_TOKEN) p->pos++;
+}
+
+static NodeRef parse_data_type(Parser *p) {
+    DataType data_type = {0};
+    data_type.name = NO_TOKEN;
+    nonws_token(p);
+    TokenRef start_token = p->pos;
+
+    TokenRef end_token;
+
+    if (tok(p)->type == IDENTIFIER_TOKEN) { // typedef
+        data_type.kind = DATA_TYPE_TYPEDEF;
+        data_type.name = p->pos;
+        use_name(p, p->pos, TYPEDEF_NAME);
+        next_token(p);
+        end_token = p->pos;
+    } else if (tok(p)->type == KEYWORD_TOKEN) {
+        if (spanstrcmp(tok(p)->span, "struct") == 0) {
+            skip_token(p, KEYWORD_TOKEN);
+            data_type.kind = DATA_TYPE_STRUCT;
+            nonws_token(p);
+            data_type.name = p->pos;
+            skip_token(p, IDENTIFIER_TOKEN);
+            use_name(p, data_type.name, TAG_NAME);
+            end_token = p->pos;
         } else {
-            data_type->primitive = UNKNOWN_PRIMITIVE_TYPE;
+            data_type.primitive = UNKNOWN_PRIMITIVE_TYPE;
 
             int i;
-            if ((i = binsearch_primitive(data_type->start_token->span, primitive_types, PRIMITIVE_COUNT)) >= 0) {
-                data_type->kind = DATA_TYPE_PRIMITIVE;
-                data_type->primitive = primitive_types[i].type;
+            if ((i = binsearch_primitive(tok(p)->span, primitive_types, PRIMITIVE_COUNT)) >= 0) {
+                data_type.kind = DATA_TYPE_PRIMITIVE;
+                data_type.primitive = primitive_types[i].type;
             }
 
-            next_token();
-            end_token = token;
+            next_token(p);
+            end_token = p->pos;
         }
     } else {
-        end_token = token;
+        end_token = p->pos;
     }
 
-    skip_white();
+    skip_white(p);
 
-    data_type->pointer = NO_POINTER_TYPE;
-    if (token->type == STAR_TOKEN) {
-        data_type->pointer = POINTER_TYPE;
-        next_token();
-        end_token = token;
+    data_type.pointer = NO_POINTER_TYPE;
+    if (tok(p)->type == STAR_TOKEN) {
+        data_type.pointer = POINTER_TYPE;
+        next_token(p);
+        end_token = p->pos;
     }
 
-    skip_white();
-    if (nonws_token()->type == STAR_TOKEN) {
-        data_type->pointer = POINTER_TO_POINTER_TYPE;
-        next_token();
-        end_token = token;
+    skip_white(p);
+    if (nonws_token(p)->type == STAR_TOKEN) {
+        data_type.pointer = POINTER_TO_POINTER_TYPE;
+        next_token(p);
+        end_token = p->pos;
     }
 
-    data_type->end_token = end_token;
-    token = end_token;
+    data_type.header = (NodeHeader) {start_token, end_token};
+    p->pos = end_token;
 
-    return data_type;
+    return add_node(p, DATA_TYPE, &data_type);
 }
 
-static FuncSignature *parse_func_signature() {
-    Token *start_token = token;
-    DataType *type = parse_data_type();
-    Token *name = nonws_token();
-    skip_token(IDENTIFIER_TOKEN);
+// Leaves the scope of the params open for the body
+static NodeRef parse_func_signature(Parser *p) {
+    TokenRef start_token = p->pos;
+    FuncSignature signature = {0};
+    signature.return_type = parse_data_type(p);
+    nonws_token(p);
+    signature.name = p->pos;
+    skip_token(p, IDENTIFIER_TOKEN);
+    declare(p, signature.name, FUNCTION_SYMBOL);
+    scope_push(p);
 
-    skip_token(OPEN_PAREN_TOKEN);
+    skip_token(p, OPEN_PAREN_TOKEN);
 
-    Declaration *stub = pool_alloc_struct(Declaration);
-    stub->header = (NodeHeader) {STUB, nonws_token(), nonws_token()};
+    NodeList params = {0};
 
-    Declaration *param, *prev;
-    param = prev = stub;
+    while (nonws_token(p)->type != CLOSE_PAREN_TOKEN) {
+        list_append(p, &params, parse_param(p));
+        if (nonws_token(p)->type == COMMA_TOKEN) skip_token(p, COMMA_TOKEN);
+    }
 
-    while (nonws_token()->type != CLOSE_PAREN_TOKEN) {
-        param = parse_decl();
-        prev->header.next = (NodeHeader *) param;
-        if (nonws_token()->type == COMMA_TOKEN) skip_token(COMMA_TOKEN);
+    skip_token(p, CLOSE_PAREN_TOKEN);
 
-        prev = param;
-    }
+    signature.header = (NodeHeader) {start_token, p->pos};
+    signature.first_param = params.first;
+    return add_node(p, FUNC_SIGNATURE, &signature);
+}
 
-    param->header.next = (NodeHeader *) stub;
+// Gives the gotos of the function from uses on their labels, dropping those with none
+static void resolve_gotos(Parser *p, uint32_t defs_start, uint32_t uses_start) {
+    Ast *ast = &p->ast;
+    uint32_t kept = uses_start;
 
-    skip_token(CLOSE_PAREN_TOKEN);
+    for (uint32_t i = uses_start; i < ast->nuses; i++) {
+        SymbolUse use = ast->uses[i];
 
-    FuncSignature *signature = pool_alloc(sizeof(FuncSignature), FuncSignature);
-    signature->header = (NodeHeader) {FUNC_SIGNATURE, start_token, token};
-    signature->name = name;
-    signature->return_type = type;
-    signature->last_param = param;
-    return signature;
+        for (uint32_t d = defs_start; use.def == NO_TOKEN && d < ast->ndefs; d++) {
+            SymbolDef *def = &ast->defs[d];
+            Span label = ast->tokens[def->token]->span;
+            if (def->kind == LABEL_SYMBOL && spancmp(label, ast->tokens[use.token]->span) == 0) use.def = def->token;
+        }
+
+        if (use.def != NO_TOKEN) ast->uses[kept++] = use;
+    }
+
+    ast->nuses = kept;
 }
 
-static NodeHeader *parse_func_body() {
-    return parse_block();
+static NodeList parse_func_body(Parser *p) {
+    uint32_t defs_start = p->ast.ndefs, uses_start = p->ast.nuses;
+    NodeList body = parse_block(p);
+    resolve_gotos(p, defs_start, uses_start);
+    return body;
 }
 
-static NodeHeader *parse_statement() {
-    if (nonws_token()->type == LINE_COMMENT_TOKEN || nonws_token()->type == MULTI_COMMENT_TOKEN) {
-        return parse_comment();
-    } else if (nonws_token()->type == IDENTIFIER_TOKEN) {
-        if (is_next_skipws(COLON_TOKEN)) {
-            return (NodeHeader *) parse_label();
-        } else if (is_next_skipws(IDENTIFIER_TOKEN)) {
-            return (NodeHeader *) parse_decl();
+static NodeRef parse_statement(Parser *p) {
+    NodeRef node;
+
+    if (nonws_token(p)->type == LINE_COMMENT_TOKEN || nonws_token(p)->type == MULTI_COMMENT_TOKEN) {
+        return parse_comment(p);
+    } else if (is_directive(tok(p)->type)) {
+        return parse_directive(p);
+    } else if (nonws_token(p)->type == IDENTIFIER_TOKEN) {
+        if (is_next_skipws(p, COLON_TOKEN)) {
+            return parse_label(p);
+        } else if (is_decl_start(p)) {
+            return parse_decl(p);
+        } else if (is_maybe_decl_start(p) && (node = try_parse(p, parse_whole_decl)) != 0) {
+            return node;
         } else {
-            return parse_expr();
+            return parse_expr(p);
         }
-    } else if (nonws_token()->type == KEYWORD_TOKEN) {
+    } else if (nonws_token(p)->type == KEYWORD_TOKEN) {
         int i;
 
-        if ((i = binsearch_parser(nonws_token()->span, keyword_parsers, KEYWORD_PARSER_COUNT)) >= 0) {
-            return keyword_parsers[i].parse();
+        if ((i = binsearch_parser(nonws_token(p)->span, keyword_parsers, KEYWORD_PARSER_COUNT)) >= 0) {
+            return keyword_parsers[i].parse(p);
         } else {
-            Declaration *decl = parse_decl();
-            return (NodeHeader *) decl;
+            return parse_decl(p);
         }
     } else {
-        return parse_expr();
+        return parse_expr(p);
     }
 
     assert(0);
 }
 
-static NodeHeader *parse_statements_until(bool (*cond)(Token *)) {
-    NodeHeader *stub = pool_alloc_struct(NodeHeader);
-    stub->type = STUB;
-    stub->start_token = nonws_token();
-    stub->end_token = nonws_token();
+// Nested blocks are flattened into the enclosing list
+static NodeList parse_statements_until(Parser *p, bool (*cond)(Token *)) {
+    NodeList list = {0};
 
-    NodeHeader *st, *prev;
-    st = prev = stub;
+    while (!cond(nonws_token(p))) {
+        if (tok(p)->type == OPEN_CURLY_TOKEN) {
+            NodeList block = parse_block(p);
 
-    while (!cond(nonws_token())) {
-        if (token->type == OPEN_CURLY_TOKEN) {
-            st = parse_block();
-            prev->next = st->next->next;
-            st->next = stub;
+            if (block.first != 0) {
+                list_append(p, &list, block.first);
+                list.last = block.last;
+            }
         } else {
-            st = parse_statement();
-            prev->next = st;
+            list_append(p, &list, parse_recovering(p, parse_statement));
         }
 
-        if (nonws_token()->type == SEMICOLON_TOKEN) skip_token(SEMICOLON_TOKEN);
-
-        prev = st;
+        if (nonws_token(p)->type == SEMICOLON_TOKEN) skip_token(p, SEMICOLON_TOKEN);
     }
 
-    st->next = stub;
-    return st;
+    return list;
 }
 
 bool is_switch_block_start(Token *t) {
-    return (token->type == CLOSE_CURLY_TOKEN) ||
-        (token->type == KEYWORD_TOKEN && (spanstrcmp(token->span, "case") == 0 || spanstrcmp(token->span, "default") == 0));
-}
-
-static SwitchStatement *parse_switch() {
-    SwitchStatement *swtch = pool_alloc_struct(SwitchStatement);
-    swtch->header = (NodeHeader) {SWITCH_STATEMENT, token};
-
-    skip_token(KEYWORD_TOKEN);
-    nonws_token();
-    skip_token(OPEN_PAREN_TOKEN);
-    nonws_token();
-    swtch->expr = parse_expr();
-    nonws_token();
-    skip_token(CLOSE_PAREN_TOKEN);
-    nonws_token();
-    skip_token(OPEN_CURLY_TOKEN);
-
-    SwitchBlock *stub_block = pool_alloc_struct(SwitchBlock);
-    stub_block->header = (NodeHeader) {STUB, nonws_token(), nonws_token()};
-
-    SwitchBlock *block, *prev;
-    block = prev = stub_block;
-
-    while (nonws_token()->type != CLOSE_CURLY_TOKEN) {
-        block = pool_alloc_struct(SwitchBlock);
-        block->header = (NodeHeader) {SWITCH_BLOCK, token};
-
-        if (spanstrcmp(token->span, "case") == 0) {
-            block->type = CASE_BLOCK;
-
-            skip_token(KEYWORD_TOKEN);
-            nonws_token();
-            assert(token->type == NUM_LITERAL_TOKEN || token->type == IDENTIFIER_TOKEN);
-            block->label_token = token;
-            next_token();
-            nonws_token();
-            block->colon_token = token;
-            skip_token(COLON_TOKEN);
-            nonws_token();
-
-            block->last_stmt = parse_statements_until(is_switch_block_start);
-        } else if (spanstrcmp(token->span, "default") == 0) {
-            block->type = DEFAULT_BLOCK;
-
-            skip_token(KEYWORD_TOKEN);
-            nonws_token();
-            block->colon_token = token;
-            skip_token(COLON_TOKEN);
-            nonws_token();
-
-            block->last_stmt = parse_statements_until(is_switch_block_start);
+    return (t->type == CLOSE_CURLY_TOKEN) ||
+        (t->type == KEYWORD_TOKEN && (spanstrcmp(t->span, "case") == 0 || spanstrcmp(t->span, "default") == 0));
+}
+
+static NodeRef parse_switch(Parser *p) {
+    SwitchStatement swtch = {0};
+    TokenRef start = p->pos;
+
+    skip_token(p, KEYWORD_TOKEN);
+    nonws_token(p);
+    skip_token(p, OPEN_PAREN_TOKEN);
+    nonws_token(p);
+    swtch.expr = parse_expr(p);
+    nonws_token(p);
+    skip_token(p, CLOSE_PAREN_TOKEN);
+    nonws_token(p);
+    skip_token(p, OPEN_CURLY_TOKEN);
+
+    NodeList blocks = {0};
+
+    while (nonws_token(p)->type != CLOSE_CURLY_TOKEN) {
+        SwitchBlock block = {0};
+        TokenRef block_start = p->pos;
+        block.label_token = NO_TOKEN;
+
+        if (spanstrcmp(tok(p)->span, "case") == 0) {
+            block.type = CASE_BLOCK;
+
+            skip_token(p, KEYWORD_TOKEN);
+            nonws_token(p);
+            if (tok(p)->type != NUM_LITERAL_TOKEN && tok(p)->type != IDENTIFIER_TOKEN) parse_fail(p, "as case label");
+            block.label_token = p->pos;
+            next_token(p);
+            nonws_token(p);
+            block.colon_token = p->pos;
+            skip_token(p, COLON_TOKEN);
+            nonws_token(p);
+
+            block.first_stmt = parse_statements_until(p, is_switch_block_start).first;
+        } else if (spanstrcmp(tok(p)->span, "default") == 0) {
+            block.type = DEFAULT_BLOCK;
+
+            skip_token(p, KEYWORD_TOKEN);
+            nonws_token(p);
+            block.colon_token = p->pos;
+            skip_token(p, COLON_TOKEN);
+            nonws_token(p);
+
+            block.first_stmt = parse_statements_until(p, is_switch_block_start).first;
         } else {
-            assert(0);
+            parse_fail(p, "in switch");
         }
 
-        block->header.end_token = token;
-        prev->header.next = (NodeHeader *) block;
-        prev = block;
+        block.header = (NodeHeader) {block_start, p->pos};
+        list_append(p, &blocks, add_node(p, SWITCH_BLOCK, &block));
     }
 
-    skip_token(CLOSE_CURLY_TOKEN);
-    swtch->header.end_token = token;
-    block->header.next = (NodeHeader *) stub_block;
-    swtch->last_block = block;
-    return swtch;
+    skip_token(p, CLOSE_CURLY_TOKEN);
+    swtch.header = (NodeHeader) {start, p->pos};
+    swtch.first_block = blocks.first;
+    return add_node(p, SWITCH_STATEMENT, &swtch);
 }
 
-static FuncInvoke *parse_func_invoke() {
-    FuncInvoke *invoke = pool_alloc_struct(FuncInvoke);
-    invoke->name = nonws_token();
-    skip_token(IDENTIFIER_TOKEN);
-    nonws_token();
-    invoke->last_arg = parse_expr_list(OPEN_PAREN_TOKEN, CLOSE_PAREN_TOKEN);
-    invoke->header = (NodeHeader) {FUNC_INVOKE, invoke->name, token};
-    return invoke;
+static NodeRef parse_comment(Parser *p) {
+    assert(tok(p)->type == LINE_COMMENT_TOKEN || tok(p)->type == MULTI_COMMENT_TOKEN);
+    NodeType type = tok(p)->type == LINE_COMMENT_TOKEN ? LINE_COMMENT : MULTI_COMMENT;
+    NodeHeader comment = {p->pos, p->pos + 1};
+
+    next_token(p);
+    return add_node(p, type, &comment);
 }
 
-static NodeHeader *parse_comment() {
-    assert(token->type == LINE_COMMENT_TOKEN || token->type == MULTI_COMMENT_TOKEN);
-    NodeHeader *comment = pool_alloc_struct(NodeHeader);
-    comment->type = token->type == LINE_COMMENT_TOKEN ? LINE_COMMENT : MULTI_COMMENT;
-    comment->start_token = token;
-    comment->end_token = token->next;
+// The directive at p and the rest of its line, continuations included, up to the newline
+static NodeRef parse_directive(Parser *p) {
+    NodeHeader directive = {p->pos, p->pos + 1};
 
-    next_token();
-    return comment;
+    for (next_token(p); !is_line_end(tok(p)); next_token(p)) {
+        directive.end_token = p->pos + 1;
+    }
+
+    return add_node(p, PREP_DIRECTIVE, &directive);
 }
 
-static LabelDecl *parse_label() {
-    Token *start = token;
+static NodeRef parse_label(Parser *p) {
+    LabelDecl label = {0};
+    label.label = p->pos;
+    skip_token(p, IDENTIFIER_TOKEN);
+    nonws_token(p);
+    skip_token(p, COLON_TOKEN);
+    label.header = (NodeHeader) {label.label, p->pos};
+    add_def(&p->ast, label.label, LABEL_SYMBOL);
+    return add_node(p, LABEL_DECL, &label);
+}
 
-    LabelDecl *label = pool_alloc_struct(LabelDecl);
-    label->label = token;
-    skip_token(IDENTIFIER_TOKEN);
-    nonws_token();
-    skip_token(COLON_TOKEN);
-    label->header = (NodeHeader) {LABEL_DECL, start, token};
-    return label;
+static NodeRef parse_goto(Parser *p) {
+    TokenRef start = p->pos;
+    skip_token(p, KEYWORD_TOKEN);
+    GotoStatement got = {0};
+    nonws_token(p);
+    got.label = p->pos;
+    skip_token(p, IDENTIFIER_TOKEN);
+    add_use(&p->ast, got.label, NO_TOKEN); // Labels can come after, resolved with the function
+    got.header = (NodeHeader) {start, p->pos};
+    return add_node(p, GOTO_STATEMENT, &got);
 }
 
-static GotoStatement *parse_goto() {
-    Token *start = token;
-    skip_token(KEYWORD_TOKEN);
-    GotoStatement *got = pool_alloc_struct(GotoStatement);
-    got->label = nonws_token();
-    skip_token(IDENTIFIER_TOKEN);
-    got->header = (NodeHeader) {GOTO_STATEMENT, start, token};
-    return got;
+static NodeRef parse_struct_decl(Parser *p) {
+    TokenRef start = p->pos;
+    skip_token(p, KEYWORD_TOKEN);
+
+    StructDecl decl = {0};
+    decl.id = NO_TOKEN;
+
+    if (nonws_token(p)->type == IDENTIFIER_TOKEN) {
+        decl.id = p->pos;
+        next_token(p);
+        declare(p, decl.id, STRUCT_SYMBOL);
+    }
+
+    nonws_token(p);
+
+    decl.first_decl = parse_decl_block(p);
+    decl.header = (NodeHeader) {start, p->pos};
+    return add_node(p, STRUCT_DECL, &decl);
 }
 
-static StructDecl *parse_struct_decl() {
-    Token *start = token;
-    skip_token(KEYWORD_TOKEN);
+static NodeRef parse_return(Parser *p) {
+    nonws_token(p);
+    TokenRef start = p->pos;
+    skip_token(p, KEYWORD_TOKEN);
+
+    ReturnStatement ret = {0};
+    ret.expr = parse_expr(p);
+    ret.header = (NodeHeader) {start, p->pos};
+    return add_node(p, RETURN_STATEMENT, &ret);
+}
 
-    StructDecl *decl = pool_alloc_struct(StructDecl);
-    decl->id = nonws_token();
-    skip_token(IDENTIFIER_TOKEN);
-    nonws_token();
+static NodeRef parse_decl(Parser *p) {
+    NodeRef ref = parse_member(p);
+    Declaration *decl = ast_node(&p->ast, ref);
 
-    decl->last_decl = parse_decl_block();
-    decl->header = (NodeHeader) {STRUCT_DECL, start, token};
-    return decl;
+    if (!decl->var_arg) declare(p, decl->id, p->names->depth == 0 ? GLOBAL_SYMBOL : VARIABLE_SYMBOL);
+    return ref;
 }
 
-static ReturnStatement *parse_return() {
-    Token *start = nonws_token();
-    skip_token(KEYWORD_TOKEN);
+static NodeRef parse_param(Parser *p) {
+    NodeRef ref = parse_member(p);
+    Declaration *decl = ast_node(&p->ast, ref);
 
-    ReturnStatement *ret = pool_alloc_struct(ReturnStatement);
-    NodeHeader *expr = parse_expr();
-    ret->header = (NodeHeader) {RETURN_STATEMENT, start, token};
-    ret->expr = expr;
-    return ret;
+    if (!decl->var_arg) declare(p, decl->id, PARAM_SYMBOL);
+    return ref;
 }
 
-static Declaration *parse_decl() {
-    Token *start = nonws_token();
-    Declaration *decl = pool_alloc_struct(Declaration);
-    decl->var_arg = false;
+// A declaration that is the whole statement, for trying one where an expression could be too
+static NodeRef parse_whole_decl(Parser *p) {
+    NodeRef ref = parse_decl(p);
+    if (!is_next_skipws_at(p, p->pos, SEMICOLON_TOKEN)) parse_fail(p, "after declaration");
+    return ref;
+}
+
+// A declaration without binding its id, as struct members are
+static NodeRef parse_member(Parser *p) {
+    nonws_token(p);
+    TokenRef start = p->pos;
+    Declaration decl = {0};
+    decl.var_arg = false;
 
-    if (nonws_token()->type == ELLIPSIS_TOKEN) {
-        decl->var_arg = true;
-        skip_token(ELLIPSIS_TOKEN);
+    if (tok(p)->type == ELLIPSIS_TOKEN) {
+        decl.var_arg = true;
+        skip_token(p, ELLIPSIS_TOKEN);
     } else {
-        DataType *type = parse_data_type();
-        decl->id = nonws_token();
-        decl->data_type = type;
+        decl.data_type = parse_data_type(p);
+        nonws_token(p);
+        decl.id = p->pos;
 
-        if (is_next_skipws(EQUAL_TOKEN)) {
-            decl->assign = parse_assign();
-        } else {
-            skip_token(IDENTIFIER_TOKEN);
-        }
+        skip_token(p, IDENTIFIER_TOKEN);
+        if (is_next_skipws_at(p, p->pos, EQUAL_TOKEN)) decl.assign = parse_init(p, decl.id);
     }
 
-    decl->header = (NodeHeader) {DECLARATION, start, token};
+    decl.header = (NodeHeader) {start, p->pos};
 
-    return decl;
+    return add_node(p, DECLARATION, &decl);
 }
 
-static NodeHeader *parse_break() {
-    NodeHeader *br = pool_alloc_struct(NodeHeader);
-    br->type = BREAK_STATEMENT;
-    br->start_token = token;
-    skip_token(KEYWORD_TOKEN);
-    br->end_token = token;
-    return br;
-}
+static NodeRef parse_typedef(Parser *p) {
+    TokenRef start = p->pos;
+    skip_token(p, KEYWORD_TOKEN);
 
-static Assignment *parse_assign() {
-    Token *start = nonws_token();
-    Assignment *assign = pool_alloc_struct(Assignment);
-    Token *varname = nonws_token();
-    skip_token(IDENTIFIER_TOKEN);
-    Token *sign = nonws_token();
-    skip_token(EQUAL_TOKEN);
-    nonws_token();
+    TypedefDecl def = {0};
+    TokenRef t = skipws_at(p, p->pos);
 
-    assign->varname = varname;
-    assign->equal_sign = sign;
-    assign->expr = parse_expr();
-    assign->header = (NodeHeader) {ASSIGNMENT, start, token};
+    if (spanstrcmp(p->ast.tokens[t]->span, "struct") == 0) {
+        TokenRef after = skipws_at(p, t + 1);
+        if (p->ast.tokens[after]->type == IDENTIFIER_TOKEN) after = skipws_at(p, after + 1);
 
-    return assign;
+        nonws_token(p);
+        def.type = p->ast.tokens[after]->type == OPEN_CURLY_TOKEN ? parse_struct_decl(p) : parse_data_type(p);
+    } else {
+        def.type = parse_data_type(p);
+    }
+
+    nonws_token(p);
+    def.id = p->pos;
+    skip_token(p, IDENTIFIER_TOKEN);
+    declare(p, def.id, TYPEDEF_SYMBOL);
+
+    def.header = (NodeHeader) {start, p->pos};
+    return add_node(p, TYPEDEF_DECL, &def);
+}
+
+static NodeRef parse_break(Parser *p) {
+    NodeHeader br = {p->pos};
+    skip_token(p, KEYWORD_TOKEN);
+    br.end_token = p->pos;
+    return add_node(p, BREAK_STATEMENT, &br);
 }
 
-static IfStatement *parse_if() {
-    Token *start = nonws_token();
-    skip_token(KEYWORD_TOKEN);
-    skip_token(OPEN_PAREN_TOKEN);
+// The initializer of a declared id, as an assignment to it
+static NodeRef parse_init(Parser *p, TokenRef id) {
+    VarReference var = {{id, id + 1}, id};
+    Assignment assign = {0};
+    assign.lhs = add_node(p, VAR_REFERENCE, &var);
+    nonws_token(p);
+    assign.op = p->pos;
+    skip_token(p, EQUAL_TOKEN);
+    nonws_token(p);
 
-    NodeHeader *cond = parse_expr();
+    assign.expr = parse_expr_bp(p, COMMA_POWER);
+    assign.header = (NodeHeader) {id, p->pos};
 
-    skip_token(CLOSE_PAREN_TOKEN);
+    return add_node(p, ASSIGNMENT, &assign);
+}
 
-    IfStatement *ifstat = pool_alloc_struct(IfStatement);
-    ifstat->cond = cond;
-    ifstat->then_statement = nonws_token()->type == OPEN_CURLY_TOKEN ? parse_block() : parse_statement();
-    Token *endif = token;
-    ifstat->else_token = NULL;
+static NodeRef parse_if(Parser *p) {
+    nonws_token(p);
+    TokenRef start = p->pos;
+    skip_token(p, KEYWORD_TOKEN);
+    skip_token(p, OPEN_PAREN_TOKEN);
 
-    if (spanstrcmp(nonws_token()->span, "else") == 0) {
-        ifstat->else_token = token;
-        skip_token(KEYWORD_TOKEN);
-        ifstat->else_statement = nonws_token()->type == OPEN_CURLY_TOKEN ? parse_block() : parse_statement();
-        endif = token;
-    } else {
-        NodeHeader *elsest = pool_alloc_struct(NodeHeader);
-        elsest->type = STUB;
-        elsest->start_token = nonws_token();
-        elsest->end_token = nonws_token();
-        elsest->next = elsest;
+    IfStatement ifstat = {0};
+    ifstat.cond = parse_expr(p);
+
+    skip_token(p, CLOSE_PAREN_TOKEN);
+
+    ifstat.then_statement = nonws_token(p)->type == OPEN_CURLY_TOKEN ? parse_block(p).first : parse_statement(p);
+    TokenRef endif = p->pos;
+    ifstat.else_token = NO_TOKEN;
 
-        ifstat->else_statement = elsest;
+    if (spanstrcmp(nonws_token(p)->span, "else") == 0) {
+        ifstat.else_token = p->pos;
+        skip_token(p, KEYWORD_TOKEN);
+        ifstat.else_statement = nonws_token(p)->type == OPEN_CURLY_TOKEN ? parse_block(p).first : parse_statement(p);
+        endif = p->pos;
     }
 
-    ifstat->header = (NodeHeader) {IF_STATEMENT, start, endif};
+    ifstat.header = (NodeHeader) {start, endif};
 
-    return ifstat;
+    return add_node(p, IF_STATEMENT, &ifstat);
 }
 
-static NodeHeader *parse_expr_lazy() {
-    if (nonws_token()->type == S_CHAR_SEQ_TOKEN) {
-        StringLiteral *literal = pool_alloc_struct(StringLiteral);
-        literal->header = (NodeHeader) {STRING_LITERAL, token, token->next};
-        literal->str = nonws_token();
+// Whether a token starts a type name: a keyword other than sizeof, or a typedef name. An identifier not
+// declared in the file is taken for one when followed by what can only follow a type in a cast.
+static bool is_type_start(Parser *p, TokenRef t) {
+    Token *token = p->ast.tokens[t];
 
-        next_token();
+    if (token->type == KEYWORD_TOKEN) return spanstrcmp(token->span, "sizeof") != 0;
+    if (token->type != IDENTIFIER_TOKEN) return false;
 
-        return (NodeHeader *) literal;
-    } else if (nonws_token()->type == NUM_LITERAL_TOKEN) {
-        IntLiteral *literal = pool_alloc_struct(IntLiteral);
-        literal->header = (NodeHeader) {INT_LITERAL, token, token->next};
-        literal->num = nonws_token();
+    NameKind kind = name_kind(p, t);
+    if (kind != UNKNOWN_NAME) return kind == TYPEDEF_NAME;
 
-        next_token();
+    TokenRef next = skipws_at(p, t + 1);
+    if (p->ast.tokens[next]->type == STAR_TOKEN) {
+        TokenType after = p->ast.tokens[skipws_at(p, next + 1)]->type;
+        return after == CLOSE_PAREN_TOKEN || after == STAR_TOKEN;
+    }
+    if (p->ast.tokens[next]->type != CLOSE_PAREN_TOKEN) return false;
 
-        return (NodeHeader *) literal;
-    } else if (token->type == OPEN_CURLY_TOKEN) {
-        Token *start = token;
-        StructInit *init = pool_alloc_struct(StructInit);
-        init->last_expr = parse_expr_list(OPEN_CURLY_TOKEN, CLOSE_CURLY_TOKEN);
-        init->header = (NodeHeader){STRUCT_INIT, start, token};
-
-        return (NodeHeader *) init;
-    } else if (nonws_token()->type == IDENTIFIER_TOKEN) {
-        NodeHeader *def_expr;
-
-        NodeHeader *node;
-        if ((def_expr = prep_define_get(define_table, token->span)) != NULL) {
-            DefineReference *ref = pool_alloc_struct(DefineReference);
-            ref->header = (NodeHeader) {DEFINE_REFERENCE, token, token->next};
-            ref->expr = def_expr;
-            node = (NodeHeader *) ref;
-            next_token();
-        } else if (is_next_skipws(OPEN_BRACKET_TOKEN)) {
-            ArrAccess *access = pool_alloc_struct(ArrAccess);
-            access->id = token;
-            next_token();
-            skip_token(OPEN_BRACKET_TOKEN);
-            nonws_token();
-            access->index_expr = parse_expr();
-            nonws_token();
-            skip_token(CLOSE_BRACKET_TOKEN);
-            access->header = (NodeHeader) {ARRAY_ACCESS, access->id, token};
-            node = (NodeHeader *) access;
-        } else if (is_next_skipws(OPEN_PAREN_TOKEN)) {
-            return (NodeHeader *) parse_func_invoke();
-        } else if (is_next_skipws(EQUAL_TOKEN)) {
-            return (NodeHeader *) parse_assign();
+    TokenType after = p->ast.tokens[skipws_at(p, next + 1)]->type;
+    return after == IDENTIFIER_TOKEN || after == NUM_LITERAL_TOKEN || after == S_CHAR_SEQ_TOKEN ||
+        after == CHAR_LITERAL_TOKEN || after == OPEN_PAREN_TOKEN || after == OPEN_CURLY_TOKEN;
+}
+
+// An operand with its prefix operators
+static NodeRef parse_prefix(Parser *p) {
+    Token *token = nonws_token(p);
+    TokenRef start = p->pos;
+
+    if (prefix_operators[token->type]) {
+        UnaryOp op = {0};
+        op.op = start;
+        next_token(p);
+        nonws_token(p);
+        op.expr = parse_expr_bp(p, PREFIX_POWER);
+        op.header = (NodeHeader) {start, p->pos};
+        return add_node(p, UNARY_OP, &op);
+    } else if (token->type == KEYWORD_TOKEN && spanstrcmp(token->span, "sizeof") == 0) {
+        UnaryOp op = {0};
+        op.op = start;
+        next_token(p);
+        nonws_token(p);
+
+        if (tok(p)->type == OPEN_PAREN_TOKEN && is_type_start(p, skipws_at(p, p->pos + 1))) {
+            skip_token(p, OPEN_PAREN_TOKEN);
+            op.expr = parse_data_type(p);
+            skip_token(p, CLOSE_PAREN_TOKEN);
         } else {
-            VarReference *ref = pool_alloc_struct(VarReference);
-            ref->header = (NodeHeader) {VAR_REFERENCE, token, token->next};
-            ref->id = nonws_token();
-            node = (NodeHeader *) ref;
-            next_token();
+            op.expr = parse_expr_bp(p, PREFIX_POWER);
         }
 
-        return node;
+        op.header = (NodeHeader) {start, p->pos};
+        return add_node(p, UNARY_OP, &op);
+    } else if (token->type == S_CHAR_SEQ_TOKEN) {
+        StringLiteral literal = {{start, start + 1}, start};
+        next_token(p);
+        return add_node(p, STRING_LITERAL, &literal);
+    } else if (token->type == NUM_LITERAL_TOKEN || token->type == CHAR_LITERAL_TOKEN) {
+        IntLiteral literal = {{start, start + 1}, start};
+        next_token(p);
+        return add_node(p, INT_LITERAL, &literal);
+    } else if (token->type == OPEN_CURLY_TOKEN) {
+        StructInit init = {0};
+        init.first_expr = parse_expr_list(p, OPEN_CURLY_TOKEN, CLOSE_CURLY_TOKEN);
+        init.header = (NodeHeader) {start, p->pos};
+        return add_node(p, STRUCT_INIT, &init);
+    } else if (token->type == IDENTIFIER_TOKEN) {
+        NodeRef def_expr;
+
+        if ((def_expr = macro_expr(p, token->span)) != 0) {
+            DefineReference ref = {{start, start + 1}, def_expr};
+            use_name(p, start, MACRO_NAME);
+            next_token(p);
+            return add_node(p, DEFINE_REFERENCE, &ref);
+        } else {
+            VarReference ref = {{start, start + 1}, start};
+            use_name(p, start, ORDINARY_NAME);
+            next_token(p);
+            return add_node(p, VAR_REFERENCE, &ref);
+        }
     } else if (token->type == OPEN_PAREN_TOKEN) {
-        TypeCast *cast = pool_alloc_struct(TypeCast);
-        cast->header = (NodeHeader) {TYPE_CAST, token};
+        if (is_type_start(p, skipws_at(p, start + 1))) {
+            TypeCast cast = {0};
+
+            skip_token(p, OPEN_PAREN_TOKEN);
+            cast.data_type = parse_data_type(p);
+            nonws_token(p);
+            skip_token(p, CLOSE_PAREN_TOKEN);
+            nonws_token(p);
+            cast.expr = parse_expr_bp(p, PREFIX_POWER);
+            cast.header = (NodeHeader) {start, p->pos};
+            return add_node(p, TYPE_CAST, &cast);
+        }
 
-        skip_token(OPEN_PAREN_TOKEN);
-        cast->data_type = parse_data_type();
-        nonws_token();
-        skip_token(CLOSE_PAREN_TOKEN);
-        nonws_token();
-        cast->expr = parse_expr();
-        cast->header.end_token = token;
-        return (NodeHeader *) cast;
+        ParenExpr paren = {0};
+        skip_token(p, OPEN_PAREN_TOKEN);
+        nonws_token(p);
+        paren.expr = parse_expr(p);
+        skip_token(p, CLOSE_PAREN_TOKEN);
+        paren.header = (NodeHeader) {start, p->pos};
+        return add_node(p, PAREN_EXPR, &paren);
     }
 
-    assert(0);
+    parse_fail(p, "in expression");
+    return 0;
 }
 
-static NodeHeader *parse_expr() {
-    Token *start = nonws_token();
-
-    if (binsearchi(nonws_token()->type, (int *) unary_operations, UNARY_OP_COUNT) >= 0) {
-        UnaryOp *op = pool_alloc_struct(UnaryOp);
-        start = nonws_token();
-        next_token();
-        nonws_token();
-        op->expr = parse_expr();
-        op->header = (NodeHeader) {UNARY_OP, start, token};
-        return (NodeHeader *) op;
-    }
-
-    NodeHeader *lhs = parse_expr_lazy();
-    Token *after_expr = token;
-
-    if (nonws_token()->type == ARROW_TOKEN || nonws_token()->type == DOT_TOKEN) {
-        MemberAccess *access = pool_alloc_struct(MemberAccess);
-        access->lhs = lhs;
-        nonws_token();
-        assert(token->type == ARROW_TOKEN || nonws_token()->type == DOT_TOKEN);
-        next_token();
-        access->member = nonws_token();
-        next_token();
-        access->header = (NodeHeader) {MEMBER_ACCESS, start, token};
-        return (NodeHeader *) access;
-    } else if (binsearchi(nonws_token()->type, (int *) binary_operations, BINARY_OP_COUNT) >= 0) {
-        next_token();
-        BinaryOp *op = pool_alloc_struct(BinaryOp);
-        op->lhs = lhs;
-        op->rhs = parse_expr_lazy();
-        op->header = (NodeHeader) {BINARY_OP, start, token};
-        return (NodeHeader *) op;
-    } else {
-        token = after_expr;
-        return lhs;
+// Precedence climbing: operators binding tighter than min_power are folded into the operand as they
+// come, each token is looked at once. The position is left before the whitespace that follows.
+static NodeRef parse_expr_bp(Parser *p, BindingPower min_power) {
+    nonws_token(p);
+    TokenRef start = p->pos;
+    NodeRef lhs = parse_prefix(p);
+
+    for (;;) {
+        TokenRef op = skipws_at(p, p->pos);
+        Token *token = p->ast.tokens[op];
+        BindingPower power = infix_powers[token->type];
+
+        if (power <= min_power) break;
+
+        p->pos = op;
+
+        switch (token->type) {
+            case OPEN_PAREN_TOKEN: {
+                FuncInvoke invoke = {0};
+                invoke.callee = lhs;
+                invoke.first_arg = parse_expr_list(p, OPEN_PAREN_TOKEN, CLOSE_PAREN_TOKEN);
+                invoke.header = (NodeHeader) {start, p->pos};
+                lhs = add_node(p, FUNC_INVOKE, &invoke);
+            } break;
+            case OPEN_BRACKET_TOKEN: {
+                ArrAccess access = {0};
+                access.array = lhs;
+                next_token(p);
+                access.index_expr = parse_expr(p);
+                skip_token(p, CLOSE_BRACKET_TOKEN);
+                access.header = (NodeHeader) {start, p->pos};
+                lhs = add_node(p, ARRAY_ACCESS, &access);
+            } break;
+            case DOT_TOKEN:
+            case ARROW_TOKEN: {
+                MemberAccess access = {0};
+                access.lhs = lhs;
+                next_token(p);
+                nonws_token(p);
+                access.member = p->pos;
+                skip_token(p, IDENTIFIER_TOKEN);
+                access.header = (NodeHeader) {start, p->pos};
+                lhs = add_node(p, MEMBER_ACCESS, &access);
+            } break;
+            case INCREMENT_TOKEN:
+            case DECREMENT_TOKEN: {
+                UnaryOp unary = {0};
+                unary.op = op;
+                unary.postfix = true;
+                unary.expr = lhs;
+                next_token(p);
+                unary.header = (NodeHeader) {start, p->pos};
+                lhs = add_node(p, UNARY_OP, &unary);
+            } break;
+            case QUESTION_TOKEN: {
+                ConditionalOp cond = {0};
+                cond.cond = lhs;
+                next_token(p);
+                cond.then_expr = parse_expr(p);
+                skip_token(p, COLON_TOKEN);
+                cond.else_expr = parse_expr_bp(p, power - 1);
+                cond.header = (NodeHeader) {start, p->pos};
+                lhs = add_node(p, CONDITIONAL_OP, &cond);
+            } break;
+            default: {
+                next_token(p);
+
+                if (power == ASSIGN_POWER) {
+                    Assignment assign = {0};
+                    assign.lhs = lhs;
+                    assign.op = op;
+                    assign.expr = parse_expr_bp(p, power - 1);
+                    assign.header = (NodeHeader) {start, p->pos};
+                    lhs = add_node(p, ASSIGNMENT, &assign);
+                } else {
+                    BinaryOp binary = {0};
+                    binary.op = op;
+                    binary.lhs = lhs;
+                    binary.rhs = parse_expr_bp(p, power);
+                    binary.header = (NodeHeader) {start, p->pos};
+                    lhs = add_node(p, BINARY_OP, &binary);
+                }
+            } break;
+        }
     }
-}
 
-static NodeHeader *parse_expr_list(TokenType open_token_type, TokenType close_token_type) {
-    skip_token(open_token_type);
+    return lhs;
+}
 
-    NodeHeader *stub = pool_alloc_struct(NodeHeader);
-    stub->type = STUB;
-    stub->start_token = nonws_token();
-    stub->end_token = nonws_token();
+static NodeRef parse_expr(Parser *p) {
+    return parse_expr_bp(p, NO_POWER);
+}
 
-    NodeHeader *expr, *prev;
-    expr = prev = stub;
+static NodeRef parse_expr_list(Parser *p, TokenType open_token_type, TokenType close_token_type) {
+    skip_token(p, open_token_type);
 
-    while (nonws_token()->type != close_token_type) {
-        expr = parse_expr();
-        prev->next = expr;
-        if (nonws_token()->type == COMMA_TOKEN) skip_token(COMMA_TOKEN);
+    NodeList list = {0};
 
-        prev = expr;
+    while (nonws_token(p)->type != close_token_type) {
+        list_append(p, &list, parse_expr_bp(p, COMMA_POWER));
+        if (nonws_token(p)->type == COMMA_TOKEN) skip_token(p, COMMA_TOKEN);
     }
 
-    skip_token(close_token_type);
-    expr->next = stub;
+    skip_token(p, close_token_type);
 
-    return expr;
+    return list.first;
 }
 
-static Declaration *parse_decl_block() {
-    skip_token(OPEN_CURLY_TOKEN);
-
-    Declaration *stub = pool_alloc_struct(Declaration);
-    stub->header = (NodeHeader) {STUB, nonws_token(), nonws_token()};
-
-    Declaration *decl, *prev;
-    decl = prev = stub;
+static NodeRef parse_decl_block(Parser *p) {
+    skip_token(p, OPEN_CURLY_TOKEN);
 
-    while (nonws_token()->type != CLOSE_CURLY_TOKEN) {
-        decl = parse_decl();
-        prev->header.next = (NodeHeader *) decl;
-        if (nonws_token()->type == SEMICOLON_TOKEN) skip_token(SEMICOLON_TOKEN);
+    NodeList list = {0};
 
-        prev = decl;
+    while (nonws_token(p)->type != CLOSE_CURLY_TOKEN) {
+        list_append(p, &list, parse_member(p));
+        if (nonws_token(p)->type == SEMICOLON_TOKEN) skip_token(p, SEMICOLON_TOKEN);
     }
 
-    skip_token(CLOSE_CURLY_TOKEN);
-    decl->header.next = (NodeHeader *) stub;
+    skip_token(p, CLOSE_CURLY_TOKEN);
 
-    return decl;
+    return list.first;
 }
 
-static NodeHeader *parse_block() {
-    skip_token(OPEN_CURLY_TOKEN);
-
-    NodeHeader *stub = pool_alloc_struct(NodeHeader);
-    stub->type = STUB;
-    stub->start_token = nonws_token();
-    stub->end_token = nonws_token();
-
-    NodeHeader *st, *prev;
-    st = prev = stub;
+static bool is_block_end(Token *t) {
+    return t->type == CLOSE_CURLY_TOKEN;
+}
 
-    while (nonws_token()->type != CLOSE_CURLY_TOKEN) {
-        st = parse_statement();
-        prev->next = st;
-        if (nonws_token()->type == SEMICOLON_TOKEN) skip_token(SEMICOLON_TOKEN);
+static NodeList parse_block(Parser *p) {
+    skip_token(p, OPEN_CURLY_TOKEN);
+    scope_push(p);
 
-        prev = st;
-    }
+    NodeList list = parse_statements_until(p, is_block_end);
 
-    skip_token(CLOSE_CURLY_TOKEN);
-    st->next = stub;
+    skip_token(p, CLOSE_CURLY_TOKEN);
+    scope_pop(p);
 
-    return st;
+    return list;
 }
 
 static int binsearch_primitive(Span target, Primitive *arr, size_t size) {
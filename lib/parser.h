@@ -3,10 +3,14 @@
 #ifndef ZHABA_PARSER_H
 #define ZHABA_PARSER_H
 
+#include <stdint.h>
+#include <stdio.h>
+
 typedef enum {
     UNKNOWN_NODE,
     INCLUDE_DIRECTIVE,
     DEFINE_DIRECTIVE,
+    PREP_DIRECTIVE, // Any other directive line, or one inside a body, kept as text
     FUNC_DEF, FUNC_DECL,
     FUNC_INVOKE,
     FUNC_SIGNATURE,
@@ -21,23 +25,38 @@ typedef enum {
     UNARY_OP,
     BINARY_OP,
     MEMBER_ACCESS,
+    CONDITIONAL_OP,
+    PAREN_EXPR,
     LABEL_DECL,
     STRUCT_DECL,
+    TYPEDEF_DECL,
     IF_STATEMENT, GOTO_STATEMENT, SWITCH_STATEMENT, SWITCH_BLOCK,
     STUB,
     RETURN_STATEMENT,
     STATEMENT,
+    DATA_TYPE,
+    UNPARSED, // Tokens skipped over by a recovering parse
     NODE_TYPE_COUNT
 } NodeType;
 
-struct NodeHeader {
-    NodeType type;
-    Token *start_token;
-    Token *end_token;
-    struct NodeHeader *next;
-};
+// Nodes live in one array per NodeType and refer to each other with 32-bit refs: the type in the top
+// bits, the index into its array in the rest. 0 is no node. Tokens are referred to by their index in
+// Ast.tokens, in the order of the token list.
+typedef uint32_t NodeRef;
+typedef uint32_t TokenRef;
+
+#define NODE_REF_INDEX_BITS 24
+#define NODE_REF(type, index) (((NodeRef) (type) << NODE_REF_INDEX_BITS) | (index))
+#define NODE_REF_TYPE(ref) ((NodeType) ((ref) >> NODE_REF_INDEX_BITS))
+#define NODE_REF_INDEX(ref) ((ref) & ((1u << NODE_REF_INDEX_BITS) - 1))
+#define NO_TOKEN UINT32_MAX
 
-typedef struct NodeHeader NodeHeader;
+// Every node starts with it. Lists are chained through next, the last one has 0.
+typedef struct {
+    TokenRef start_token;
+    TokenRef end_token;
+    NodeRef next;
+} NodeHeader;
 
 typedef enum {
     UNKNOWN_DATA_TYPE_KIND,
@@ -58,51 +77,53 @@ typedef enum {
 } PointerType;
 
 typedef struct {
-    DataTypeKind kind;
-    PrimitiveDataType primitive;
-    PointerType pointer;
-    Token *typedef_id;
-    Token *struct_id;
-    Token *start_token;
-    Token *end_token;
+    NodeHeader header;
+    uint8_t kind;      // DataTypeKind
+    uint8_t primitive; // PrimitiveDataType
+    uint8_t pointer;   // PointerType
+    TokenRef name;     // Of the struct or the typedef
 } DataType;
 
+// Also the compound ones, op is the operator token
 typedef struct {
     NodeHeader header;
-    Token *varname;
-    NodeHeader *expr;
-    Token *equal_sign;
+    NodeRef lhs;
+    TokenRef op;
+    NodeRef expr;
 } Assignment;
 
 typedef struct {
     NodeHeader header;
     bool var_arg;
-    DataType *data_type;
-    Token *id;
-    Assignment *assign;
+    NodeRef data_type;
+    TokenRef id;
+    NodeRef assign;
 } Declaration;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *last_expr;
+    NodeRef first_expr;
 } StructInit;
 
 typedef struct {
     NodeHeader header;
-    Token *name;
-    DataType *return_type;
-    Declaration *last_param;
+    TokenRef name;
+    NodeRef return_type;
+    NodeRef first_param;
 } FuncSignature;
 
+// An outline parse leaves the body to parse_body(), first_stmt is only set once parsed is
 typedef struct {
     NodeHeader header;
-    FuncSignature *signature;
-    NodeHeader *last_stmt;
+    NodeRef signature;
+    bool parsed;
+    NodeRef first_stmt;
+    uint32_t names_mark; // The file scope names the body sees
 } FuncDef;
 
 typedef struct {
     NodeHeader header;
-    FuncSignature *signature;
+    NodeRef signature;
 } FuncDecl;
 
 typedef enum {
@@ -112,40 +133,47 @@ typedef enum {
 typedef struct {
     NodeHeader header;
     IncludeType include_type;
-    Token *pathOrHeader;
+    TokenRef pathOrHeader;
 } Include;
 
 typedef struct {
     NodeHeader header;
-    Token *id;
-    NodeHeader *expr;
+    TokenRef id;
+    NodeRef expr;
 } Define;
 
 typedef struct {
     NodeHeader header;
-    Token *name;
-    NodeHeader *last_arg;
+    NodeRef callee;
+    NodeRef first_arg;
 } FuncInvoke;
 
 typedef struct {
     NodeHeader header;
-    Token *str;
+    TokenRef str;
 } StringLiteral;
 
 typedef struct {
     NodeHeader header;
-    Token *num;
+    TokenRef num;
 } IntLiteral;
 
 typedef struct {
     NodeHeader header;
-    Token *id;
-    Declaration *last_decl;
+    TokenRef id;
+    NodeRef first_decl;
 } StructDecl;
 
+// Of a type, or of a struct declared along with it
+typedef struct {
+    NodeHeader header;
+    NodeRef type;
+    TokenRef id;
+} TypedefDecl;
+
 typedef struct {
     NodeHeader header;
-    NodeHeader *expr;
+    NodeRef expr;
 } ReturnStatement;
 
 typedef enum {
@@ -157,77 +185,177 @@ typedef enum {
 typedef struct {
     NodeHeader header;
     SwitchBlockType type;
-    Token *label_token;
-    Token *colon_token;
-    NodeHeader *last_stmt;
+    TokenRef label_token;
+    TokenRef colon_token;
+    NodeRef first_stmt;
 } SwitchBlock;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *expr;
-    SwitchBlock *last_block;
+    NodeRef expr;
+    NodeRef first_block;
 } SwitchStatement;
 
 typedef struct {
     NodeHeader header;
-    Token *label;
+    TokenRef label;
 } LabelDecl;
 
 typedef struct {
     NodeHeader header;
-    Token *label;
+    TokenRef label;
 } GotoStatement;
 
 typedef struct {
     NodeHeader header;
-    Token *id;
+    TokenRef id;
 } VarReference;
 
 typedef struct {
     NodeHeader header;
-    DataType *data_type;
-    NodeHeader *expr;
+    NodeRef data_type;
+    NodeRef expr;
 } TypeCast;
 
 typedef struct {
     NodeHeader header;
-    Token *id;
-    NodeHeader *index_expr;
+    NodeRef array;
+    NodeRef index_expr;
 } ArrAccess;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *expr;
+    NodeRef expr;
 } DefineReference;
 
+// sizeof of a type has a DATA_TYPE for expr
 typedef struct {
     NodeHeader header;
-    NodeHeader *expr;
+    TokenRef op;
+    bool postfix;
+    NodeRef expr;
 } UnaryOp;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *lhs;
-    NodeHeader *rhs;
+    TokenRef op;
+    NodeRef lhs;
+    NodeRef rhs;
 } BinaryOp;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *lhs;
-    Token *member;
+    NodeRef cond;
+    NodeRef then_expr;
+    NodeRef else_expr;
+} ConditionalOp;
+
+typedef struct {
+    NodeHeader header;
+    NodeRef expr;
+} ParenExpr;
+
+typedef struct {
+    NodeHeader header;
+    NodeRef lhs;
+    TokenRef member;
 } MemberAccess;
 
 typedef struct {
     NodeHeader header;
-    NodeHeader *cond;
-    NodeHeader *then_statement;
-    NodeHeader *else_statement;
-    Token *else_token;
+    NodeRef cond;
+    NodeRef then_statement; // First of the list
+    NodeRef else_statement;
+    TokenRef else_token;
 } IfStatement;
 
-typedef struct FuncArgument FuncArgument;
+typedef struct {
+    byte *ptr;
+    uint32_t size;
+    uint32_t cap;
+} NodeArray;
+
+typedef enum {
+    VARIABLE_SYMBOL, // In a function
+    GLOBAL_SYMBOL,   // A variable at file scope
+    PARAM_SYMBOL,
+    FUNCTION_SYMBOL,
+    TYPEDEF_SYMBOL,
+    STRUCT_SYMBOL,
+    LABEL_SYMBOL,
+    MACRO_SYMBOL,
+} SymbolKind;
+
+// A declared identifier
+typedef struct {
+    TokenRef token;
+    uint32_t kind; // SymbolKind
+} SymbolDef;
+
+// An identifier resolved to the SymbolDef.token it refers to
+typedef struct {
+    TokenRef token;
+    TokenRef def;
+} SymbolUse;
+
+// Where a recovering parse gave up on a statement or declaration
+typedef struct {
+    TokenRef token;
+    const char *context;
+} ParseError;
 
-NodeHeader *parse(Token *);
+typedef struct {
+    Token **tokens; // An EOF_TOKEN at ntokens
+    uint32_t ntokens;
+    NodeArray nodes[NODE_TYPE_COUNT];
+    NodeRef first_element;
+    ParseError *errors; // In source order
+    uint32_t nerrors;
+    uint32_t errors_cap;
+    SymbolDef *defs;    // In the order they are parsed, symbols_index() sorts them out
+    uint32_t ndefs;
+    uint32_t defs_cap;
+    SymbolUse *uses;
+    uint32_t nuses;
+    uint32_t uses_cap;
+} Ast;
+
+typedef struct DefineTable DefineTable;
+typedef struct NameTable NameTable;
+typedef struct Speculation Speculation;
+typedef struct Recovery Recovery;
+
+// Everything a parse works with, returned with the AST. Parsers share nothing but the keyword table
+// set up by parser_init(), so files can be parsed on separate threads, each with its own pool.
+typedef struct {
+    Ast ast;
+    TokenRef pos;
+    NodeRef element;
+    DefineTable *define_table;
+    TokenRef macros_limit; // Macros defined from there on aren't seen yet, while a body of the outline is parsed
+    NameTable *names;
+    Speculation *speculation; // Set while try_parse() runs
+    Recovery *recovery;       // Innermost statement or declaration to give up on, in recovery mode
+    bool outline;
+} Parser;
+
+Parser *parse(Token *);
+Parser *parse_outline(Token *);
+NodeRef parse_body(Parser *, NodeRef func_def);
+void parser_threads_set(int nthreads);
+void parser_recovery_set(bool recover);
 void parser_init();
 
+void *ast_node(Ast *, NodeRef);
+Token *ast_token(Ast *, TokenRef);
+uint32_t ast_count(Ast *, NodeType);
+NodeRef ast_nth(Ast *, NodeType, uint32_t index);
+NodeRef ast_next_call(Ast *, Span name, NodeRef after);
+const uint8_t *ast_ref_fields(NodeType); // Offsets of the child refs in source order, 0 terminated
+uint32_t ast_node_size(NodeType);
+void ast_free(Ast *);
+void ast_print_errors(Ast *, char *filename, FILE *);
+
+#define ast_header(ast, ref) ((NodeHeader *) ast_node((ast), (ref)))
+
 #endif //ZHABA_PARSER_H
\ No newline at end of file
@@ -2,44 +2,66 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "common.h"
 
 typedef struct DefineKv {
     Span key;
-    void *value;
+    void *value; // NULL for #undef, which also hides the parent's definition
     struct DefineKv *next;
 } DefineKv;
 
+// A forked table only stores what changed since the fork and looks everything else up in its
+// parent. Parents are shared between their forks, so they must not change once forked.
 struct DefineTable {
     DefineKv **ptr;
     size_t size;
+    size_t count;
+    size_t generation; // Changes on every set, lets cached expansions skip revalidation
+    DefineTable *parent;
+    bool frozen;
 };
 
+static DefineKv **new_buckets(size_t size) {
+    DefineKv **ptr = pool_alloc(sizeof(DefineKv *) * size, DefineKv *);
+
+    for (size_t i = 0; i < size; i++) {
+        ptr[i] = NULL;
+    }
+
+    return ptr;
+}
+
 DefineTable *prep_define_newtable() {
     DefineTable *t = pool_alloc_struct(DefineTable);
 
     t->size = 32;
-    t->ptr = pool_alloc(sizeof(DefineKv *) * t->size, DefineKv *);
-
-    for (int i = 0; i < t->size; i++) {
-        t->ptr[i] = NULL;
-    }
+    t->ptr = new_buckets(t->size);
+    t->count = 0;
+    t->generation = 0;
+    t->parent = NULL;
+    t->frozen = false;
 
     return t;
 }
 
-uint hash(Span key, size_t tsize) {
-    uint hash = 2166136261;
-
-    for (byte *cp = key.ptr; cp < key.end; cp++) {
-        hash ^= (uint)(*cp);
-        hash *= 16777619;
-    }
+DefineTable *prep_define_fork(DefineTable *parent) {
+    DefineTable *t = prep_define_newtable();
+    parent->frozen = true;
+    t->parent = parent;
+    return t;
+}
 
-    return hash % tsize;
+// The table forked, NULL if it wasn't
+DefineTable *prep_define_parent(DefineTable *table) {
+    return table->parent;
 }
 
 static DefineKv *new_kv(Span key, void *value) {
@@ -50,12 +72,37 @@ static DefineKv *new_kv(Span key, void *value) {
     return kv;
 }
 
+// The old buckets stay in the pool, the entries are relinked
+static void grow_table(DefineTable *table) {
+    size_t size = table->size * 4;
+    DefineKv **ptr = new_buckets(size);
+
+    for (size_t i = 0; i < table->size; i++) {
+        for (DefineKv *kv = table->ptr[i], *next; kv != NULL; kv = next) {
+            next = kv->next;
+            uint h = hash(kv->key, size);
+            kv->next = ptr[h];
+            ptr[h] = kv;
+        }
+    }
+
+    table->ptr = ptr;
+    table->size = size;
+}
+
 void prep_define_set(DefineTable *table, Span key, void *value) {
+    if (table->frozen) {
+        fprintf(stderr, "expand: changing a forked macro table\n");
+        assert(false);
+    }
+
+    table->generation++;
     uint h = hash(key, table->size);
     DefineKv *kv = table->ptr[h];
 
     if (kv == NULL) {
         table->ptr[h] = new_kv(key, value);
+        table->count++;
     } else {
         DefineKv *head = kv;
         DefineKv *prev_found = NULL, *found = NULL;
@@ -76,16 +123,20 @@ void prep_define_set(DefineTable *table, Span key, void *value) {
         } else {
             nkv->next = head;
             table->ptr[h] = nkv;
+            table->count++;
         }
     }
+
+    if (table->count > table->size * 2) grow_table(table);
 }
 
 void *prep_define_get(DefineTable *table, Span key) {
-    uint h = hash(key, table->size);
-    DefineKv *kv = table->ptr[h];
+    for ( ; table != NULL; table = table->parent) {
+        uint h = hash(key, table->size);
 
-    for ( ; kv != NULL; kv = kv->next) {
-        if (spancmp(kv->key, key) == 0) return kv->value;
+        for (DefineKv *kv = table->ptr[h]; kv != NULL; kv = kv->next) {
+            if (spancmp(kv->key, key) == 0) return kv->value;
+        }
     }
 
     return NULL;
@@ -164,412 +215,3054 @@ void *prep_define_get(DefineTable *table, Span key) {
 
 static char **search_paths;
 static size_t search_paths_size;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void prep_search_paths_set(char **paths, size_t paths_size) {
+    pthread_mutex_lock(&prefetch_lock); // The I/O threads look for headers on them
     search_paths = paths;
     search_paths_size = paths_size;
+    pthread_mutex_unlock(&prefetch_lock);
 }
 
-static char *expand(Span sp, char *dirpath, DefineTable *def_table, char *out, int *outsz);
-static bool eval_expr(Span expr, DefineTable *def_table);
+static char *snapshot_path;
+static int snapshot_includes;
+static int snapshot_loads;
 
-byte *read_src(char *path, size_t *size) {
-    FILE *f = fopen(path, "r");
-    assert(f); // TODO: Error handling
-    fseek(f, 0, SEEK_END);
-    *size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// The macro state and the output of the includes after the #include, #define and #undef lines the main
+// file starts with, up to nincludes includes, are saved to path. They are reused for a main file starting
+// with the same includes and definitions while neither the files read for them nor the search paths change.
+void prep_snapshot_set(char *path, int nincludes) {
+    snapshot_path = path;
+    snapshot_includes = nincludes;
+}
 
-    byte *data = pool_alloc(*size, byte);
-    size_t rsz = fread(data, 1, *size, f);
-    assert(rsz == *size); // TODO: Error handling
-    fclose(f);
-    return data;
+// How many expansions started from a snapshot instead of expanding the includes
+int prep_snapshot_loads() {
+    return snapshot_loads;
 }
 
-char *prep_expand(char *srcfile, DefineTable *def_table, char *out, int *outsz) {
-    size_t srcsize;
-    byte *src = read_src(srcfile, &srcsize);
+static int shared_includes;
 
-    char *srcdir_end;
+// Main files that start by including the same files and defining the same macros, up to nincludes
+// includes, share the macro state after them within a run: the first builds it once, the others fork
+// it. Comments and what comes after may differ. A snapshot's count wins when both are set.
+void prep_shared_prefix_set(int nincludes) {
+    shared_includes = nincludes;
+}
 
-    for (srcdir_end = srcfile + strlen(srcfile); srcdir_end >= srcfile && *srcdir_end != '/'; srcdir_end--)
-        ;
+static SourceMap *source_map;
+static bool line_markers;
 
-    char *dirpath;
-    if (srcdir_end >= srcfile) {
-        dirpath = pool_alloc(srcdir_end - srcfile + 1, char);
-        strncpy(dirpath, srcfile, srcdir_end - srcfile);
-    } else {
-        dirpath = pool_alloc(1 + 1, char);
-        strncpy(dirpath, ".", 1);
+// The next expansions record their output into map, each one starting over
+void prep_source_map_set(SourceMap *map) {
+    source_map = map;
+}
+
+// #line markers in front of every line that doesn't follow the one written before it
+void prep_line_markers_set(bool on) {
+    line_markers = on;
+}
+
+// Growable scratch arrays used while compiling, the finished program is copied to the pool
+typedef struct {
+    void *ptr;
+    size_t size;
+    size_t cap;
+    size_t item_size;
+} Vec;
+
+static void *vec_push(Vec *v) {
+    if (v->size == v->cap) {
+        v->cap = v->cap == 0 ? 16 : v->cap * 2;
+        v->ptr = realloc(v->ptr, v->cap * v->item_size);
+        assert(v->ptr != NULL);
     }
 
-    return expand((Span){src, src + srcsize}, dirpath, def_table, out, outsz);
+    return (byte *) v->ptr + v->item_size * v->size++;
+}
+
+static void *vec_copy_to_pool(Vec *v, size_t align) {
+    void *p = pool_alloc_align(v->size * v->item_size, align);
+    if (v->size > 0) memcpy(p, v->ptr, v->size * v->item_size);
+    return p;
 }
 
 #define min(x, y) ((x) < (y) ? (x) : (y))
+#define max(x, y) ((x) > (y) ? (x) : (y))
 
-struct reader {
-    byte *ptr;
+// Position in the token list of a file. pos is inside tok when a directive took only part of a
+// whitespace token; end clips the range, e.g. to the content of a conditional group
+typedef struct {
+    Token *tok;
+    byte *pos;
     byte *end;
-    byte cur;
+} Cursor;
+
+struct SourceMap {
+    Vec ranges; // MapRange
+    size_t size; // Of the output
 };
 
+typedef struct SrcFile SrcFile;
+
+// Expanded tokens either go to a list the parser reads or are written straight into a text buffer
+typedef struct {
+    Token *head;
+    Token **tail;
+    char *outp;
+    int *outsz;
+    size_t offset;      // Bytes written so far
+    SourceMap *map;
+    byte *origin;       // Invocation whose expansion is being written, all of it maps there
+    bool markers;
+    char *line_path;    // Where the next line comes from as far as a reader of #line markers knows
+    int line;
+    bool bol;
+} Output;
+
+static void expand(Cursor *c, char *dirpath, DefineTable *def_table, Output *out);
+static void expand_main(char *srcfile, DefineTable *def_table, Output *out);
+static bool eval_expr(Token *directive, Cursor line, DefineTable *def_table);
+
+// Sources are read and lexed once per run and kept in the pool, so a header included by many translation
+// units has stable tokens. Its directive tokens key the #if cache below.
+struct SrcFile {
+    char *path;
+    Span content;
+    Token *tokens;
+    uint32_t id;
+    Vec lines;           // Offsets of the line starts, made on the first lookup
+    Vec line_directives; // LineDirective, by offset
+    Span once_name;      // Defined once the file was expanded with #pragma once
+    struct SrcFile *next;
+};
+
+// From offset on, the lines of the file are numbered from line and come from path as #line says
+typedef struct {
+    size_t offset;
+    int line;
+    char *path;
+} LineDirective;
 
-// true if it has something
-static bool readnext(struct reader *r) {
-    if (r->ptr >= r->end) return false;
+#define SRC_FILES_SIZE 256
+static SrcFile *src_files[SRC_FILES_SIZE];
 
-    r->cur = *r->ptr;
-    r->ptr++;
+static Vec src_ids = {.item_size = sizeof(SrcFile *)};
+static Vec src_addrs = {.item_size = sizeof(SrcFile *)}; // By content address, to find the file of a span
 
-    if (r->ptr >= r->end) return true;
+static void add_src(SrcFile *sf) {
+    sf->id = (uint32_t) src_ids.size;
+    *(SrcFile **) vec_push(&src_ids) = sf;
 
-    if (r->cur == '\\') {
-        r->cur = (*r->ptr == '\n' ? ' ' : *r->ptr);
-        r->ptr++;
+    vec_push(&src_addrs);
+    SrcFile **addrs = src_addrs.ptr;
+    size_t i = src_addrs.size - 1;
+
+    for ( ; i > 0 && addrs[i - 1]->content.ptr > sf->content.ptr; i--) {
+        addrs[i] = addrs[i - 1];
     }
 
-    return true;
+    addrs[i] = sf;
 }
 
-static void read_while(struct reader *r, int (*cmp)(int)) {
-    bool cond = true;
-    while (readnext(r) && (cond = cmp(r->cur)))
-        ;
+// File whose content p points into, NULL for text made by the preprocessor
+static SrcFile *find_src(byte *p) {
+    SrcFile **addrs = src_addrs.ptr;
+    size_t lo = 0, hi = src_addrs.size;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
 
-    if (!cond) {
-        r->ptr--;
+        if (addrs[mid]->content.ptr <= p) lo = mid + 1;
+        else hi = mid;
     }
+
+    if (lo == 0 || p >= addrs[lo - 1]->content.end) return NULL;
+    return addrs[lo - 1];
 }
 
-static void read_until(struct reader *r, int (*cmp)(int)) {
-    bool cond = true;
-    while (readnext(r) && !(cond = cmp(r->cur)))
-        ;
+// 1-based line of the offset, the offset of the line start goes to line_start
+static int src_line(SrcFile *sf, size_t offset, size_t *line_start) {
+    if (sf->lines.size == 0) {
+        *(size_t *) vec_push(&sf->lines) = 0;
+
+        for (byte *cp = sf->content.ptr; cp < sf->content.end; cp++) {
+            if (*cp == '\n') *(size_t *) vec_push(&sf->lines) = cp + 1 - sf->content.ptr;
+        }
+    }
+
+    size_t *lines = sf->lines.ptr;
+    size_t lo = 0, hi = sf->lines.size;
 
-    if (cond) {
-        r->ptr--;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (lines[mid] <= offset) lo = mid + 1;
+        else hi = mid;
     }
+
+    if (line_start != NULL) *line_start = lines[lo - 1];
+    return (int) lo;
 }
 
-static void read_until_char(struct reader *r, byte c) {
-    bool cond = true;
-    while (readnext(r) && !(cond = (c == r->cur)))
+// Line of the offset as the #line directives before it tell, and the path they give
+static int presumed_line(SrcFile *sf, size_t offset, char **path) {
+    LineDirective *ld = sf->line_directives.ptr;
+    size_t i = sf->line_directives.size;
+    int line = src_line(sf, offset, NULL);
+
+    for ( ; i > 0 && ld[i - 1].offset > offset; i--)
         ;
 
-    if (cond) {
-        r->ptr--;
+    *path = i > 0 && ld[i - 1].path != NULL ? ld[i - 1].path : sf->path;
+    return i > 0 ? ld[i - 1].line + line - src_line(sf, ld[i - 1].offset, NULL) : line;
+}
+
+// Include prefetching. Every file read is scanned for #include lines as plain text, and the headers
+// they name are looked for and read on I/O threads. When the main thread gets to an include it takes
+// what is ready, does itself what nobody started yet and waits for the rest. The threads only use
+// malloc, the pool and the lexer stay on the main thread.
+
+typedef enum {
+    PREFETCH_QUEUED,
+    PREFETCH_RUNNING,
+    PREFETCH_DONE,
+} PrefetchState;
+
+typedef struct Prefetch {
+    char *key;   // Path of a file to read, or <name> of a header to look for on the search paths
+    char *path;  // Where the header was found
+    byte *data;  // NULL when the file couldn't be read
+    size_t size;
+    PrefetchState state;
+    struct Prefetch *next;
+    struct Prefetch *next_job;
+} Prefetch;
+
+#define PREFETCHES_SIZE 1024
+static Prefetch *prefetches[PREFETCHES_SIZE];
+static Prefetch *prefetch_jobs, **prefetch_jobs_tail = &prefetch_jobs;
+static pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+static int prefetch_threads, prefetch_started;
+
+// Threads are started on the first prefetch and stay, 0 stops using them
+void prep_prefetch_set(int nthreads) {
+    prefetch_threads = nthreads;
+}
+
+// Same as src_dirpath(), "." when the path has no directory
+static char *join_dir(char *path, byte *name, size_t name_len) {
+    char *slash = strrchr(path, '/');
+    size_t dir_len = slash != NULL ? slash - path : 1;
+
+    char *joined = malloc(dir_len + 1 + name_len + 1);
+    assert(joined != NULL);
+    memcpy(joined, slash != NULL ? path : ".", dir_len);
+    joined[dir_len] = '/';
+    memcpy(joined + dir_len + 1, name, name_len);
+    joined[dir_len + 1 + name_len] = '\0';
+
+    return joined;
+}
+
+static Prefetch *find_prefetch(char *key) {
+    uint h = hash((Span) {(byte *) key, (byte *) key + strlen(key)}, PREFETCHES_SIZE);
+
+    for (Prefetch *p = prefetches[h]; p != NULL; p = p->next) {
+        if (strcmp(p->key, key) == 0) return p;
     }
+
+    return NULL;
 }
 
-static void read_spaces_until_lf(struct reader *r) {
-    while (readnext(r) && isspace(r->cur) && r->cur != '\n')
-        ;
+static void *prefetch_worker(void *arg);
+
+// Takes over the key, the lock is held
+static void queue_prefetch(char *key) {
+    if (find_prefetch(key) != NULL) {
+        free(key);
+        return;
+    }
+
+    uint h = hash((Span) {(byte *) key, (byte *) key + strlen(key)}, PREFETCHES_SIZE);
+    Prefetch *p = calloc(1, sizeof(Prefetch));
+    assert(p != NULL);
+
+    p->key = key;
+    p->state = PREFETCH_QUEUED;
+    p->next = prefetches[h];
+    prefetches[h] = p;
+
+    *prefetch_jobs_tail = p;
+    prefetch_jobs_tail = &p->next_job;
+    pthread_cond_signal(&prefetch_queued);
+
+    for ( ; prefetch_started < prefetch_threads; prefetch_started++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, NULL) != 0) break;
+        pthread_detach(thread);
+    }
 }
 
-static int isid(int c) {
-    return isalnum(c) || c == '_';
+// Lines that start with #include, comments and conditionals aside. The lock is only taken to queue
+// what was found.
+static void scan_includes(char *path, byte *p, byte *end) {
+    bool line_start = true;
+    char **keys = NULL;
+    size_t nkeys = 0, keys_cap = 0;
+
+    for ( ; p < end; p++) {
+        if (*p == '\n') {
+            line_start = true;
+            continue;
+        }
+
+        if (*p == ' ' || *p == '\t') continue;
+        if (*p != '#' || !line_start) {
+            line_start = false;
+            continue;
+        }
+
+        line_start = false;
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+
+        if (end - p < 7 || memcmp(p, "include", 7) != 0) continue;
+        for (p += 7; p < end && (*p == ' ' || *p == '\t'); p++)
+            ;
+
+        if (p == end || (*p != '"' && *p != '<')) continue;
+
+        byte close = *p == '"' ? '"' : '>';
+        byte *name = p + 1;
+        for (p = name; p < end && *p != close && *p != '\n'; p++)
+            ;
+
+        if (p == end || *p != close) continue;
+
+        if (nkeys == keys_cap) {
+            keys_cap = keys_cap > 0 ? 2 * keys_cap : 16;
+            keys = realloc(keys, keys_cap * sizeof(char *));
+            assert(keys != NULL);
+        }
+
+        if (close == '"') {
+            keys[nkeys++] = join_dir(path, name, p - name);
+        } else {
+            char *key = malloc(p - name + 3);
+            assert(key != NULL);
+            sprintf(key, "<%.*s>", (int) (p - name), (char *) name);
+            keys[nkeys++] = key;
+        }
+    }
+
+    if (nkeys == 0) return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    for (size_t i = 0; i < nkeys; i++) {
+        queue_prefetch(keys[i]);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    free(keys);
 }
 
-static struct reader new_span_reader(Span sp) {
-    return (struct reader) {.ptr = sp.ptr, .end = sp.end};
+static void run_prefetch(Prefetch *p);
+
+// The entry of key once it is done, NULL if nothing asked for it
+static Prefetch *take_prefetch(char *key) {
+    pthread_mutex_lock(&prefetch_lock);
+    Prefetch *p = find_prefetch(key);
+
+    if (p != NULL && p->state == PREFETCH_QUEUED) {
+        p->state = PREFETCH_RUNNING;
+        pthread_mutex_unlock(&prefetch_lock);
+        run_prefetch(p);
+        return p;
+    }
+
+    while (p != NULL && p->state != PREFETCH_DONE) {
+        pthread_cond_wait(&prefetch_done, &prefetch_lock);
+    }
+
+    pthread_mutex_unlock(&prefetch_lock);
+    return p;
 }
 
-// TODO: Combine out and outsz
-static char *expand(Span sp, char *dirpath, DefineTable *def_table, char *out, int *outsz) {
-    char *outp = out;
-    assert(*outsz > 0);
+// The entry is PREFETCH_RUNNING and belongs to the caller
+static void run_prefetch(Prefetch *p) {
+    if (p->key[0] == '<') {
+        Span name = {(byte *) p->key + 1, (byte *) p->key + strlen(p->key) - 1};
 
-    struct reader r = new_span_reader(sp);
+        pthread_mutex_lock(&prefetch_lock);
+        char **paths = search_paths;
+        size_t npaths = search_paths_size;
+        pthread_mutex_unlock(&prefetch_lock);
 
-    while (readnext(&r)) {
-        if (r.cur == '#') {
-            read_while(&r, isspace);
-            Span directive = {r.ptr, r.ptr};
-            read_until(&r, isspace);
-            directive.end = r.ptr;
+        for (size_t i = 0; i < npaths && p->path == NULL; i++) {
+            char *path = malloc(strlen(paths[i]) + 1 + (name.end - name.ptr) + 1);
+            assert(path != NULL);
+            sprintf(path, "%s/%.*s", paths[i], (int) (name.end - name.ptr), (char *) name.ptr);
 
-            if (spanstrcmp(directive, "include") == 0) {
-                read_while(&r, isspace);
+            if (file_exists(path)) p->path = path;
+            else free(path);
+        }
 
-                if (r.cur == '"') {
-                    readnext(&r);
-                    Span local_path = {r.ptr, r.ptr};
+        if (p->path != NULL) {
+            pthread_mutex_lock(&prefetch_lock);
+            queue_prefetch(strdup(p->path));
+            pthread_mutex_unlock(&prefetch_lock);
+        }
+    } else {
+        FILE *f = fopen(p->key, "r");
 
-                    read_until_char(&r, '"');
-                    local_path.end = r.ptr;
+        if (f != NULL && fseek(f, 0, SEEK_END) == 0) {
+            long size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+            p->data = size >= 0 ? malloc(size + 1) : NULL;
 
-                    assert(r.cur == '"');
-                    readnext(&r);
+            if (p->data != NULL && fread(p->data, 1, size, f) == (size_t) size) {
+                p->size = size;
+            } else {
+                free(p->data);
+                p->data = NULL;
+            }
+        }
 
-                    read_spaces_until_lf(&r);
-                    char *inc_path = path_join_ssp(dirpath, local_path);
+        if (f != NULL) fclose(f);
+        if (p->data != NULL) scan_includes(p->key, p->data, p->data + p->size);
+    }
 
-                    outp = prep_expand(inc_path, def_table, outp, outsz);
-                } else if (r.cur == '<') {
-                    readnext(&r);
-                    Span ext_path = {r.ptr, r.ptr};
+    pthread_mutex_lock(&prefetch_lock);
+    p->state = PREFETCH_DONE;
+    pthread_cond_broadcast(&prefetch_done);
+    pthread_mutex_unlock(&prefetch_lock);
+}
 
-                    read_until_char(&r, '>');
-                    ext_path.end = r.ptr;
+static void *prefetch_worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&prefetch_lock);
 
-                    assert(r.cur == '>');
-                    readnext(&r);
+        while (prefetch_jobs == NULL) {
+            pthread_cond_wait(&prefetch_queued, &prefetch_lock);
+        }
 
-                    read_spaces_until_lf(&r);
+        Prefetch *p = prefetch_jobs;
+        prefetch_jobs = p->next_job;
+        if (prefetch_jobs == NULL) prefetch_jobs_tail = &prefetch_jobs;
 
-                    char *inc_path = NULL;
-                    for (int i = 0; i < search_paths_size; i++) {
-                        char *p = search_paths[i];
-                        inc_path = path_join_ssp(p, ext_path);
-                        if (file_exists(inc_path)) break;
-                    }
+        bool claimed = p->state == PREFETCH_QUEUED;
+        if (claimed) p->state = PREFETCH_RUNNING;
+        pthread_mutex_unlock(&prefetch_lock);
 
-                    assert(inc_path != NULL);
-                    outp = prep_expand(inc_path, def_table, outp, outsz);
-                }
-            } else if (spanstrcmp(directive, "define") == 0) {
-                read_while(&r, isspace);
+        if (claimed) run_prefetch(p);
+    }
 
-                Span id = {r.ptr, r.ptr};
+    return arg;
+}
 
-                read_until(&r, isspace);
-                id.end = r.ptr;
-                while (readnext(&r) && isspace(r.cur) && r.cur != '\n')
-                    ;
+// NULL if the file can't be read
+static SrcFile *load_src(char *path) {
+    Span key = {(byte *) path, (byte *) path + strlen(path)};
+    uint h = hash(key, SRC_FILES_SIZE);
 
-                Span *content = pool_alloc_struct(Span);
-                if (r.cur == '\n') {
-                    content->ptr = content->end = NULL;
-                } else {
-                    content->ptr = content->end = r.ptr-1;
-                    read_until_char(&r, '\n');
-                    content->end = r.ptr;
-                    read_spaces_until_lf(&r);
-                }
+    for (SrcFile *sf = src_files[h]; sf != NULL; sf = sf->next) {
+        if (strcmp(sf->path, path) == 0) return sf;
+    }
+
+    Prefetch *p = prefetch_threads > 0 ? take_prefetch(path) : NULL;
+    byte *data;
+    size_t size;
 
-                prep_define_set(def_table, id, content);
-            } else if (spanstrcmp(directive, "ifdef") == 0 || spanstrcmp(directive, "ifndef") == 0) {
-                read_while(&r, isspace);
+    if (p != NULL && p->data != NULL) {
+        data = p->data;
+        size = p->size;
+    } else {
+        FILE *f = fopen(path, "r");
+        long fsize = f != NULL && fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
 
-                Span id = {r.ptr, r.ptr};
+        if (fsize < 0) {
+            fprintf(stderr, "expand: cannot read %s\n", path);
+            if (f != NULL) fclose(f);
+            return NULL;
+        }
 
-                read_until(&r, isspace);
-                id.end = r.ptr;
+        size = fsize;
+        fseek(f, 0, SEEK_SET);
+        data = pool_alloc(size, byte);
+        size_t rsz = fread(data, 1, size, f);
+        fclose(f);
 
-                read_spaces_until_lf(&r);
+        if (rsz != size) {
+            fprintf(stderr, "expand: cannot read %s\n", path);
+            return NULL;
+        }
 
-                Span content = {r.ptr, r.ptr};
+        if (prefetch_threads > 0) scan_includes(path, data, data + size);
+    }
 
-                char *term = "#endif";
-                size_t termlen = strlen(term);
-                for ( ; content.end + termlen <= sp.end; content.end++) {
-                    if (spanstrcmp((Span){content.end, content.end + termlen}, term) == 0) {
-                        if (*(content.end-1) == '\n') content.end--;
-                        break;
-                    }
-                }
+    SrcFile *sf = pool_alloc_struct(SrcFile);
+    sf->path = pool_alloc_copy_str(path);
+    sf->content = (Span) {data, data + size};
+    sf->lines.item_size = sizeof(size_t);
+    sf->line_directives.item_size = sizeof(LineDirective);
 
-                void *repl = prep_define_get(def_table, id);
+    char *once_name = pool_alloc(strlen(path) + 14, char); // No identifier has spaces
+    sprintf(once_name, "#pragma once %s", path);
+    sf->once_name = (Span) {(byte *) once_name, (byte *) once_name + strlen(once_name)};
+    sf->next = src_files[h];
+    src_files[h] = sf;
+    add_src(sf);
 
-                if ((spanstrcmp(directive, "ifdef") == 0) && repl || (spanstrcmp(directive, "ifndef") == 0 && !repl)) {
-                    outp = expand(content, dirpath, def_table, outp, outsz);
-                }
+    return sf;
+}
 
-                r.ptr = content.end + termlen + (*content.end == '\n' ? 1 : 0);
-            } else if (spanstrcmp(directive, "undef") == 0) {
-                read_while(&r, isspace);
+// With tracing on, every expanded file is a node of the include tree, the main files are the roots.
+// Times and counts include the subtree, self values are what is left after the children.
+typedef struct TraceNode {
+    char *path;
+    SrcFile *file;
+    uint64_t start;
+    uint64_t resolve_ns;
+    uint64_t read_ns;
+    uint64_t total_ns;
+    size_t bytes;
+    size_t defines;
+    struct TraceNode *parent;
+    struct TraceNode *children;
+    struct TraceNode **children_tail;
+    struct TraceNode *next;
+} TraceNode;
+
+static bool tracing;
+static TraceNode *trace_roots, **trace_roots_tail = &trace_roots;
+static TraceNode *trace_current;
+static size_t trace_defines;
+static uint64_t trace_epoch;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-                Span id = {r.ptr, r.ptr};
+void prep_trace_set(bool on) {
+    tracing = on;
+    if (on && trace_epoch == 0) trace_epoch = now_ns();
+}
 
-                read_until(&r, isspace);
-                id.end = r.ptr;
+// resolve_start is when looking for the file began
+static TraceNode *trace_push(char *path, uint64_t resolve_start, Output *out) {
+    TraceNode *node = pool_alloc_struct(TraceNode);
+    node->path = path;
+    node->start = now_ns();
+    node->resolve_ns = node->start - resolve_start;
+    node->bytes = out->offset;
+    node->defines = trace_defines;
+    node->parent = trace_current;
+    node->children_tail = &node->children;
+
+    TraceNode ***tail = trace_current != NULL ? &trace_current->children_tail : &trace_roots_tail;
+    **tail = node;
+    *tail = &node->next;
+
+    trace_current = node;
+    return node;
+}
 
-                read_spaces_until_lf(&r);
+static void trace_pop(TraceNode *node, Output *out) {
+    node->total_ns = now_ns() - node->start;
+    node->bytes = out->offset - node->bytes;
+    node->defines = trace_defines - node->defines;
+    trace_current = node->parent;
+}
 
-                prep_define_set(def_table, id, NULL);
-            } else if (spanstrcmp(directive, "if") == 0) {
-                read_while(&r, isspace);
+static void write_trace_event(FILE *f, TraceNode *node, bool *first) {
+    fprintf(f, "%s\n{\"name\": \"", *first ? "" : ",");
+    *first = false;
 
-                Span expr = {r.ptr, r.ptr};
+    for (char *cp = node->path; *cp != '\0'; cp++) {
+        if (*cp == '"' || *cp == '\\') fputc('\\', f);
+        fputc(*cp, f);
+    }
 
-                read_until_char(&r, '\n');
-                expr.end = r.ptr;
+    fprintf(f, "\", \"cat\": \"include\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, ",
+            (node->start - trace_epoch) / 1e3, node->total_ns / 1e3);
+    fprintf(f, "\"args\": {\"resolve_us\": %.3f, \"read_us\": %.3f, \"bytes\": %zu, \"defines\": %zu}}",
+            node->resolve_ns / 1e3, node->read_ns / 1e3, node->bytes, node->defines);
 
-                read_spaces_until_lf(&r);
-                Span content = {r.ptr, r.ptr};
+    for (TraceNode *child = node->children; child != NULL; child = child->next) {
+        write_trace_event(f, child, first);
+    }
+}
 
-                char *term = "#endif";
-                size_t termlen = strlen(term);
-                for ( ; content.end + termlen <= sp.end; content.end++) {
-                    if (spanstrcmp((Span){content.end, content.end + termlen}, term) == 0) {
-                        if (*(content.end-1) == '\n') content.end--;
-                        break;
-                    }
-                }
+// Chrome trace event format, for chrome://tracing or Perfetto
+void prep_trace_write_json(FILE *f) {
+    bool first = true;
+    fprintf(f, "{\"traceEvents\": [");
 
-                if (eval_expr(expr, def_table)) {
-                    outp = expand(content, dirpath, def_table, outp, outsz);
-                }
+    for (TraceNode *root = trace_roots; root != NULL; root = root->next) {
+        write_trace_event(f, root, &first);
+    }
 
-                r.ptr = content.end + termlen + (*content.end == '\n' ? 1 : 0);
-            } else {
-                fprintf(stderr, "expand: unrecognized directive '");
-                for (byte *cp = directive.ptr; cp < directive.end; cp++) {
-                    fprintf(stderr, "%c", *cp);
-                }
-                fprintf(stderr, "'\n");
-                assert(0);
-            }
-        } else if (r.cur == '/') {
-            Span comment = {r.ptr-1, r.ptr};
-
-            if (comment.end < sp.end) {
-                if (*comment.end == '/') {
-                    for (; comment.end < sp.end && *comment.end != '\n' ; comment.end++)
-                        ;
-                } else if (*comment.end == '*') {
-                    for (; comment.end+1 < sp.end && (*comment.end != '*' || *(comment.end+1) != '/'); comment.end++)
-                        ;
-
-                    comment.end += 2;
-                }
-            }
+    fprintf(f, "\n]}\n");
+}
 
-            for (byte *cp = comment.ptr; cp < sp.end && cp < comment.end; cp++) {
-                *outp++ = (char) *cp;
-                *outsz -= 1;
-            }
-            r.ptr = comment.end;
-        } else if (r.cur == '"' || r.cur == '\'') {
-            byte quote = r.cur;
-            Span literal = {r.ptr-1};
-
-            while (readnext(&r)) {
-                if (r.cur == '\\') {
-                    readnext(&r);
-                } else if (r.cur == quote) {
-                    break;
-                }
-            }
-            literal.end = r.ptr;
+typedef struct {
+    char *path;
+    int count;
+    uint64_t total_ns;
+    uint64_t self_ns;
+    uint64_t io_ns;
+    size_t bytes;
+    size_t defines;
+} TraceSummary;
+
+static void summarize_trace(TraceNode *node, TraceSummary *files, bool *open) {
+    uint32_t id = node->file != NULL ? node->file->id : 0;
+    bool outer = node->file != NULL && !open[id];
+    if (outer) open[id] = true;
+
+    uint64_t children_ns = 0;
+    size_t children_bytes = 0, children_defines = 0;
+
+    for (TraceNode *child = node->children; child != NULL; child = child->next) {
+        summarize_trace(child, files, open);
+        children_ns += child->total_ns;
+        children_bytes += child->bytes;
+        children_defines += child->defines;
+    }
 
-            for (byte *cp = literal.ptr; cp < sp.end && cp < literal.end; cp++) {
-                *outp++ = (char) *cp;
-                *outsz -= 1;
-            }
-        } else if (isalpha(r.cur)) {
-            Span id = {r.ptr-1, r.ptr};
-            read_while(&r, isid);
-            id.end = r.ptr;
+    if (node->file == NULL) return;
+    if (outer) open[id] = false;
+
+    // A file included from within itself only adds to its total from the outermost include
+    TraceSummary *sum = &files[id];
+    sum->path = node->path;
+    sum->count++;
+    sum->self_ns += node->total_ns - children_ns;
+    sum->io_ns += node->resolve_ns + node->read_ns;
+    sum->bytes += node->bytes - children_bytes;
+    sum->defines += node->defines - children_defines;
+    if (outer) sum->total_ns += node->total_ns;
+}
 
-            Span *repl = (Span *) prep_define_get(def_table, id);
+static int cmp_summary(const void *a, const void *b) {
+    const TraceSummary *sa = a, *sb = b;
+    return sa->total_ns < sb->total_ns ? 1 : sa->total_ns > sb->total_ns ? -1 : 0;
+}
 
-            if (repl == NULL) {
-                for ( ; id.ptr < id.end; id.ptr++) {
-                    *outp++ = (char) *id.ptr;
-                    *outsz -= 1;
-                }
-            } else {
-                struct reader replr = new_span_reader(*repl);
+// One line per file, the slowest first. Bytes and defines are the file's own.
+void prep_trace_write_summary(FILE *f) {
+    TraceSummary *files = calloc(src_ids.size + 1, sizeof(TraceSummary));
+    bool *open = calloc(src_ids.size + 1, sizeof(bool));
+    assert(files != NULL && open != NULL);
 
-                while (readnext(&replr)) {
-                    *outp++ = (char) replr.cur;
-                    *outsz -= 1;
-                }
-            }
-        } else {
-            *outp++ = (char) r.cur;
-            *outsz -= 1;
+    for (TraceNode *root = trace_roots; root != NULL; root = root->next) {
+        summarize_trace(root, files, open);
+    }
+
+    qsort(files, src_ids.size, sizeof(TraceSummary), cmp_summary);
+    fprintf(f, "%10s %10s %10s %6s %10s %8s  %s\n", "total ms", "self ms", "io ms", "count", "bytes", "defines", "file");
+
+    for (size_t i = 0; i < src_ids.size && files[i].count > 0; i++) {
+        TraceSummary *sum = &files[i];
+        fprintf(f, "%10.3f %10.3f %10.3f %6d %10zu %8zu  %s\n", sum->total_ns / 1e6, sum->self_ns / 1e6,
+                sum->io_ns / 1e6, sum->count, sum->bytes, sum->defines, sum->path);
+    }
+
+    free(files);
+    free(open);
+}
+
+static SrcFile *lex_src(char *path) {
+    uint64_t start = tracing ? now_ns() : 0;
+    SrcFile *sf = load_src(path);
+    if (sf == NULL) return NULL;
+
+    if (sf->tokens == NULL) {
+        int nlines;
+        LexerError err;
+        sf->tokens = tokenize(sf->content.ptr, sf->content.end - sf->content.ptr, &nlines, &err);
+
+        if (sf->tokens == NULL) {
+            fprintf(stderr, "expand: %s:%d:%d: unexpected character '%c'\n", path, err.line, err.column, err.token);
         }
     }
 
-    return outp;
+    if (tracing && trace_current != NULL) {
+        trace_current->read_ns += now_ns() - start;
+        if (trace_current->file == NULL) trace_current->file = sf;
+    }
+
+    return sf;
 }
 
-enum tokenType {
-    PREP_UNKNOWN_TOKEN,
-    PREP_PLUS_TOKEN,
-    PREP_IDENTIFIER_TOKEN,
-    PREP_DEFINED_TOKEN,
-    PREP_OPEN_PAREN_TOKEN, PREP_CLOSE_PAREN_TOKEN,
-    PREP_AND_TOKEN
-};
+// Files expanded while a snapshot is being recorded
+static Vec *snapshot_deps;
 
-struct prepToken {
-    enum tokenType type;
-    Span span;
-};
+static char *src_dirpath(char *srcfile) {
+    char *srcdir_end;
+
+    for (srcdir_end = srcfile + strlen(srcfile); srcdir_end >= srcfile && *srcdir_end != '/'; srcdir_end--)
+        ;
+
+    char *dirpath;
+    if (srcdir_end >= srcfile) {
+        dirpath = pool_alloc(srcdir_end - srcfile + 1, char);
+        strncpy(dirpath, srcfile, srcdir_end - srcfile);
+    } else {
+        dirpath = pool_alloc(1 + 1, char);
+        strncpy(dirpath, ".", 1);
+    }
 
-static struct prepToken tokens[128];
-static int stack[64];
-static int stackTop = 0;
+    return dirpath;
+}
+
+static void expand_file(char *srcfile, DefineTable *def_table, Output *out) {
+    if (snapshot_deps != NULL) *(char **) vec_push(snapshot_deps) = srcfile;
 
-static void push(int x) {
-    assert(stackTop < 64);
-    stack[stackTop++] = x;
+    SrcFile *sf = lex_src(srcfile);
+    if (sf == NULL || sf->tokens == NULL || prep_define_get(def_table, sf->once_name) != NULL) return;
+
+    Cursor c = {sf->tokens, sf->content.ptr, sf->content.end};
+    expand(&c, src_dirpath(srcfile), def_table, out);
 }
 
-static int pop() {
-    assert(stackTop > 0);
-    return stack[--stackTop];
+static void expand_output(char *srcfile, DefineTable *def_table, Output *out) {
+    out->map = source_map;
+    out->markers = line_markers;
+    out->bol = true;
+    if (source_map != NULL) source_map->ranges.size = 0;
+
+    TraceNode *node = tracing ? trace_push(srcfile, now_ns(), out) : NULL;
+    expand_main(srcfile, def_table, out);
+    if (node != NULL) trace_pop(node, out);
+
+    if (source_map != NULL) source_map->size = out->offset;
 }
 
-static struct prepToken *eval(DefineTable *def_table, struct prepToken *tokenp, struct prepToken *end_token);
+char *prep_expand(char *srcfile, DefineTable *def_table, char *out, int *outsz) {
+    Output o = {.outp = out, .outsz = outsz};
+    expand_output(srcfile, def_table, &o);
+    return o.outp;
+}
 
-static bool eval_expr(Span expr, DefineTable *def_table) {
-    byte *p;
-    struct prepToken *tp = tokens;
-
-    for (p = expr.ptr; p < expr.end;) {
-        if (*p == '+') {
-            *tp++ = (struct prepToken) {PREP_PLUS_TOKEN, p, p + 1};
-        } else if (*p == '&') {
-            struct prepToken tok = {PREP_AND_TOKEN, p, p};
-            p++;
-            assert(*p == '&');
-            p++;
-            tok.span.end = p;
-            *tp++ = tok;
-        } else if (isalpha(*p) || *p == '_') {
-            struct prepToken tok = {PREP_IDENTIFIER_TOKEN, p, p};
-            for ( ; isalnum(*p) || *p == '_' ; p++, tok.span.end++)
-                ;
-
-            if (spanstrcmp(tok.span, "DEFINED") == 0 || spanstrcmp(tok.span, "defined") == 0) tok.type = PREP_DEFINED_TOKEN;
-
-            *tp++ = tok;
-        } else if (isspace(*p)) {
-            p++;
-        } else {
-            assert(0);
+Token *prep_expand_tokens(char *srcfile, DefineTable *def_table) {
+    Output o = {.head = NULL};
+    o.tail = &o.head;
+    expand_output(srcfile, def_table, &o);
+
+    for (int i = 0; i < 4; i++) { // Same lookahead padding as the lexer output
+        Token *stub = pool_alloc_struct(Token);
+        stub->type = STUB_TOKEN;
+        *o.tail = stub;
+        o.tail = &stub->next;
+    }
+
+    return o.head;
+}
+
+static bool cursor_done(Cursor *c) {
+    return c->tok == NULL || c->tok->type == STUB_TOKEN || c->pos >= c->end;
+}
+
+// What is left of the current token
+static Span cursor_span(Cursor *c) {
+    return (Span) {c->pos, min(c->tok->span.end, c->end)};
+}
+
+static void cursor_next(Cursor *c) {
+    c->tok = c->tok->next;
+    if (c->tok != NULL) c->pos = c->tok->span.ptr;
+}
+
+static bool is_space(Token *t) {
+    return t->type == WHITESPACE_TOKEN || t->type == LINE_COMMENT_TOKEN || t->type == MULTI_COMMENT_TOKEN;
+}
+
+static bool is_directive(Token *t) {
+    return t->type == INCLUDE_TOKEN || t->type == DEFINE_TOKEN || t->type == PREP_DIRECTIVE_TOKEN;
+}
+
+// Newline that isn't a line continuation, the first one or the last one
+static byte *find_newline(Span ws, bool last) {
+    byte *found = NULL;
+
+    for (byte *cp = ws.ptr; cp < ws.end; cp++) {
+        if (*cp == '\n' && (cp == ws.ptr || *(cp - 1) != '\\')) {
+            found = cp;
+            if (!last) break;
         }
     }
 
-    struct prepToken *end_token = tp;
+    return found;
+}
+
+// Moves c past the newline that ends the current line
+static void skip_line(Cursor *c) {
+    for ( ; !cursor_done(c); cursor_next(c)) {
+        byte *nl;
 
-    for (struct prepToken *t = tokens; t < end_token; ) {
-        t = eval(def_table, t, end_token);
+        if (c->tok->type == WHITESPACE_TOKEN && (nl = find_newline(cursor_span(c), false)) != NULL) {
+            c->pos = nl + 1;
+            if (c->pos == c->tok->span.end) cursor_next(c);
+            return;
+        }
     }
-    return (bool) pop();
 }
 
-static struct prepToken *eval(DefineTable *def_table, struct prepToken *tokenp, struct prepToken *end_token) {
-    switch (tokenp->type) {
-        case PREP_DEFINED_TOKEN: {
-            push(prep_define_get(def_table, (tokenp + 1)->span) != NULL);
-            tokenp += 2;
-        } break;
-        case PREP_AND_TOKEN: {
-            tokenp = eval(def_table, tokenp + 1, end_token);
-            push(pop() && pop());
-        } break;
-        default: {
-            assert(0);
-        } break;
+static Token *new_token(TokenType type, Span sp, Token *at) {
+    Token *t = pool_alloc_struct(Token);
+    t->type = type;
+    t->span = sp;
+
+    if (at != NULL) {
+        t->line = at->line;
+        t->column = at->column;
+    }
+
+    return t;
+}
+
+// The source map is a list of ranges sorted by their start in the output. Inside a range the output
+// follows the file byte by byte, except in the output of an invocation, which all maps to the
+// invocation.
+
+#define NO_FILE UINT32_MAX
+
+typedef struct {
+    size_t out;
+    size_t src;
+    uint32_t file; // Id of the SrcFile, NO_FILE for text made by the preprocessor
+    bool fixed;
+} MapRange;
+
+SourceMap *prep_source_map_new() {
+    SourceMap *map = pool_alloc_struct(SourceMap);
+    map->ranges.item_size = sizeof(MapRange);
+    return map;
+}
+
+bool prep_source_map_lookup(SourceMap *map, size_t offset, SourcePos *pos) {
+    MapRange *ranges = map->ranges.ptr;
+    size_t lo = 0, hi = map->ranges.size;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+
+        if (ranges[mid].out <= offset) lo = mid + 1;
+        else hi = mid;
+    }
+
+    if (lo == 0 || offset >= map->size) return false;
+
+    MapRange *r = &ranges[lo - 1];
+    pos->expanded = r->fixed;
+
+    if (r->file == NO_FILE) {
+        pos->path = NULL;
+        pos->offset = 0;
+        pos->line = pos->column = 0;
+        return true;
+    }
+
+    SrcFile *sf = ((SrcFile **) src_ids.ptr)[r->file];
+    size_t line_start;
+
+    pos->path = sf->path;
+    pos->offset = r->fixed ? r->src : r->src + (offset - r->out);
+    pos->line = src_line(sf, pos->offset, &line_start);
+    pos->column = (int) (pos->offset - line_start) + 1;
+    return true;
+}
+
+// The output from here on comes from src, or from the invocation being expanded
+static void map_output(Output *out, byte *src) {
+    if (out->origin != NULL) src = out->origin;
+
+    SrcFile *sf = find_src(src);
+    MapRange r = {out->offset, sf ? src - sf->content.ptr : 0, sf ? sf->id : NO_FILE, out->origin != NULL};
+    Vec *ranges = &out->map->ranges;
+
+    if (ranges->size > 0) {
+        MapRange *last = (MapRange *) ranges->ptr + ranges->size - 1;
+        size_t follows = last->fixed || last->file == NO_FILE ? last->src : last->src + (out->offset - last->out);
+
+        if (last->file == r.file && last->fixed == r.fixed && follows == r.src) return;
+        if (last->out == out->offset) ranges->size--; // Nothing was written in it
     }
 
-    return tokenp;
-}
\ No newline at end of file
+    *(MapRange *) vec_push(ranges) = r;
+}
+
+static void write_output(Output *out, TokenType type, Span sp, Token *at) {
+    if (out->map != NULL) map_output(out, sp.ptr);
+
+    if (out->outp == NULL) {
+        Token *t = new_token(type, sp, at);
+        *out->tail = t;
+        out->tail = &t->next;
+        out->offset += sp.end - sp.ptr;
+
+        for (byte *cp = sp.ptr; cp < sp.end; cp++) {
+            if (*cp == '\n') out->line++;
+        }
+
+        out->bol = *(sp.end - 1) == '\n';
+        return;
+    }
+
+    for (byte *cp = sp.ptr; cp < sp.end; cp++) {
+        char c = (char) *cp;
+        bool continuation = type == WHITESPACE_TOKEN && c == '\\' && cp + 1 < sp.end && *(cp + 1) == '\n';
+
+        if (continuation) { // Continuations read as a space
+            c = ' ';
+            cp++;
+        }
+
+        *out->outp++ = c;
+        *out->outsz -= 1;
+        out->offset++;
+        if (c == '\n') out->line++;
+
+        if (continuation && out->map != NULL && cp + 1 < sp.end) map_output(out, cp + 1);
+    }
+
+    out->bol = *(out->outp - 1) == '\n';
+}
+
+// Before a line that doesn't come right after the last one, outside of invocations
+static void write_line_marker(Output *out, byte *p, Token *at) {
+    SrcFile *sf;
+    if (!out->bol || out->origin != NULL || (sf = find_src(p)) == NULL) return;
+
+    char *path;
+    int line = presumed_line(sf, p - sf->content.ptr, &path);
+    if (out->line_path != NULL && strcmp(path, out->line_path) == 0 && line == out->line) return;
+
+    int len = snprintf(NULL, 0, "#line %d \"%s\"", line, path);
+    byte *marker = pool_alloc(len + 2, byte);
+    sprintf((char *) marker, "#line %d \"%s\"\n", line, path);
+
+    write_output(out, PREP_DIRECTIVE_TOKEN, (Span) {marker, marker + len}, at);
+    write_output(out, WHITESPACE_TOKEN, (Span) {marker + len, marker + len + 1}, at);
+    out->line_path = path;
+    out->line = line;
+}
+
+static void emit(Output *out, TokenType type, Span sp, Token *at) {
+    if (sp.ptr >= sp.end) return;
+
+    if (!out->markers) {
+        write_output(out, type, sp, at);
+        return;
+    }
+
+    while (sp.ptr < sp.end) { // Line by line, a marker can only go at the start of one
+        byte *eol = memchr(sp.ptr, '\n', sp.end - sp.ptr);
+        Span line = {sp.ptr, eol != NULL ? eol + 1 : sp.end};
+
+        write_line_marker(out, sp.ptr, at);
+        write_output(out, type, line, at);
+        sp.ptr = line.end;
+    }
+}
+
+static bool span_eq(Span sp1, Span sp2) {
+    size_t len = sp1.end - sp1.ptr;
+    return len == sp2.end - sp2.ptr && (len == 0 || memcmp(sp1.ptr, sp2.ptr, len) == 0);
+}
+
+// Macros are expanded on preprocessing tokens made from the lexer tokens. A token remembers the whitespace
+// and comments in front of it, so text that goes through an expansion keeps its original spacing.
+
+typedef enum {
+    PP_IDENTIFIER,
+    PP_NUMBER,
+    PP_CHAR,
+    PP_STRING,
+    PP_PUNCT,
+    PP_PARAM,           // Parameter in a replacement list
+    PP_STRINGIFY,       // # before a parameter in a replacement list
+    PP_PASTE,           // ## in a replacement list
+    PP_PLACEMARKER,     // Empty ## operand
+    PP_DEFINED,         // `defined X` in #if, the span is X
+} PPTokenType;
+
+typedef struct HideSet {
+    Span name;
+    struct HideSet *next;
+} HideSet;
+
+// Whitespace and comments in front of a token. first is the lexer token the span starts in
+typedef struct {
+    Span span;
+    Token *first;
+} Space;
+
+typedef struct PPToken {
+    PPTokenType type;
+    Span span;
+    Token *tok;         // Lexer token it was made from, or a new one for # and ## results
+    Space ws;
+    int param;
+    HideSet *hideset;
+    struct PPToken *next;
+} PPToken;
+
+typedef struct {
+    PPToken *head;
+    PPToken **tail;
+    PPToken **last;     // Link to the last token
+} TokenList;
+
+typedef struct Macro Macro;
+
+typedef struct {
+    Span name;
+    Macro *macro;
+} MacroDep;
+
+struct Macro {
+    Span name;
+    bool funclike;
+    bool variadic;
+    int nparams;
+    Span *params;
+    PPToken *body;
+
+    // Full expansion of an object-like macro, reused while every macro it looked up resolves the same way
+    bool memoized;
+    bool no_memo;
+    PPToken *expansion;
+    MacroDep *deps;
+    size_t deps_size;
+    DefineTable *memo_table;
+    size_t memo_generation;
+};
+
+typedef struct {
+    DefineTable *table;
+    Cursor *src;        // Source to continue an invocation from once the tokens run out, NULL if there's none
+    Vec *deps;          // MacroDep of every lookup, if the result is cached
+    bool in_cond;       // `defined` is an operator
+    bool incomplete;    // The result depends on what follows the tokens
+} Expander;
+
+static PPTokenType pp_type(TokenType type) {
+    switch (type) {
+        case IDENTIFIER_TOKEN:
+        case KEYWORD_TOKEN: return PP_IDENTIFIER;
+        case NUM_LITERAL_TOKEN: return PP_NUMBER;
+        case CHAR_LITERAL_TOKEN: return PP_CHAR;
+        case S_CHAR_SEQ_TOKEN: return PP_STRING;
+        default: return PP_PUNCT;
+    }
+}
+
+// Next preprocessing token, NULL at the end of the range, at a directive or, with stop_at_newline, at the end
+// of the line. The newline itself is left to the caller
+static PPToken *next_pptoken(Cursor *c, bool stop_at_newline) {
+    Space ws = {{c->pos, c->pos}, c->tok};
+
+    for ( ; !cursor_done(c) && is_space(c->tok); cursor_next(c)) {
+        Span sp = cursor_span(c);
+        byte *nl;
+
+        if (stop_at_newline && c->tok->type == WHITESPACE_TOKEN && (nl = find_newline(sp, false)) != NULL) {
+            c->pos = nl;
+            return NULL;
+        }
+
+        ws.span.end = sp.end;
+    }
+
+    if (cursor_done(c) || is_directive(c->tok)) return NULL;
+
+    PPToken *t = pool_alloc_struct(PPToken);
+    t->type = pp_type(c->tok->type);
+    t->span = c->tok->span;
+    t->tok = c->tok;
+    t->ws = ws;
+    cursor_next(c);
+    return t;
+}
+
+static void emit_space(Output *out, Space ws) {
+    for (Token *w = ws.first; w != NULL && w->type != STUB_TOKEN && w->span.ptr < ws.span.end; w = w->next) {
+        emit(out, w->type, (Span) {max(w->span.ptr, ws.span.ptr), min(w->span.end, ws.span.end)}, w);
+    }
+}
+
+static void emit_pptokens(Output *out, PPToken *t) {
+    for ( ; t != NULL; t = t->next) {
+        emit_space(out, t->ws);
+        emit(out, t->tok->type, t->span, t->tok);
+    }
+}
+
+static bool is_punct(PPToken *t, char *str) {
+    return t != NULL && t->type == PP_PUNCT && spanstrcmp(t->span, str) == 0;
+}
+
+static void list_init(TokenList *l) {
+    l->head = NULL;
+    l->tail = &l->head;
+    l->last = NULL;
+}
+
+static void list_append(TokenList *l, PPToken *t) {
+    t->next = NULL;
+    l->last = l->tail;
+    *l->tail = t;
+    l->tail = &t->next;
+}
+
+static void list_replace_last(TokenList *l, PPToken *t) {
+    t->next = NULL;
+    *l->last = t;
+    l->tail = &t->next;
+}
+
+static void list_remove_last(TokenList *l) {
+    *l->last = NULL;
+    l->tail = l->last;
+    l->last = NULL;
+}
+
+static PPToken *list_concat(PPToken *list, PPToken *rest) {
+    if (list == NULL) return rest;
+
+    PPToken *t;
+    for (t = list; t->next != NULL; t = t->next)
+        ;
+
+    t->next = rest;
+    return list;
+}
+
+static PPToken *copy_token(PPToken *t) {
+    PPToken *c = pool_alloc_struct(PPToken);
+    *c = *t;
+    c->next = NULL;
+    return c;
+}
+
+static void append_copies(TokenList *out, PPToken *t, Space ws) {
+    for (bool first = true; t != NULL; t = t->next, first = false) {
+        PPToken *c = copy_token(t);
+        if (first) c->ws = ws;
+        list_append(out, c);
+    }
+}
+
+static bool hideset_contains(HideSet *hs, Span name) {
+    for ( ; hs != NULL; hs = hs->next) {
+        if (span_eq(hs->name, name)) return true;
+    }
+
+    return false;
+}
+
+static HideSet *hideset_add(HideSet *hs, Span name) {
+    HideSet *n = pool_alloc_struct(HideSet);
+    n->name = name;
+    n->next = hs;
+    return n;
+}
+
+static HideSet *hideset_union(HideSet *a, HideSet *b) {
+    for ( ; a != NULL; a = a->next) {
+        if (!hideset_contains(b, a->name)) b = hideset_add(b, a->name);
+    }
+
+    return b;
+}
+
+static HideSet *hideset_intersect(HideSet *a, HideSet *b) {
+    HideSet *r = NULL;
+
+    for ( ; a != NULL; a = a->next) {
+        if (hideset_contains(b, a->name)) r = hideset_add(r, a->name);
+    }
+
+    return r;
+}
+
+// Reads the rest of a #define line at c, up to the newline
+static Macro *parse_define(Cursor *c) {
+    PPToken *name = next_pptoken(c, true);
+
+    if (name == NULL || name->type != PP_IDENTIFIER) {
+        fprintf(stderr, "expand: macro name missing in #define\n");
+        return NULL;
+    }
+
+    Macro *m = pool_alloc_struct(Macro);
+    m->name = name->span;
+
+    Vec params = {.item_size = sizeof(Span)};
+
+    if (!cursor_done(c) && c->tok->type == OPEN_PAREN_TOKEN) { // Only a parenthesis right after the name starts a parameter list
+        m->funclike = true;
+        cursor_next(c);
+
+        for (bool valid = false; !valid; ) {
+            PPToken *t = next_pptoken(c, true);
+
+            if (is_punct(t, ")") && params.size == 0) break;
+
+            if (is_punct(t, "...")) {
+                m->variadic = true;
+                *(Span *) vec_push(&params) = (Span) {(byte *) "__VA_ARGS__", (byte *) "__VA_ARGS__" + 11};
+                t = next_pptoken(c, true);
+                valid = is_punct(t, ")");
+            } else if (t != NULL && t->type == PP_IDENTIFIER) {
+                *(Span *) vec_push(&params) = t->span;
+                t = next_pptoken(c, true);
+
+                if (is_punct(t, "...")) { // Named variadic parameter
+                    m->variadic = true;
+                    t = next_pptoken(c, true);
+                }
+
+                valid = is_punct(t, ")");
+                if (!valid && !m->variadic && is_punct(t, ",")) continue;
+            }
+
+            if (!valid) {
+                fprintf(stderr, "expand: invalid parameter list of macro '%.*s'\n", (int) (m->name.end - m->name.ptr), m->name.ptr);
+                free(params.ptr);
+                return NULL;
+            }
+        }
+    }
+
+    m->nparams = (int) params.size;
+    m->params = vec_copy_to_pool(&params, __alignof(Span));
+    free(params.ptr);
+
+    TokenList body;
+    list_init(&body);
+    PPToken *t, *last = NULL;
+
+    while ((t = next_pptoken(c, true)) != NULL) {
+        if (t->type == PP_IDENTIFIER) {
+            for (int i = 0; i < m->nparams; i++) {
+                if (span_eq(t->span, m->params[i])) {
+                    t->type = PP_PARAM;
+                    t->param = i;
+                    break;
+                }
+            }
+        } else if (is_punct(t, "##") || is_punct(t, "%:%:")) {
+            t->type = PP_PASTE;
+        }
+
+        if (last != NULL && m->funclike && t->type == PP_PARAM && (is_punct(last, "#") || is_punct(last, "%:"))) {
+            last->type = PP_STRINGIFY;
+        }
+
+        list_append(&body, t);
+        last = t;
+    }
+
+    if (body.head != NULL) {
+        body.head->ws = (Space) {{NULL, NULL}, NULL};
+        if (body.head->type == PP_PASTE) body.head->type = PP_PUNCT; // ## can't start or end a list
+        if (last->type == PP_PASTE) last->type = PP_PUNCT;
+    }
+
+    m->body = body.head;
+    return m;
+}
+
+static bool macro_equal(Macro *m1, Macro *m2) {
+    if (m1 == m2) return true;
+    if (m1 == NULL || m2 == NULL) return false;
+    if (m1->funclike != m2->funclike || m1->variadic != m2->variadic || m1->nparams != m2->nparams) return false;
+
+    for (int i = 0; i < m1->nparams; i++) {
+        if (!span_eq(m1->params[i], m2->params[i])) return false;
+    }
+
+    PPToken *t1, *t2;
+    for (t1 = m1->body, t2 = m2->body; t1 != NULL && t2 != NULL; t1 = t1->next, t2 = t2->next) {
+        if (t1->type != t2->type || !span_eq(t1->span, t2->span)) return false;
+        if ((t1->ws.span.ptr == t1->ws.span.end) != (t2->ws.span.ptr == t2->ws.span.end)) return false;
+    }
+
+    return t1 == t2;
+}
+
+static PPToken *expand_list(Expander *x, PPToken *input);
+
+static Macro *lookup_macro(Expander *x, Span name) {
+    Macro *m = prep_define_get(x->table, name);
+    if (x->deps != NULL) *(MacroDep *) vec_push(x->deps) = (MacroDep) {name, m};
+    return m;
+}
+
+// Makes m->expansion hold the full expansion of the object-like macro m. Fails when the expansion
+// depends on the tokens after the macro name
+static bool memoize(Expander *x, Macro *m) {
+    if (m->no_memo) return false;
+
+    bool valid = m->memoized && m->memo_table == x->table && m->memo_generation == x->table->generation;
+
+    if (m->memoized && !valid) {
+        valid = true;
+
+        for (size_t i = 0; i < m->deps_size && valid; i++) {
+            valid = prep_define_get(x->table, m->deps[i].name) == m->deps[i].macro;
+        }
+    }
+
+    if (!valid) {
+        Vec deps = {.item_size = sizeof(MacroDep)};
+        Expander y = {.table = x->table, .deps = &deps};
+        TokenList body;
+        list_init(&body);
+        append_copies(&body, m->body, (Space) {{NULL, NULL}, NULL});
+
+        HideSet *hs = hideset_add(NULL, m->name);
+        for (PPToken *t = body.head; t != NULL; t = t->next) {
+            t->hideset = hs;
+        }
+
+        PPToken *expansion = expand_list(&y, body.head);
+
+        if (y.incomplete) {
+            m->no_memo = true;
+            free(deps.ptr);
+            return false;
+        }
+
+        m->expansion = expansion;
+        m->deps = vec_copy_to_pool(&deps, __alignof(MacroDep));
+        m->deps_size = deps.size;
+        m->memoized = true;
+        free(deps.ptr);
+    }
+
+    m->memo_table = x->table;
+    m->memo_generation = x->table->generation;
+
+    if (x->deps != NULL) {
+        for (size_t i = 0; i < m->deps_size; i++) {
+            *(MacroDep *) vec_push(x->deps) = m->deps[i];
+        }
+    }
+
+    return true;
+}
+
+static PPToken *take_token(Expander *x, PPToken **input) {
+    PPToken *t = *input;
+
+    if (t != NULL) {
+        *input = t->next;
+        t->next = NULL;
+        return t;
+    }
+
+    if (x->src != NULL) return next_pptoken(x->src, false);
+
+    x->incomplete = true;
+    return NULL;
+}
+
+static PPToken *take_open_paren(Expander *x, PPToken **input) {
+    PPToken *t = *input;
+
+    if (t != NULL) {
+        if (!is_punct(t, "(")) return NULL;
+
+        *input = t->next;
+        return t;
+    }
+
+    if (x->src == NULL) {
+        x->incomplete = true;
+        return NULL;
+    }
+
+    Cursor pos = *x->src;
+    if (is_punct(t = next_pptoken(x->src, false), "(")) return t;
+
+    *x->src = pos;
+    return NULL;
+}
+
+// Takes the tokens of an invocation whose '(' was taken as they are written, commas included. Returns the
+// closing ')', or NULL if the input ends first
+static PPToken *collect_args(Expander *x, PPToken **input, TokenList *written) {
+    int depth = 0;
+    PPToken *t;
+
+    list_init(written);
+
+    while ((t = take_token(x, input)) != NULL) {
+        if (depth == 0 && is_punct(t, ")")) return t;
+
+        if (is_punct(t, "(")) depth++;
+        else if (is_punct(t, ")")) depth--;
+
+        list_append(written, t);
+    }
+
+    return NULL;
+}
+
+// Splits the tokens of an invocation of m at the commas between its arguments and returns how many there
+// are. With NULL args it only counts and the tokens are left alone.
+static int split_args(Macro *m, PPToken *written, TokenList *args) {
+    int depth = 0;
+    int nargs = 1;
+
+    for (int i = 0; args != NULL && i < (m->nparams > 0 ? m->nparams : 1); i++) {
+        list_init(&args[i]); // Variadic arguments left out altogether stay empty
+    }
+
+    for (PPToken *t = written, *next; t != NULL; t = next) {
+        next = t->next;
+
+        if (is_punct(t, "(")) {
+            depth++;
+        } else if (is_punct(t, ")")) {
+            depth--;
+        } else if (depth == 0 && is_punct(t, ",") && !(m->variadic && nargs == m->nparams)) {
+            nargs++;
+            continue;
+        }
+
+        if (args != NULL) list_append(&args[nargs - 1], t);
+    }
+
+    return nargs;
+}
+
+static bool check_args(Macro *m, PPToken *written, int nargs) {
+    if (nargs == m->nparams) return true;
+    if (m->nparams == 0) return nargs == 1 && written == NULL;
+    if (m->variadic && nargs == m->nparams - 1) return true; // Variadic arguments left out altogether
+
+    fprintf(stderr, "expand: macro '%.*s' expects %d arguments, %d given\n",
+            (int) (m->name.end - m->name.ptr), m->name.ptr, m->nparams, nargs);
+    return false;
+}
+
+static PPToken *stringize(PPToken *arg) {
+    size_t len = 2;
+    for (PPToken *t = arg; t != NULL; t = t->next) {
+        len += 1 + 2 * (t->span.end - t->span.ptr);
+    }
+
+    byte *buf = pool_alloc(len, byte);
+    byte *p = buf;
+    *p++ = '"';
+
+    for (PPToken *t = arg; t != NULL; t = t->next) {
+        if (t != arg && t->ws.span.ptr != t->ws.span.end) *p++ = ' ';
+
+        for (byte *cp = t->span.ptr; cp < t->span.end; cp++) {
+            if ((t->type == PP_STRING || t->type == PP_CHAR) && (*cp == '"' || *cp == '\\')) *p++ = '\\';
+            *p++ = *cp;
+        }
+    }
+
+    *p++ = '"';
+
+    PPToken *s = pool_alloc_struct(PPToken);
+    s->type = PP_STRING;
+    s->span = (Span) {buf, p};
+    s->tok = new_token(S_CHAR_SEQ_TOKEN, s->span, arg != NULL ? arg->tok : NULL);
+    return s;
+}
+
+static PPToken *paste(PPToken *lhs, PPToken *rhs) {
+    if (lhs->type == PP_PLACEMARKER) {
+        PPToken *t = copy_token(rhs);
+        t->ws = lhs->ws;
+        return t;
+    }
+
+    if (rhs->type == PP_PLACEMARKER) return lhs;
+
+    size_t len1 = lhs->span.end - lhs->span.ptr, len2 = rhs->span.end - rhs->span.ptr;
+    byte *buf = pool_alloc(len1 + len2, byte);
+    memcpy(buf, lhs->span.ptr, len1);
+    memcpy(buf + len1, rhs->span.ptr, len2);
+
+    PPToken *t = copy_token(lhs);
+    t->span = (Span) {buf, buf + len1 + len2};
+    Token *lexed = lex_token(buf, len1 + len2);
+
+    if (lexed == NULL) {
+        fprintf(stderr, "expand: pasting '%.*s' and '%.*s' does not give a valid preprocessing token\n",
+                (int) len1, lhs->span.ptr, (int) len2, rhs->span.ptr);
+
+        t->tok = new_token(lhs->tok->type, t->span, lhs->tok);
+    } else {
+        t->type = pp_type(lexed->type);
+        t->tok = new_token(lexed->type, t->span, lhs->tok);
+    }
+
+    t->hideset = lhs->hideset;
+    t->next = NULL;
+    return t;
+}
+
+// Instantiates the replacement list of m. Operands of # and ## are taken as written, other arguments
+// are fully expanded first, then everything gets the hide set hs
+static PPToken *subst(Expander *x, Macro *m, TokenList *args, HideSet *hs, Space ws) {
+    TokenList out;
+    list_init(&out);
+
+    PPToken **expanded = m->nparams > 0 ? pool_alloc(sizeof(PPToken *) * m->nparams, PPToken *) : NULL;
+    bool *is_expanded = m->nparams > 0 ? pool_alloc(sizeof(bool) * m->nparams, bool) : NULL;
+    PPToken *prev = NULL;
+
+    for (PPToken *b = m->body; b != NULL; prev = b, b = b->next) {
+        if (b->type == PP_STRINGIFY) {
+            PPToken *s = stringize(args[b->next->param].head);
+            s->ws = b->ws;
+            list_append(&out, s);
+            b = b->next;
+        } else if (b->type == PP_PARAM) {
+            PPToken *arg = args[b->param].head;
+            bool pasted = (prev != NULL && prev->type == PP_PASTE) || (b->next != NULL && b->next->type == PP_PASTE);
+
+            if (pasted && arg == NULL) {
+                PPToken *pm = pool_alloc_struct(PPToken);
+                pm->type = PP_PLACEMARKER;
+                pm->ws = b->ws;
+                list_append(&out, pm);
+            } else if (pasted) {
+                append_copies(&out, arg, b->ws);
+            } else {
+                if (!is_expanded[b->param]) {
+                    Expander y = {.table = x->table, .deps = x->deps, .in_cond = x->in_cond};
+                    TokenList copy;
+                    list_init(&copy);
+                    append_copies(&copy, arg, arg != NULL ? arg->ws : (Space) {{NULL, NULL}, NULL});
+
+                    expanded[b->param] = expand_list(&y, copy.head);
+                    is_expanded[b->param] = true;
+                }
+
+                append_copies(&out, expanded[b->param], b->ws);
+            }
+        } else if (b->type == PP_PASTE && m->variadic && b->next != NULL && b->next->type == PP_PARAM &&
+                   b->next->param == m->nparams - 1 && is_punct(prev, ",")) {
+            // GNU `, ## __VA_ARGS__`: without variadic arguments the comma goes away, otherwise nothing is pasted
+            PPToken *arg = args[b->next->param].head;
+
+            if (arg == NULL) list_remove_last(&out);
+            else append_copies(&out, arg, b->next->ws);
+
+            b = b->next;
+        } else {
+            list_append(&out, copy_token(b));
+        }
+    }
+
+    TokenList res;
+    list_init(&res);
+
+    for (PPToken *t = out.head, *next; t != NULL; t = next) {
+        next = t->next;
+
+        if (t->type == PP_PASTE && res.head != NULL && next != NULL) {
+            list_replace_last(&res, paste(*res.last, next));
+            next = next->next;
+        } else {
+            list_append(&res, t);
+        }
+    }
+
+    TokenList result;
+    list_init(&result);
+
+    for (PPToken *t = res.head, *next; t != NULL; t = next) {
+        next = t->next;
+        if (t->type == PP_PLACEMARKER) continue;
+
+        t->hideset = hideset_union(t->hideset, hs);
+        list_append(&result, t);
+    }
+
+    if (result.head != NULL) result.head->ws = ws;
+    return result.head;
+}
+
+// Rescans input until it runs out, replacing macros. A name in a token's hide set came from
+// expanding that very macro, so it isn't replaced again
+static PPToken *expand_list(Expander *x, PPToken *input) {
+    TokenList out;
+    list_init(&out);
+    PPToken *t;
+
+    while ((t = input) != NULL) {
+        input = t->next;
+        t->next = NULL;
+
+        if (t->type != PP_IDENTIFIER) {
+            list_append(&out, t);
+            continue;
+        }
+
+        if (x->in_cond && spanstrcmp(t->span, "defined") == 0) {
+            PPToken *name = input;
+            bool paren = is_punct(name, "(");
+            if (paren) name = name->next;
+
+            if (name != NULL && name->type == PP_IDENTIFIER && (!paren || is_punct(name->next, ")"))) {
+                input = paren ? name->next->next : name->next;
+                t->type = PP_DEFINED;
+                t->span = name->span;
+            }
+
+            list_append(&out, t);
+            continue;
+        }
+
+        Macro *m;
+        if (hideset_contains(t->hideset, t->span) || (m = lookup_macro(x, t->span)) == NULL) {
+            list_append(&out, t);
+            continue;
+        }
+
+        if (!m->funclike) {
+            if (t->hideset == NULL && !x->in_cond && memoize(x, m)) {
+                append_copies(&out, m->expansion, t->ws);
+            } else {
+                input = list_concat(subst(x, m, NULL, hideset_add(t->hideset, m->name), t->ws), input);
+            }
+
+            continue;
+        }
+
+        PPToken *lparen = take_open_paren(x, &input);
+
+        if (lparen == NULL) {
+            list_append(&out, t);
+            continue;
+        }
+
+        TokenList written;
+        PPToken *rparen = collect_args(x, &input, &written);
+
+        if (rparen == NULL && x->src != NULL) {
+            fprintf(stderr, "expand: unterminated invocation of macro '%.*s'\n", (int) (m->name.end - m->name.ptr), m->name.ptr);
+        }
+
+        if (rparen == NULL || !check_args(m, written.head, split_args(m, written.head, NULL))) { // Left as written
+            list_append(&out, t);
+            list_append(&out, lparen);
+
+            for (PPToken *a = written.head, *next; a != NULL; a = next) {
+                next = a->next;
+                list_append(&out, a);
+            }
+
+            if (rparen != NULL) list_append(&out, rparen);
+            continue;
+        }
+
+        TokenList *args = pool_alloc(sizeof(TokenList) * (m->nparams > 0 ? m->nparams : 1), TokenList);
+        split_args(m, written.head, args);
+
+        HideSet *hs = hideset_add(hideset_intersect(t->hideset, rparen->hideset), m->name);
+        input = list_concat(subst(x, m, args, hs, t->ws), input);
+    }
+
+    return out.head;
+}
+
+// Expands the macro name at c. Arguments and rescanning may continue past it, c is left after the last
+// token used
+static void expand_invocation(Cursor *c, Macro *macro, DefineTable *def_table, Output *out) {
+    Expander x = {.table = def_table, .src = c};
+    PPToken *t = next_pptoken(c, false);
+
+    byte *origin = out->origin;
+    out->origin = t->span.ptr;
+
+    if (!macro->funclike && memoize(&x, macro)) {
+        emit_pptokens(out, macro->expansion);
+    } else {
+        emit_pptokens(out, expand_list(&x, t));
+    }
+
+    out->origin = origin;
+}
+
+// Directive name of a PREP_DIRECTIVE_TOKEN, without the '#' and the blanks after it
+static Span directive_name(Token *t) {
+    byte *p;
+    for (p = t->span.ptr + 1; p < t->span.end && (*p == ' ' || *p == '\t'); p++)
+        ;
+
+    return (Span) {p, t->span.end};
+}
+
+// Finds the #elif, #else or #endif that continues the group at c, skipping nested groups. The content
+// of the group ends before the newline in front of it
+static Token *find_group_end(Cursor c, byte **content_end) {
+    int depth = 0;
+    *content_end = c.pos;
+
+    for ( ; !cursor_done(&c); cursor_next(&c)) {
+        byte *nl;
+
+        if (c.tok->type == WHITESPACE_TOKEN && (nl = find_newline(cursor_span(&c), true)) != NULL) {
+            *content_end = nl;
+        }
+
+        if (c.tok->type != PREP_DIRECTIVE_TOKEN) continue;
+
+        Span name = directive_name(c.tok);
+
+        if (spanstrcmp(name, "if") == 0 || spanstrcmp(name, "ifdef") == 0 || spanstrcmp(name, "ifndef") == 0) {
+            depth++;
+        } else if (spanstrcmp(name, "endif") == 0) {
+            if (depth == 0) return c.tok;
+            depth--;
+        } else if (depth == 0 && (spanstrcmp(name, "elif") == 0 || spanstrcmp(name, "else") == 0)) {
+            return c.tok;
+        }
+    }
+
+    return NULL;
+}
+
+static Span directive_id(Cursor line) {
+    PPToken *id = next_pptoken(&line, true);
+    return id != NULL && id->type == PP_IDENTIFIER ? id->span : (Span) {NULL, NULL};
+}
+
+// Expands the taken branch of an #if/#ifdef/#ifndef group. c is right after the directive name,
+// and is left right after the name of the closing #endif
+static void expand_conditional(Cursor *c, Token *directive, char *dirpath, DefineTable *def_table, Output *out) {
+    bool taken = false;
+
+    for (;;) {
+        Span name = directive_name(directive);
+        bool cond = false;
+
+        if (!taken) {
+            if (spanstrcmp(name, "if") == 0 || spanstrcmp(name, "elif") == 0) {
+                cond = eval_expr(directive, *c, def_table);
+            } else if (spanstrcmp(name, "ifdef") == 0) {
+                cond = prep_define_get(def_table, directive_id(*c)) != NULL;
+            } else if (spanstrcmp(name, "ifndef") == 0) {
+                cond = prep_define_get(def_table, directive_id(*c)) == NULL;
+            } else {
+                cond = true;
+            }
+        }
+
+        skip_line(c);
+
+        byte *content_end;
+        Token *next = find_group_end(*c, &content_end);
+
+        if (cond) {
+            Cursor content = {c->tok, c->pos, min(content_end, c->end)};
+            expand(&content, dirpath, def_table, out);
+            taken = true;
+        }
+
+        if (next == NULL) {
+            fprintf(stderr, "expand: unterminated conditional directive\n");
+            c->tok = NULL;
+            break;
+        }
+
+        c->tok = next;
+        cursor_next(c);
+        directive = next;
+
+        if (spanstrcmp(directive_name(directive), "endif") == 0) break;
+    }
+}
+
+// Path of the file an #include names, NULL after reporting it if it names none or a header that isn't on the
+// search paths. c is at the #include token and is left after the directive line
+static char *resolve_include(Cursor *c, char *dirpath) {
+    for (cursor_next(c); !cursor_done(c) && c->tok->type == WHITESPACE_TOKEN; cursor_next(c))
+        ;
+
+    Token *path = cursor_done(c) ? NULL : c->tok;
+    char *inc_path = NULL;
+
+    if (path != NULL && (path->type == INCLUDE_PATH_TOKEN || path->type == HEADER_NAME_TOKEN)) {
+        Span name = {path->span.ptr + 1, path->span.end};
+        if (name.end > name.ptr && *(name.end - 1) == (path->type == HEADER_NAME_TOKEN ? '>' : '"')) name.end--;
+
+        if (path->type == INCLUDE_PATH_TOKEN) {
+            inc_path = path_join_ssp(dirpath, name);
+        } else {
+            Prefetch *p = NULL;
+
+            if (prefetch_threads > 0) {
+                char *key = pool_alloc(name.end - name.ptr + 3, char);
+                sprintf(key, "<%.*s>", (int) (name.end - name.ptr), (char *) name.ptr);
+                p = take_prefetch(key);
+            }
+
+            if (p != NULL && p->path != NULL) {
+                inc_path = p->path;
+            } else {
+                for (int i = 0; i < search_paths_size && inc_path == NULL; i++) {
+                    inc_path = path_join_ssp(search_paths[i], name);
+                    if (!file_exists(inc_path)) inc_path = NULL;
+                }
+            }
+
+            if (inc_path == NULL) {
+                fprintf(stderr, "expand: #include <%.*s> not found on the search paths\n", (int) (name.end - name.ptr),
+                        (char *) name.ptr);
+            }
+        }
+    } else {
+        fprintf(stderr, "expand: #include expects \"FILENAME\" or <FILENAME>\n");
+    }
+
+    skip_line(c);
+    return inc_path;
+}
+
+// c is at the #include token, the file is expanded once the directive line is consumed
+static void expand_include(Cursor *c, char *dirpath, DefineTable *def_table, Output *out) {
+    uint64_t resolve_start = tracing ? now_ns() : 0;
+    char *inc_path = resolve_include(c, dirpath);
+    if (inc_path == NULL) return;
+
+    TraceNode *node = tracing ? trace_push(inc_path, resolve_start, out) : NULL;
+    expand_file(inc_path, def_table, out);
+    if (node != NULL) trace_pop(node, out);
+}
+
+static bool is_definition(Token *t) {
+    return t->type == DEFINE_TOKEN || (t->type == PREP_DIRECTIVE_TOKEN && spanstrcmp(directive_name(t), "undef") == 0);
+}
+
+// c is at a #define or #undef and is left after its line
+static void expand_definition(Cursor *c, DefineTable *def_table) {
+    Token *tok = c->tok;
+    cursor_next(c);
+
+    if (tok->type == DEFINE_TOKEN) {
+        Macro *macro = parse_define(c);
+        if (macro != NULL) {
+            prep_define_set(def_table, macro->name, macro);
+            trace_defines++;
+        }
+    } else {
+        Span id = directive_id(*c);
+        if (id.ptr != NULL) prep_define_set(def_table, id, NULL);
+    }
+
+    skip_line(c);
+}
+
+// Writes the rest of the line at c as it is, its newline included
+static void emit_line(Cursor *c, Output *out) {
+    for ( ; !cursor_done(c); cursor_next(c)) {
+        Span sp = cursor_span(c);
+        byte *nl;
+
+        if (c->tok->type == WHITESPACE_TOKEN && (nl = find_newline(sp, false)) != NULL) {
+            emit(out, c->tok->type, (Span) {sp.ptr, nl + 1}, c->tok);
+            c->pos = nl + 1;
+            if (c->pos == c->tok->span.end) cursor_next(c);
+            return;
+        }
+
+        emit(out, c->tok->type, sp, c->tok);
+    }
+}
+
+// #pragma once defines the once name of the file, so that it goes with the rest of the macro state into
+// forks and snapshots. Other pragmas are left in the output for the compiler. c is at the directive.
+static void expand_pragma(Cursor *c, DefineTable *def_table, Output *out) {
+    Cursor line = *c;
+    cursor_next(&line);
+    PPToken *arg = next_pptoken(&line, true);
+    SrcFile *sf = find_src(c->tok->span.ptr);
+
+    if (sf != NULL && arg != NULL && spanstrcmp(arg->span, "once") == 0 && next_pptoken(&line, true) == NULL) {
+        Macro *m = pool_alloc_struct(Macro);
+        m->name = sf->once_name;
+        prep_define_set(def_table, m->name, m);
+        skip_line(c);
+    } else {
+        emit_line(c, out);
+    }
+}
+
+// Numbers the lines after the directive at c from the line it gives, in the file it names if it does.
+// The source map keeps the real positions, only the #line markers written go by it.
+static void expand_line(Cursor *c) {
+    SrcFile *sf = find_src(c->tok->span.ptr);
+    cursor_next(c);
+
+    PPToken *num = next_pptoken(c, true);
+    PPToken *name = num != NULL ? next_pptoken(c, true) : NULL;
+    bool valid = num != NULL && num->type == PP_NUMBER && (name == NULL || name->type == PP_STRING);
+    int line = 0;
+
+    for (byte *cp = valid ? num->span.ptr : NULL; cp != NULL && cp < num->span.end; cp++) {
+        valid = valid && isdigit(*cp);
+        line = line * 10 + (*cp - '0');
+    }
+
+    valid = valid && (name == NULL || next_pptoken(c, true) == NULL);
+    skip_line(c);
+
+    if (!valid) {
+        fprintf(stderr, "expand: #line expects a line number and an optional \"FILENAME\"\n");
+        return;
+    }
+
+    if (sf == NULL || cursor_done(c)) return;
+
+    Vec *directives = &sf->line_directives;
+    LineDirective *last = directives->size > 0 ? (LineDirective *) directives->ptr + directives->size - 1 : NULL;
+    size_t offset = c->pos - sf->content.ptr;
+    if (last != NULL && last->offset >= offset) return; // Recorded when the file was expanded before
+
+    char *path = last != NULL ? last->path : NULL;
+    if (name != NULL) {
+        path = pool_alloc(name->span.end - name->span.ptr - 1, char);
+        memcpy(path, name->span.ptr + 1, name->span.end - name->span.ptr - 2);
+    }
+
+    *(LineDirective *) vec_push(directives) = (LineDirective) {offset, line, path};
+}
+
+// #error and #warning, and directives that aren't known after what, are reported with the rest of their
+// line and expansion goes on. c is at the directive.
+static void report_directive(Cursor *c, char *what) {
+    Token *directive = c->tok;
+    SrcFile *sf = find_src(directive->span.ptr);
+    Span name = directive_name(directive);
+    Span text = {name.end, name.end};
+
+    for ( ; text.end < c->end && *text.end != '\n'; text.end++)
+        ;
+
+    for ( ; text.ptr < text.end && isspace(*text.ptr); text.ptr++)
+        ;
+
+    for ( ; text.end > text.ptr && isspace(*(text.end - 1)); text.end--)
+        ;
+
+    char *path = "?";
+    int line = sf != NULL ? presumed_line(sf, directive->span.ptr - sf->content.ptr, &path) : 0;
+    fprintf(stderr, "expand: %s:%d: %s#%.*s %.*s\n", path, line, what, (int) (name.end - name.ptr), name.ptr,
+            (int) (text.end - text.ptr), text.ptr);
+
+    cursor_next(c);
+    skip_line(c);
+}
+
+static void expand(Cursor *c, char *dirpath, DefineTable *def_table, Output *out) {
+    Macro *macro;
+
+    while (!cursor_done(c)) {
+        Token *tok = c->tok;
+
+        if (tok->type == INCLUDE_TOKEN) {
+            expand_include(c, dirpath, def_table, out);
+        } else if (is_definition(tok)) {
+            expand_definition(c, def_table);
+        } else if (tok->type == PREP_DIRECTIVE_TOKEN) {
+            Span directive = directive_name(tok);
+
+            if (spanstrcmp(directive, "if") == 0 || spanstrcmp(directive, "ifdef") == 0 || spanstrcmp(directive, "ifndef") == 0) {
+                cursor_next(c);
+                expand_conditional(c, tok, dirpath, def_table, out);
+            } else if (spanstrcmp(directive, "pragma") == 0) {
+                expand_pragma(c, def_table, out);
+            } else if (spanstrcmp(directive, "line") == 0) {
+                expand_line(c);
+            } else if (spanstrcmp(directive, "error") == 0 || spanstrcmp(directive, "warning") == 0) {
+                report_directive(c, "");
+            } else {
+                report_directive(c, "unrecognized directive ");
+            }
+        } else if ((tok->type == IDENTIFIER_TOKEN || tok->type == KEYWORD_TOKEN) &&
+                   (macro = prep_define_get(def_table, tok->span)) != NULL) {
+            expand_invocation(c, macro, def_table, out);
+        } else {
+            emit(out, tok->type, cursor_span(c), tok);
+            cursor_next(c);
+        }
+    }
+}
+
+// The macro state after the prefix of a main file, the #include, #define and #undef lines it starts with, and
+// what each of its includes put out. Its key is the path of every include and the tokens of every definition
+// in order, the text in between is written from each main file itself.
+typedef struct SharedPrefix {
+    Span key;
+    DefineTable *table; // Frozen when shared, the main files with the same key fork it
+    int nincludes;
+    Token **outputs;    // One list per include
+    struct SharedPrefix *next;
+} SharedPrefix;
+
+// Snapshots are read in place from a private mapping, names and token text point into it. Numbers are
+// native 32-bit words and strings are a length followed by the bytes padded to a word. Token types are
+// stored as numbers, so SNAPSHOT_VERSION goes up whenever TokenType or the layout changes.
+#define SNAPSHOT_MAGIC "ZHBSNAP"
+#define SNAPSHOT_VERSION 2
+
+enum {
+    SNAPSHOT_DEFINED = 1,
+    SNAPSHOT_FUNCLIKE = 2,
+    SNAPSHOT_VARIADIC = 4,
+};
+
+typedef struct {
+    byte *p;
+    byte *end;
+    bool ok;
+} SnapReader;
+
+static void snap_put_u32(FILE *f, uint32_t v) {
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void snap_put_str(FILE *f, Span sp) {
+    static const byte pad[4];
+    uint32_t len = (uint32_t) (sp.end - sp.ptr);
+
+    snap_put_u32(f, len);
+    if (len > 0) fwrite(sp.ptr, 1, len, f);
+    fwrite(pad, 1, (4 - len % 4) % 4, f);
+}
+
+static void snap_put_cstr(FILE *f, char *str) {
+    snap_put_str(f, (Span) {(byte *) str, (byte *) str + strlen(str)});
+}
+
+static uint32_t snap_u32(SnapReader *r) {
+    uint32_t v = 0;
+
+    if (r->ok && r->end - r->p >= (ptrdiff_t) sizeof(v)) {
+        memcpy(&v, r->p, sizeof(v));
+        r->p += sizeof(v);
+    } else {
+        r->ok = false;
+    }
+
+    return v;
+}
+
+static Span snap_str(SnapReader *r) {
+    uint32_t len = snap_u32(r);
+    size_t padded = len + (4 - len % 4) % 4;
+
+    if (!r->ok || r->end - r->p < (ptrdiff_t) padded) {
+        r->ok = false;
+        return (Span) {NULL, NULL};
+    }
+
+    Span sp = {r->p, r->p + len};
+    r->p += padded;
+    return sp;
+}
+
+static bool snap_str_eq(SnapReader *r, Span expected) {
+    Span sp = snap_str(r);
+    return r->ok && span_eq(sp, expected);
+}
+
+static Span cstr_span(char *str) {
+    return (Span) {(byte *) str, (byte *) str + strlen(str)};
+}
+
+// mtime in nanoseconds and size go in as two words each
+static void snap_put_stat(FILE *f, struct stat *st) {
+    uint64_t vals[] = {(uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec, (uint64_t) st->st_size};
+
+    for (int i = 0; i < 2; i++) {
+        snap_put_u32(f, (uint32_t) vals[i]);
+        snap_put_u32(f, (uint32_t) (vals[i] >> 32));
+    }
+}
+
+static bool snap_stat_eq(SnapReader *r, struct stat *st) {
+    uint64_t vals[] = {(uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec, (uint64_t) st->st_size};
+    bool eq = true;
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t v = snap_u32(r);
+        v |= (uint64_t) snap_u32(r) << 32;
+        eq = eq && v == vals[i];
+    }
+
+    return r->ok && eq;
+}
+
+static void snap_put_pptoken(FILE *f, PPToken *t) {
+    snap_put_u32(f, t->type);
+    snap_put_u32(f, t->tok->type);
+    snap_put_u32(f, (uint32_t) t->param);
+    snap_put_str(f, t->span);
+    snap_put_str(f, t->ws.span);
+
+    uint32_t npieces = 0;
+    for (Token *w = t->ws.first; w != NULL && w->type != STUB_TOKEN && w->span.ptr < t->ws.span.end; w = w->next) {
+        npieces++;
+    }
+
+    snap_put_u32(f, npieces);
+    for (Token *w = t->ws.first; w != NULL && w->type != STUB_TOKEN && w->span.ptr < t->ws.span.end; w = w->next) {
+        snap_put_u32(f, w->type);
+        snap_put_u32(f, (uint32_t) (min(w->span.end, t->ws.span.end) - max(w->span.ptr, t->ws.span.ptr)));
+    }
+}
+
+// The whitespace pieces are consecutive slices of the stored whitespace, as they are of the source
+static PPToken *snap_pptoken(SnapReader *r) {
+    PPToken *t = pool_alloc_struct(PPToken);
+    t->type = (PPTokenType) snap_u32(r);
+    TokenType lextype = (TokenType) snap_u32(r);
+    t->param = (int) snap_u32(r);
+    t->span = snap_str(r);
+    t->tok = new_token(lextype, t->span, NULL);
+    t->ws.span = snap_str(r);
+
+    uint32_t npieces = snap_u32(r);
+    byte *p = t->ws.span.ptr;
+    Token **tail = &t->ws.first;
+
+    for (uint32_t i = 0; i < npieces && r->ok; i++) {
+        TokenType type = (TokenType) snap_u32(r);
+        uint32_t len = snap_u32(r);
+
+        if (len > t->ws.span.end - p) {
+            r->ok = false;
+            break;
+        }
+
+        *tail = new_token(type, (Span) {p, p + len}, NULL);
+        tail = &(*tail)->next;
+        p += len;
+    }
+
+    return t;
+}
+
+// Parents first, so that the entries of their forks win when the snapshot is applied
+static void snap_put_macros(FILE *f, DefineTable *table) {
+    if (table->parent != NULL) snap_put_macros(f, table->parent);
+
+    for (size_t i = 0; i < table->size; i++) {
+        for (DefineKv *kv = table->ptr[i]; kv != NULL; kv = kv->next) {
+            Macro *m = kv->value;
+            snap_put_str(f, kv->key);
+
+            if (m == NULL) { // #undef, so that it hides a definition the table might start with
+                snap_put_u32(f, 0);
+                continue;
+            }
+
+            snap_put_u32(f, SNAPSHOT_DEFINED | (m->funclike ? SNAPSHOT_FUNCLIKE : 0) | (m->variadic ? SNAPSHOT_VARIADIC : 0));
+            snap_put_u32(f, (uint32_t) m->nparams);
+            for (int j = 0; j < m->nparams; j++) {
+                snap_put_str(f, m->params[j]);
+            }
+
+            uint32_t nbody = 0;
+            for (PPToken *t = m->body; t != NULL; t = t->next) {
+                nbody++;
+            }
+
+            snap_put_u32(f, nbody);
+            for (PPToken *t = m->body; t != NULL; t = t->next) {
+                snap_put_pptoken(f, t);
+            }
+        }
+    }
+}
+
+static void save_snapshot(SharedPrefix *sp, Vec *deps) {
+    char *tmp_path = pool_alloc(strlen(snapshot_path) + 5, char);
+    sprintf(tmp_path, "%s.tmp", snapshot_path);
+
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "expand: cannot write snapshot %s\n", tmp_path);
+        return;
+    }
+
+    fwrite(SNAPSHOT_MAGIC, 1, sizeof(SNAPSHOT_MAGIC), f);
+    snap_put_u32(f, SNAPSHOT_VERSION);
+    snap_put_str(f, sp->key);
+
+    snap_put_u32(f, (uint32_t) search_paths_size);
+    for (size_t i = 0; i < search_paths_size; i++) {
+        snap_put_cstr(f, search_paths[i]);
+    }
+
+    snap_put_u32(f, (uint32_t) deps->size);
+    for (size_t i = 0; i < deps->size; i++) {
+        char *path = ((char **) deps->ptr)[i];
+        struct stat st;
+
+        if (stat(path, &st) != 0) memset(&st, 0, sizeof(st));
+        snap_put_cstr(f, path);
+        snap_put_stat(f, &st);
+    }
+
+    uint32_t nmacros = 0;
+    for (DefineTable *t = sp->table; t != NULL; t = t->parent) {
+        nmacros += t->count;
+    }
+
+    snap_put_u32(f, nmacros);
+    snap_put_macros(f, sp->table);
+
+    for (int i = 0; i < sp->nincludes; i++) { // As many as the key has
+        uint32_t nout = 0;
+        for (Token *t = sp->outputs[i]; t != NULL; t = t->next) {
+            nout++;
+        }
+
+        snap_put_u32(f, nout);
+        for (Token *t = sp->outputs[i]; t != NULL; t = t->next) {
+            snap_put_u32(f, t->type);
+            snap_put_u32(f, (uint32_t) t->line);
+            snap_put_u32(f, (uint32_t) t->column);
+            snap_put_str(f, t->span);
+        }
+    }
+
+    bool failed = ferror(f);
+    if (fclose(f) != 0 || failed || rename(tmp_path, snapshot_path) != 0) {
+        fprintf(stderr, "expand: cannot write snapshot %s\n", snapshot_path);
+        remove(tmp_path);
+    }
+}
+
+// Applies the snapshot if it was made for this prefix and nothing it depends on changed since
+static bool load_snapshot(SharedPrefix *sp) {
+    FILE *f = fopen(snapshot_path, "rb");
+    if (f == NULL) return false;
+
+    struct stat st;
+    byte *map = MAP_FAILED;
+
+    if (fstat(fileno(f), &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    }
+
+    fclose(f);
+    if (map == MAP_FAILED) return false;
+
+    SnapReader r = {map, map + st.st_size, st.st_size >= sizeof(SNAPSHOT_MAGIC)};
+    r.ok = r.ok && memcmp(map, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+    if (r.ok) r.p += sizeof(SNAPSHOT_MAGIC);
+
+    r.ok = snap_u32(&r) == SNAPSHOT_VERSION && r.ok;
+    r.ok = r.ok && snap_str_eq(&r, sp->key);
+    r.ok = r.ok && snap_u32(&r) == search_paths_size;
+
+    for (size_t i = 0; i < search_paths_size && r.ok; i++) {
+        r.ok = snap_str_eq(&r, cstr_span(search_paths[i]));
+    }
+
+    uint32_t ndeps = snap_u32(&r);
+    for (uint32_t i = 0; i < ndeps && r.ok; i++) {
+        Span path = snap_str(&r);
+        char *cpath = pool_alloc(path.end - path.ptr + 1, char);
+        memcpy(cpath, path.ptr, path.end - path.ptr);
+
+        struct stat dep_st;
+        if (stat(cpath, &dep_st) != 0) memset(&dep_st, 0, sizeof(dep_st));
+        r.ok = snap_stat_eq(&r, &dep_st);
+    }
+
+    // Read everything before touching the table, a truncated file must not leave it half set
+    uint32_t nmacros = snap_u32(&r);
+    Span *names = r.ok ? pool_alloc(sizeof(Span) * (nmacros + 1), Span) : NULL;
+    Macro **macros = r.ok ? pool_alloc(sizeof(Macro *) * (nmacros + 1), Macro *) : NULL;
+
+    for (uint32_t i = 0; i < nmacros && r.ok; i++) {
+        names[i] = snap_str(&r);
+        uint32_t flags = snap_u32(&r);
+        if (!(flags & SNAPSHOT_DEFINED)) continue;
+
+        Macro *m = macros[i] = pool_alloc_struct(Macro);
+        m->name = names[i];
+        m->funclike = (flags & SNAPSHOT_FUNCLIKE) != 0;
+        m->variadic = (flags & SNAPSHOT_VARIADIC) != 0;
+        m->nparams = (int) snap_u32(&r);
+        m->params = pool_alloc(sizeof(Span) * (m->nparams + 1), Span);
+
+        for (int j = 0; j < m->nparams && r.ok; j++) {
+            m->params[j] = snap_str(&r);
+        }
+
+        uint32_t nbody = snap_u32(&r);
+        TokenList body;
+        list_init(&body);
+
+        for (uint32_t j = 0; j < nbody && r.ok; j++) {
+            list_append(&body, snap_pptoken(&r));
+        }
+
+        m->body = body.head;
+    }
+
+    Token **outputs = pool_alloc(sizeof(Token *) * sp->nincludes, Token *);
+
+    for (int i = 0; i < sp->nincludes && r.ok; i++) {
+        uint32_t nout = snap_u32(&r);
+        Output replay = {.head = NULL};
+        replay.tail = &replay.head;
+
+        for (uint32_t j = 0; j < nout && r.ok; j++) {
+            TokenType type = (TokenType) snap_u32(&r);
+            Token at = {.line = (int) snap_u32(&r), .column = (int) snap_u32(&r)};
+            emit(&replay, type, snap_str(&r), &at);
+        }
+
+        outputs[i] = replay.head;
+    }
+
+    if (!r.ok) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < nmacros; i++) {
+        prep_define_set(sp->table, names[i], macros[i]);
+    }
+
+    memcpy(sp->outputs, outputs, sizeof(Token *) * sp->nincludes);
+    snapshot_loads++;
+    return true;
+}
+
+static void key_put(Vec *key, Span sp) {
+    for (byte *p = sp.ptr; p < sp.end; p++) {
+        *(byte *) vec_push(key) = *p;
+    }
+}
+
+// Keys the prefix at c, which ends with the line of its nincludes-th #include or before the first line that
+// isn't blank, a comment, an #include, a #define or an #undef. Returns how many includes it has.
+static int find_prefix(Cursor c, char *dirpath, int nincludes, Span *key) {
+    Vec buf = {.item_size = sizeof(byte)};
+    size_t key_len = 0;
+    int found = 0;
+
+    while (!cursor_done(&c) && found < nincludes) {
+        if (is_space(c.tok)) {
+            cursor_next(&c);
+        } else if (c.tok->type == INCLUDE_TOKEN) {
+            char *path = resolve_include(&c, dirpath);
+            if (path == NULL) break;
+
+            *(byte *) vec_push(&buf) = 'I';
+            key_put(&buf, (Span) {(byte *) path, (byte *) path + strlen(path) + 1});
+            key_len = buf.size;
+            found++;
+        } else if (is_definition(c.tok)) {
+            *(byte *) vec_push(&buf) = c.tok->type == DEFINE_TOKEN ? 'D' : 'U';
+            cursor_next(&c);
+
+            // Spacing only matters as far as there is some, e.g. between a name and its parameter list
+            for (PPToken *t; (t = next_pptoken(&c, true)) != NULL; ) {
+                if (t->ws.span.ptr != t->ws.span.end) *(byte *) vec_push(&buf) = ' ';
+                key_put(&buf, t->span);
+            }
+
+            *(byte *) vec_push(&buf) = '\0';
+            skip_line(&c);
+        } else {
+            break;
+        }
+    }
+
+    byte *k = pool_alloc(key_len + 1, byte);
+    if (key_len > 0) memcpy(k, buf.ptr, key_len);
+    *key = (Span) {k, k + key_len}; // Definitions after the last include are left to the main file
+    free(buf.ptr);
+    return found;
+}
+
+#define SHARED_PREFIXES_SIZE 1024
+static SharedPrefix *shared_prefixes[SHARED_PREFIXES_SIZE];
+
+static SharedPrefix *find_shared_prefix(Span key) {
+    for (SharedPrefix *sp = shared_prefixes[hash(key, SHARED_PREFIXES_SIZE)]; sp != NULL; sp = sp->next) {
+        if (span_eq(sp->key, key)) return sp;
+    }
+
+    return NULL;
+}
+
+// Expands the includes and definitions of the prefix at c into sp, the rest of its text is left out
+static void build_prefix(Cursor c, char *dirpath, SharedPrefix *sp) {
+    Vec deps = {.item_size = sizeof(char *)};
+    snapshot_deps = &deps;
+
+    for (int i = 0; i < sp->nincludes; ) {
+        if (c.tok->type == INCLUDE_TOKEN) {
+            Output recorded = {.head = NULL};
+            recorded.tail = &recorded.head;
+            expand_include(&c, dirpath, sp->table, &recorded);
+            sp->outputs[i++] = recorded.head;
+        } else if (is_definition(c.tok)) {
+            expand_definition(&c, sp->table);
+        } else {
+            cursor_next(&c);
+        }
+    }
+
+    snapshot_deps = NULL;
+    if (snapshot_path != NULL) save_snapshot(sp, &deps);
+    free(deps.ptr);
+}
+
+// Writes the prefix at c as expand() would, with the output of the includes taken from sp. c is left after it
+static void replay_prefix(Cursor *c, SharedPrefix *sp, Output *out) {
+    for (int i = 0; i < sp->nincludes; ) {
+        if (c->tok->type == INCLUDE_TOKEN) {
+            skip_line(c);
+
+            for (Token *t = sp->outputs[i++]; t != NULL; t = t->next) {
+                emit(out, t->type, t->span, t);
+            }
+        } else if (is_definition(c->tok)) {
+            skip_line(c);
+        } else {
+            emit(out, c->tok->type, cursor_span(c), c->tok);
+            cursor_next(c);
+        }
+    }
+}
+
+// The table is expected to start out the same way on every run, as it does in zhaba_expand. Only
+// empty tables take part in prefix sharing, they get the shared state as their parent.
+static void expand_main(char *srcfile, DefineTable *def_table, Output *out) {
+    int nincludes = snapshot_path != NULL ? snapshot_includes : shared_includes;
+
+    if (nincludes <= 0) {
+        expand_file(srcfile, def_table, out);
+        return;
+    }
+
+    SrcFile *sf = lex_src(srcfile);
+    if (sf == NULL || sf->tokens == NULL) return;
+
+    char *dirpath = src_dirpath(srcfile);
+    Cursor c = {sf->tokens, sf->content.ptr, sf->content.end};
+    Span key;
+    int found = find_prefix(c, dirpath, nincludes, &key);
+
+    if (found > 0) {
+        bool share = shared_includes > 0 && def_table->count == 0 && def_table->parent == NULL;
+        SharedPrefix *sp = share ? find_shared_prefix(key) : NULL;
+
+        if (sp == NULL) {
+            sp = pool_alloc_struct(SharedPrefix);
+            sp->key = key;
+            sp->table = share ? prep_define_newtable() : def_table;
+            sp->nincludes = found;
+            sp->outputs = pool_alloc(sizeof(Token *) * found, Token *);
+
+            if (snapshot_path == NULL || !load_snapshot(sp)) build_prefix(c, dirpath, sp);
+
+            if (share) {
+                uint h = hash(key, SHARED_PREFIXES_SIZE);
+                sp->table->frozen = true;
+                sp->next = shared_prefixes[h];
+                shared_prefixes[h] = sp;
+            }
+        }
+
+        if (share) def_table->parent = sp->table;
+        replay_prefix(&c, sp, out);
+    }
+
+    expand(&c, dirpath, def_table, out);
+}
+
+// #if expressions are compiled once per directive location into a small stack bytecode. The program
+// keeps the macros that were looked up while expanding the condition; as long as they are defined
+// the same way, only the bytecode is rerun against the current table.
+
+enum tokenType {
+    PREP_END_TOKEN,
+    PREP_NUM_TOKEN, PREP_CHAR_TOKEN,
+    PREP_IDENTIFIER_TOKEN,
+    PREP_DEFINED_TOKEN,
+    PREP_OPEN_PAREN_TOKEN, PREP_CLOSE_PAREN_TOKEN,
+    PREP_NOT_TOKEN, PREP_TILDE_TOKEN,
+    PREP_STAR_TOKEN, PREP_DIVISION_TOKEN, PREP_PERCENT_TOKEN,
+    PREP_PLUS_TOKEN, PREP_MINUS_TOKEN,
+    PREP_SHL_TOKEN, PREP_SHR_TOKEN,
+    PREP_LESSER_TOKEN, PREP_GREATER_TOKEN, PREP_LESSER_OR_EQUAL_TOKEN, PREP_GREATER_OR_EQUAL_TOKEN,
+    PREP_DOUBLE_EQUAL_TOKEN, PREP_NOT_EQUAL_TOKEN,
+    PREP_AMPERSAND_TOKEN, PREP_CARET_TOKEN, PREP_PIPE_TOKEN,
+    PREP_AND_TOKEN, PREP_OR_TOKEN,
+    PREP_QUESTION_TOKEN, PREP_COLON_TOKEN, PREP_COMMA_TOKEN,
+    PREP_UNKNOWN_TOKEN,
+    PREP_TOKEN_COUNT
+};
+
+struct prepToken {
+    enum tokenType type;
+    Span span;
+};
+
+struct prepPunct {
+    char *str;
+    enum tokenType type;
+};
+
+static struct prepPunct prep_puncts[] = {
+    {"<<", PREP_SHL_TOKEN}, {">>", PREP_SHR_TOKEN},
+    {"<=", PREP_LESSER_OR_EQUAL_TOKEN}, {">=", PREP_GREATER_OR_EQUAL_TOKEN},
+    {"==", PREP_DOUBLE_EQUAL_TOKEN}, {"!=", PREP_NOT_EQUAL_TOKEN},
+    {"&&", PREP_AND_TOKEN}, {"||", PREP_OR_TOKEN},
+    {"(", PREP_OPEN_PAREN_TOKEN}, {")", PREP_CLOSE_PAREN_TOKEN},
+    {"!", PREP_NOT_TOKEN}, {"~", PREP_TILDE_TOKEN},
+    {"*", PREP_STAR_TOKEN}, {"/", PREP_DIVISION_TOKEN}, {"%", PREP_PERCENT_TOKEN},
+    {"+", PREP_PLUS_TOKEN}, {"-", PREP_MINUS_TOKEN},
+    {"<", PREP_LESSER_TOKEN}, {">", PREP_GREATER_TOKEN},
+    {"&", PREP_AMPERSAND_TOKEN}, {"^", PREP_CARET_TOKEN}, {"|", PREP_PIPE_TOKEN},
+    {"?", PREP_QUESTION_TOKEN}, {":", PREP_COLON_TOKEN}, {",", PREP_COMMA_TOKEN},
+};
+
+#define PREP_PUNCTS_SIZE (sizeof(prep_puncts) / sizeof(prep_puncts[0]))
+
+typedef enum {
+    COND_PUSH,                  // arg: constant index
+    COND_DEFINED,               // arg: name index
+    COND_NEG, COND_NOT, COND_COMPL, COND_BOOL,
+    COND_MUL, COND_DIV, COND_MOD, COND_ADD, COND_SUB, COND_SHL, COND_SHR,
+    COND_LT, COND_GT, COND_LE, COND_GE, COND_EQ, COND_NE,
+    COND_BAND, COND_XOR, COND_BOR,
+    COND_AND_JUMP,              // arg: target. Leaves 0 and jumps if the top is 0, pops it otherwise
+    COND_OR_JUMP,               // arg: target. Leaves 1 and jumps if the top isn't 0, pops it otherwise
+    COND_JUMP_ZERO,             // arg: target. Pops, jumps if 0
+    COND_JUMP,                  // arg: target
+    COND_POP,
+    COND_UNSIGNED,              // Converts the top to unsigned
+    COND_OP_COUNT
+} CondOp;
+
+#define COND_OP_BITS 8
+#define cond_instr(op, arg) ((uint) (op) | ((uint) (arg) << COND_OP_BITS))
+#define cond_op(instr) ((CondOp) ((instr) & ((1 << COND_OP_BITS) - 1)))
+#define cond_arg(instr) ((instr) >> COND_OP_BITS)
+
+typedef struct {
+    intmax_t value;
+    bool is_unsigned;
+} CondValue;
+
+typedef struct {
+    uint *code;
+    size_t code_size;
+    CondValue *consts;
+    Span *names;
+    MacroDep *guards;           // Macros expanded while compiling
+    size_t guards_size;
+    int max_depth;
+} CondProgram;
+
+typedef struct CondCacheEntry {
+    Token *directive;
+    CondProgram *program;
+    struct CondCacheEntry *next;
+} CondCacheEntry;
+
+#define COND_CACHE_SIZE 1024
+static CondCacheEntry **cond_cache;
+
+typedef struct {
+    Vec tokens;     // struct prepToken
+    Vec code;       // uint
+    Vec consts;     // CondValue
+    Vec names;      // Span
+    Vec guards;     // MacroDep
+    size_t pos;
+    int depth, max_depth;
+    bool error;
+} CondCompiler;
+
+static enum tokenType cond_token_type(PPToken *t) {
+    switch (t->type) {
+        case PP_NUMBER: return PREP_NUM_TOKEN;
+        case PP_CHAR: return PREP_CHAR_TOKEN;
+        case PP_DEFINED: return PREP_DEFINED_TOKEN;
+        case PP_IDENTIFIER: return spanstrcmp(t->span, "defined") == 0 ? PREP_UNKNOWN_TOKEN : PREP_IDENTIFIER_TOKEN;
+        case PP_PUNCT: {
+            for (int i = 0; i < PREP_PUNCTS_SIZE; i++) {
+                if (spanstrcmp(t->span, prep_puncts[i].str) == 0) return prep_puncts[i].type;
+            }
+        } break;
+        default: break;
+    }
+
+    return PREP_UNKNOWN_TOKEN;
+}
+
+static void cond_emit(CondCompiler *c, CondOp op, uint arg, int depth_delta) {
+    *(uint *) vec_push(&c->code) = cond_instr(op, arg);
+    c->depth += depth_delta;
+    if (c->depth > c->max_depth) c->max_depth = c->depth;
+}
+
+static void cond_emit_const(CondCompiler *c, CondValue value) {
+    *(CondValue *) vec_push(&c->consts) = value;
+    cond_emit(c, COND_PUSH, c->consts.size - 1, 1);
+}
+
+static void cond_patch(CondCompiler *c, size_t at) {
+    uint *code = c->code.ptr;
+    code[at] = cond_instr(cond_op(code[at]), c->code.size);
+}
+
+static struct prepToken *cond_peek(CondCompiler *c) {
+    static struct prepToken end = {PREP_END_TOKEN};
+    return c->pos < c->tokens.size ? (struct prepToken *) c->tokens.ptr + c->pos : &end;
+}
+
+static bool cond_expect(CondCompiler *c, enum tokenType type) {
+    if (cond_peek(c)->type != type) {
+        c->error = true;
+        return false;
+    }
+
+    c->pos++;
+    return true;
+}
+
+static CondValue parse_cond_number(Span sp, bool *ok) {
+    CondValue v = {0, false};
+    byte *p = sp.ptr;
+    int base = 10;
+    uintmax_t n = 0;
+    bool overflow = false;
+
+    if (*p == '0' && p + 1 < sp.end && (*(p + 1) == 'x' || *(p + 1) == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (*p == '0' && p + 1 < sp.end && (*(p + 1) == 'b' || *(p + 1) == 'B')) {
+        base = 2;
+        p += 2;
+    } else if (*p == '0') {
+        base = 8;
+    }
+
+    for ( ; p < sp.end; p++) {
+        int d;
+        if (isdigit(*p)) d = *p - '0';
+        else if (isxdigit(*p) && base == 16) d = tolower(*p) - 'a' + 10;
+        else break;
+
+        if (d >= base) break;
+        if (n > (UINTMAX_MAX - d) / base) overflow = true;
+        n = n * base + d;
+    }
+
+    for ( ; p < sp.end; p++) {
+        if (*p == 'u' || *p == 'U') v.is_unsigned = true;
+        else if (*p != 'l' && *p != 'L') break;
+    }
+
+    *ok = p == sp.end && !overflow;
+    if (n > INTMAX_MAX) v.is_unsigned = true;
+    v.value = (intmax_t) n;
+    return v;
+}
+
+static CondValue parse_cond_char(Span sp) {
+    byte *p = sp.ptr;
+    for ( ; *p != '\''; p++) // Encoding prefix
+        ;
+    p++;
+
+    intmax_t c = 0;
+    if (*p == '\\') {
+        p++;
+
+        switch (*p) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'v': c = '\v'; break;
+            case 'x': {
+                for (p++; p < sp.end && isxdigit(*p); p++) {
+                    c = c * 16 + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+                }
+            } break;
+            default: {
+                if (*p >= '0' && *p <= '7') {
+                    for (int i = 0; i < 3 && *p >= '0' && *p <= '7'; i++, p++) {
+                        c = c * 8 + (*p - '0');
+                    }
+                } else {
+                    c = *p;
+                }
+            } break;
+        }
+    } else {
+        c = *p;
+    }
+
+    return (CondValue) {(char) c, false};
+}
+
+typedef struct {
+    int prec;
+    CondOp op;
+} CondBinary;
+
+// Binding power of binary operators, larger binds tighter. && and || are compiled into jumps separately
+static CondBinary cond_binaries[PREP_TOKEN_COUNT] = {
+    [PREP_STAR_TOKEN] = {10, COND_MUL}, [PREP_DIVISION_TOKEN] = {10, COND_DIV}, [PREP_PERCENT_TOKEN] = {10, COND_MOD},
+    [PREP_PLUS_TOKEN] = {9, COND_ADD}, [PREP_MINUS_TOKEN] = {9, COND_SUB},
+    [PREP_SHL_TOKEN] = {8, COND_SHL}, [PREP_SHR_TOKEN] = {8, COND_SHR},
+    [PREP_LESSER_TOKEN] = {7, COND_LT}, [PREP_GREATER_TOKEN] = {7, COND_GT},
+    [PREP_LESSER_OR_EQUAL_TOKEN] = {7, COND_LE}, [PREP_GREATER_OR_EQUAL_TOKEN] = {7, COND_GE},
+    [PREP_DOUBLE_EQUAL_TOKEN] = {6, COND_EQ}, [PREP_NOT_EQUAL_TOKEN] = {6, COND_NE},
+    [PREP_AMPERSAND_TOKEN] = {5, COND_BAND},
+    [PREP_CARET_TOKEN] = {4, COND_XOR},
+    [PREP_PIPE_TOKEN] = {3, COND_BOR},
+    [PREP_AND_TOKEN] = {2, COND_AND_JUMP},
+    [PREP_OR_TOKEN] = {1, COND_OR_JUMP},
+};
+
+// Each of these compiles an operand and returns whether its type is unsigned, which is known from the
+// constants alone. The values carry it too, but ?: has to convert whichever branch it takes.
+static bool compile_cond_expr(CondCompiler *c);
+static bool compile_cond_binary(CondCompiler *c, int min_prec);
+
+static bool compile_cond_unary(CondCompiler *c) {
+    struct prepToken *tok = cond_peek(c);
+    bool ok = true;
+
+    switch (tok->type) {
+        case PREP_NUM_TOKEN: {
+            c->pos++;
+            CondValue v = parse_cond_number(tok->span, &ok);
+            cond_emit_const(c, v);
+            if (!ok) c->error = true;
+            return v.is_unsigned;
+        }
+        case PREP_CHAR_TOKEN: {
+            c->pos++;
+            cond_emit_const(c, parse_cond_char(tok->span));
+        } break;
+        case PREP_IDENTIFIER_TOKEN: { // Identifiers left after macro replacement are 0
+            c->pos++;
+            cond_emit_const(c, (CondValue) {0, false});
+        } break;
+        case PREP_DEFINED_TOKEN: {
+            c->pos++;
+            *(Span *) vec_push(&c->names) = tok->span;
+            cond_emit(c, COND_DEFINED, c->names.size - 1, 1);
+        } break;
+        case PREP_OPEN_PAREN_TOKEN: {
+            c->pos++;
+            bool is_unsigned = compile_cond_expr(c);
+            cond_expect(c, PREP_CLOSE_PAREN_TOKEN);
+            return is_unsigned;
+        }
+        case PREP_PLUS_TOKEN: {
+            c->pos++;
+            return compile_cond_unary(c);
+        }
+        case PREP_MINUS_TOKEN: {
+            c->pos++;
+            bool is_unsigned = compile_cond_unary(c);
+            cond_emit(c, COND_NEG, 0, 0);
+            return is_unsigned;
+        }
+        case PREP_NOT_TOKEN: {
+            c->pos++;
+            compile_cond_unary(c);
+            cond_emit(c, COND_NOT, 0, 0);
+        } break;
+        case PREP_TILDE_TOKEN: {
+            c->pos++;
+            bool is_unsigned = compile_cond_unary(c);
+            cond_emit(c, COND_COMPL, 0, 0);
+            return is_unsigned;
+        }
+        default: {
+            c->error = true;
+            c->pos = c->tokens.size;
+            cond_emit_const(c, (CondValue) {0, false});
+        } break;
+    }
+
+    return false;
+}
+
+static bool compile_cond_binary(CondCompiler *c, int min_prec) {
+    bool is_unsigned = compile_cond_unary(c);
+
+    for (;;) {
+        enum tokenType type = cond_peek(c)->type;
+        CondBinary bin = cond_binaries[type];
+
+        if (bin.prec == 0 || bin.prec < min_prec) break;
+        c->pos++;
+
+        if (bin.op == COND_AND_JUMP || bin.op == COND_OR_JUMP) {
+            size_t jump = c->code.size;
+            cond_emit(c, bin.op, 0, -1);
+            compile_cond_binary(c, bin.prec + 1);
+            cond_emit(c, COND_BOOL, 0, 0);
+            cond_patch(c, jump);
+            is_unsigned = false;
+        } else {
+            bool rhs_unsigned = compile_cond_binary(c, bin.prec + 1);
+            cond_emit(c, bin.op, 0, -1);
+
+            if (bin.op >= COND_LT && bin.op <= COND_NE) is_unsigned = false; // Comparisons give int
+            else if (bin.op != COND_SHL && bin.op != COND_SHR) is_unsigned = is_unsigned || rhs_unsigned;
+        }
+    }
+
+    return is_unsigned;
+}
+
+static bool compile_cond_conditional(CondCompiler *c) {
+    bool is_unsigned = compile_cond_binary(c, 1);
+
+    if (cond_peek(c)->type == PREP_QUESTION_TOKEN) {
+        c->pos++;
+
+        size_t jump_else = c->code.size;
+        cond_emit(c, COND_JUMP_ZERO, 0, -1);
+        bool then_unsigned = compile_cond_expr(c);
+
+        size_t jump_end = c->code.size;
+        cond_emit(c, COND_JUMP, 0, -1);
+        cond_patch(c, jump_else);
+
+        cond_expect(c, PREP_COLON_TOKEN);
+        bool else_unsigned = compile_cond_conditional(c);
+        cond_patch(c, jump_end);
+
+        // The usual arithmetic conversions apply to the branches, either one being unsigned makes both so
+        is_unsigned = then_unsigned || else_unsigned;
+        if (is_unsigned) cond_emit(c, COND_UNSIGNED, 0, 0);
+    }
+
+    return is_unsigned;
+}
+
+static bool compile_cond_expr(CondCompiler *c) {
+    bool is_unsigned = compile_cond_conditional(c);
+
+    while (cond_peek(c)->type == PREP_COMMA_TOKEN) {
+        c->pos++;
+        cond_emit(c, COND_POP, 0, -1);
+        is_unsigned = compile_cond_conditional(c);
+    }
+
+    return is_unsigned;
+}
+
+static CondProgram *compile_cond(Cursor line, DefineTable *def_table) {
+    CondCompiler c = {
+        .tokens = {.item_size = sizeof(struct prepToken)},
+        .code = {.item_size = sizeof(uint)},
+        .consts = {.item_size = sizeof(CondValue)},
+        .names = {.item_size = sizeof(Span)},
+        .guards = {.item_size = sizeof(MacroDep)},
+    };
+
+    Expander x = {.table = def_table, .deps = &c.guards, .in_cond = true};
+    TokenList expr;
+    list_init(&expr);
+
+    PPToken *t;
+    while ((t = next_pptoken(&line, true)) != NULL) {
+        list_append(&expr, t);
+    }
+
+    for (t = expand_list(&x, expr.head); t != NULL; t = t->next) {
+        *(struct prepToken *) vec_push(&c.tokens) = (struct prepToken) {cond_token_type(t), t->span};
+    }
+
+    if (!c.error) {
+        compile_cond_expr(&c);
+        if (c.pos != c.tokens.size) c.error = true;
+    }
+
+    if (c.error) {
+        fprintf(stderr, "expand: invalid #if expression '");
+        for (t = expr.head; t != NULL; t = t->next) {
+            fprintf(stderr, "%s%.*s", t == expr.head ? "" : " ", (int) (t->span.end - t->span.ptr), t->span.ptr);
+        }
+        fprintf(stderr, "'\n");
+
+        c.code.size = c.names.size = 0;
+        c.consts.size = 0;
+        c.depth = c.max_depth = 0;
+        cond_emit_const(&c, (CondValue) {0, false});
+    }
+
+    CondProgram *prog = pool_alloc_struct(CondProgram);
+    prog->code = vec_copy_to_pool(&c.code, __alignof(uint));
+    prog->code_size = c.code.size;
+    prog->consts = vec_copy_to_pool(&c.consts, __alignof(CondValue));
+    prog->names = vec_copy_to_pool(&c.names, __alignof(Span));
+    prog->guards = vec_copy_to_pool(&c.guards, __alignof(MacroDep));
+    prog->guards_size = c.guards.size;
+    prog->max_depth = c.max_depth;
+
+    free(c.tokens.ptr);
+    free(c.code.ptr);
+    free(c.consts.ptr);
+    free(c.names.ptr);
+    free(c.guards.ptr);
+
+    return prog;
+}
+
+static bool guards_hold(CondProgram *prog, DefineTable *def_table) {
+    for (size_t i = 0; i < prog->guards_size; i++) {
+        if (!macro_equal(prog->guards[i].macro, prep_define_get(def_table, prog->guards[i].name))) return false;
+    }
+
+    return true;
+}
+
+static CondValue cond_binary(CondOp op, CondValue a, CondValue b) {
+    bool u = a.is_unsigned || b.is_unsigned;
+    uintmax_t ua = (uintmax_t) a.value, ub = (uintmax_t) b.value;
+    CondValue r = {0, u};
+
+    switch (op) {
+        case COND_MUL: r.value = (intmax_t) (ua * ub); break;
+        case COND_ADD: r.value = (intmax_t) (ua + ub); break;
+        case COND_SUB: r.value = (intmax_t) (ua - ub); break;
+        case COND_DIV:
+        case COND_MOD: {
+            if (b.value == 0) {
+                fprintf(stderr, "expand: division by zero in #if\n");
+            } else if (u) {
+                r.value = (intmax_t) (op == COND_DIV ? ua / ub : ua % ub);
+            } else if (a.value == INTMAX_MIN && b.value == -1) {
+                r.value = op == COND_DIV ? INTMAX_MIN : 0;
+            } else {
+                r.value = op == COND_DIV ? a.value / b.value : a.value % b.value;
+            }
+        } break;
+        case COND_SHL:
+        case COND_SHR: {
+            r.is_unsigned = a.is_unsigned;
+            uint shift = ub >= 64 ? 64 : (uint) ub;
+
+            if (shift >= 64) r.value = (op == COND_SHR && !a.is_unsigned && a.value < 0) ? -1 : 0;
+            else if (op == COND_SHL) r.value = (intmax_t) (ua << shift);
+            else if (a.is_unsigned) r.value = (intmax_t) (ua >> shift);
+            else r.value = a.value >> shift;
+        } break;
+        case COND_LT: r = (CondValue) {u ? ua < ub : a.value < b.value, false}; break;
+        case COND_GT: r = (CondValue) {u ? ua > ub : a.value > b.value, false}; break;
+        case COND_LE: r = (CondValue) {u ? ua <= ub : a.value <= b.value, false}; break;
+        case COND_GE: r = (CondValue) {u ? ua >= ub : a.value >= b.value, false}; break;
+        case COND_EQ: r = (CondValue) {ua == ub, false}; break;
+        case COND_NE: r = (CondValue) {ua != ub, false}; break;
+        case COND_BAND: r.value = (intmax_t) (ua & ub); break;
+        case COND_XOR: r.value = (intmax_t) (ua ^ ub); break;
+        case COND_BOR: r.value = (intmax_t) (ua | ub); break;
+        default: assert(0);
+    }
+
+    return r;
+}
+
+static bool run_cond(CondProgram *prog, DefineTable *def_table) {
+    CondValue stack[prog->max_depth + 1];
+    CondValue *top = stack;
+
+    for (size_t pc = 0; pc < prog->code_size; pc++) {
+        uint instr = prog->code[pc];
+
+        switch (cond_op(instr)) {
+            case COND_PUSH: *top++ = prog->consts[cond_arg(instr)]; break;
+            case COND_DEFINED: {
+                *top++ = (CondValue) {prep_define_get(def_table, prog->names[cond_arg(instr)]) != NULL, false};
+            } break;
+            case COND_NEG: (top - 1)->value = (intmax_t) -(uintmax_t) (top - 1)->value; break;
+            case COND_NOT: *(top - 1) = (CondValue) {(top - 1)->value == 0, false}; break;
+            case COND_COMPL: (top - 1)->value = ~(top - 1)->value; break;
+            case COND_BOOL: *(top - 1) = (CondValue) {(top - 1)->value != 0, false}; break;
+            case COND_AND_JUMP:
+            case COND_OR_JUMP: {
+                bool is_and = cond_op(instr) == COND_AND_JUMP;
+
+                if (((top - 1)->value != 0) != is_and) {
+                    *(top - 1) = (CondValue) {!is_and, false};
+                    pc = cond_arg(instr) - 1;
+                } else {
+                    top--;
+                }
+            } break;
+            case COND_JUMP_ZERO: {
+                if ((--top)->value == 0) pc = cond_arg(instr) - 1;
+            } break;
+            case COND_JUMP: pc = cond_arg(instr) - 1; break;
+            case COND_POP: top--; break;
+            case COND_UNSIGNED: (top - 1)->is_unsigned = true; break;
+            default: {
+                top--;
+                *(top - 1) = cond_binary(cond_op(instr), *(top - 1), *top);
+            } break;
+        }
+    }
+
+    assert(top == stack + 1);
+    return stack[0].value != 0;
+}
+
+static bool eval_expr(Token *directive, Cursor line, DefineTable *def_table) {
+    if (cond_cache == NULL) {
+        cond_cache = pool_alloc(sizeof(CondCacheEntry *) * COND_CACHE_SIZE, CondCacheEntry *);
+    }
+
+    uint h = (uint) (((uintptr_t) directive >> 3) % COND_CACHE_SIZE);
+    CondCacheEntry *entry;
+
+    for (entry = cond_cache[h]; entry != NULL; entry = entry->next) {
+        if (entry->directive == directive) break;
+    }
+
+    if (entry == NULL) {
+        entry = pool_alloc_struct(CondCacheEntry);
+        entry->directive = directive;
+        entry->next = cond_cache[h];
+        cond_cache[h] = entry;
+    }
+
+    if (entry->program == NULL || !guards_hold(entry->program, def_table)) {
+        entry->program = compile_cond(line, def_table);
+    }
+
+    return run_cond(entry->program, def_table);
+}
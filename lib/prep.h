@@ -1,15 +1,41 @@
 #ifndef ZHABA_PREP_H
 #define ZHABA_PREP_H
 
+#include <stdio.h>
+
 #include "common.h"
 #include "parser.h"
 
 typedef struct DefineTable DefineTable;
+typedef struct SourceMap SourceMap;
+
+// Where a byte of the output comes from. The output of a macro invocation is at the invocation.
+typedef struct {
+    char *path; // NULL for text made by the preprocessor, e.g. a #line marker
+    size_t offset;
+    int line;
+    int column;
+    bool expanded;
+} SourcePos;
 
 void prep_define_set(DefineTable *table, Span key, void *value);
 void *prep_define_get(DefineTable *table, Span key);
 DefineTable *prep_define_newtable();
+DefineTable *prep_define_fork(DefineTable *parent);
+DefineTable *prep_define_parent(DefineTable *table);
 char *prep_expand(char *srcfile, DefineTable *def_table, char *out, int *outsz);
+Token *prep_expand_tokens(char *srcfile, DefineTable *def_table);
 void prep_search_paths_set(char **, size_t);
+void prep_snapshot_set(char *path, int nincludes);
+int prep_snapshot_loads();
+void prep_shared_prefix_set(int nincludes);
+void prep_prefetch_set(int nthreads);
+SourceMap *prep_source_map_new();
+void prep_source_map_set(SourceMap *map);
+bool prep_source_map_lookup(SourceMap *map, size_t offset, SourcePos *pos);
+void prep_line_markers_set(bool on);
+void prep_trace_set(bool on);
+void prep_trace_write_json(FILE *f);
+void prep_trace_write_summary(FILE *f);
 
 #endif //ZHABA_PREP_H
\ No newline at end of file
@@ -0,0 +1,390 @@
+#include "symbol_db.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The header is followed by the buckets of the entries, the entries, the buckets of the files, the files and
+// the strings, each section as big as its capacity. Numbers are native 32-bit words, so SYMBOL_DB_VERSION
+// goes up whenever the layout or SymbolKind changes.
+#define SYMBOL_DB_MAGIC "ZHBSYMS"
+#define SYMBOL_DB_VERSION 2
+
+#define INITIAL_ENTRIES 64
+#define INITIAL_FILES 8
+#define INITIAL_STRINGS 1024
+
+typedef struct {
+    char magic[sizeof(SYMBOL_DB_MAGIC)];
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t entries_cap; // Also the number of their buckets, a power of two
+    uint32_t nfiles;
+    uint32_t files_cap;   // Same for the files
+    uint32_t strings_size;
+    uint32_t strings_cap;
+} SymbolDbHeader;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t next;
+    uint32_t name; // Offset into the strings, zero terminated
+    uint32_t live; // False once the file was added again
+} SymbolDbFile;
+
+typedef struct {
+    size_t buckets;
+    size_t entries;
+    size_t file_buckets;
+    size_t files;
+    size_t strings;
+    size_t end;
+} Layout;
+
+static Layout layout_of(uint32_t entries_cap, uint32_t files_cap, uint32_t strings_cap) {
+    Layout l;
+    l.buckets = sizeof(SymbolDbHeader);
+    l.entries = l.buckets + (size_t) entries_cap * sizeof(uint32_t);
+    l.file_buckets = l.entries + (size_t) entries_cap * sizeof(SymbolDbEntry);
+    l.files = l.file_buckets + (size_t) files_cap * sizeof(uint32_t);
+    l.strings = l.files + (size_t) files_cap * sizeof(SymbolDbFile);
+    l.end = l.strings + strings_cap;
+    return l;
+}
+
+static SymbolDbHeader *header(SymbolDb *db) {
+    return (SymbolDbHeader *) db->map;
+}
+
+static Layout layout(SymbolDb *db) {
+    SymbolDbHeader *h = header(db);
+    return layout_of(h->entries_cap, h->files_cap, h->strings_cap);
+}
+
+static uint32_t *buckets(SymbolDb *db) {
+    return (uint32_t *) (db->map + layout(db).buckets);
+}
+
+static SymbolDbEntry *entries(SymbolDb *db) {
+    return (SymbolDbEntry *) (db->map + layout(db).entries);
+}
+
+static uint32_t *file_buckets(SymbolDb *db) {
+    return (uint32_t *) (db->map + layout(db).file_buckets);
+}
+
+static SymbolDbFile *files(SymbolDb *db) {
+    return (SymbolDbFile *) (db->map + layout(db).files);
+}
+
+static char *strings(SymbolDb *db) {
+    return (char *) db->map + layout(db).strings;
+}
+
+static uint32_t name_hash(Span name) {
+    return hash(name, UINT_MAX);
+}
+
+// Grows the file with zeros up to size, larger than it is
+static bool extend_file(SymbolDb *db, size_t size) {
+    return fseek(db->file, size - 1, SEEK_SET) == 0 && fputc(0, db->file) != EOF && fflush(db->file) == 0;
+}
+
+static bool map_file(SymbolDb *db, size_t size) {
+    int prot = db->writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    db->map = mmap(NULL, size, prot, MAP_SHARED, fileno(db->file), 0);
+    db->size = size;
+    return db->map != MAP_FAILED;
+}
+
+// Creates the file when writable and there is none yet
+SymbolDb *symdb_open(char *path, bool writable) {
+    FILE *file = fopen(path, writable ? "r+b" : "rb");
+    if (file == NULL && writable) file = fopen(path, "w+b");
+
+    if (file == NULL) {
+        fprintf(stderr, "symdb: cannot open %s\n", path);
+        return NULL;
+    }
+
+    SymbolDb *db = malloc(sizeof(SymbolDb));
+    assert(db);
+    *db = (SymbolDb) {file, writable, MAP_FAILED, 0};
+
+    struct stat st;
+    bool ok = fstat(fileno(file), &st) == 0;
+    bool fresh = ok && writable && st.st_size == 0;
+
+    if (fresh) {
+        st.st_size = layout_of(INITIAL_ENTRIES, INITIAL_FILES, INITIAL_STRINGS).end;
+        ok = extend_file(db, st.st_size);
+    }
+
+    ok = ok && st.st_size >= (off_t) sizeof(SymbolDbHeader) && map_file(db, st.st_size);
+
+    if (ok && fresh) {
+        SymbolDbHeader *h = header(db);
+        memcpy(h->magic, SYMBOL_DB_MAGIC, sizeof(SYMBOL_DB_MAGIC));
+        h->version = SYMBOL_DB_VERSION;
+        h->entries_cap = INITIAL_ENTRIES;
+        h->files_cap = INITIAL_FILES;
+        h->strings_cap = INITIAL_STRINGS;
+    }
+
+    if (ok) {
+        SymbolDbHeader *h = header(db);
+        ok = memcmp(h->magic, SYMBOL_DB_MAGIC, sizeof(SYMBOL_DB_MAGIC)) == 0 && h->version == SYMBOL_DB_VERSION;
+        ok = ok && layout(db).end <= db->size && h->nentries <= h->entries_cap && h->nfiles <= h->files_cap;
+        ok = ok && h->strings_size <= h->strings_cap;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "symdb: %s is not a symbol database\n", path);
+        symdb_close(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+// Chains every entry and file again, the newest first like they were added
+static void rehash(SymbolDb *db) {
+    SymbolDbHeader *h = header(db);
+
+    uint32_t *bucket = buckets(db);
+    SymbolDbEntry *entry = entries(db);
+    memset(bucket, 0, h->entries_cap * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < h->nentries; i++) {
+        uint32_t *b = &bucket[entry[i].hash & (h->entries_cap - 1)];
+        entry[i].next = *b;
+        *b = i + 1;
+    }
+
+    uint32_t *file_bucket = file_buckets(db);
+    SymbolDbFile *file = files(db);
+    memset(file_bucket, 0, h->files_cap * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        uint32_t *b = &file_bucket[file[i].hash & (h->files_cap - 1)];
+        file[i].next = *b;
+        *b = i + 1;
+    }
+}
+
+static int cmp_offset(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Drops the files added again since, their entries and the strings nothing refers to anymore. Everything
+// moves down in place and keeps its order. Returns whether there was anything to drop.
+static bool compact(SymbolDb *db) {
+    SymbolDbHeader *h = header(db);
+    SymbolDbFile *file = files(db);
+    SymbolDbEntry *entry = entries(db);
+    char *str = strings(db);
+
+    uint32_t *file_index = malloc((h->nfiles + 1) * sizeof(uint32_t)); // New index of each file, or UINT32_MAX
+    assert(file_index != NULL);
+    uint32_t nfiles = 0, nentries = 0;
+
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        file_index[i] = file[i].live ? nfiles++ : UINT32_MAX;
+    }
+
+    if (nfiles == h->nfiles) {
+        free(file_index);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h->nentries; i++) {
+        if (file_index[entry[i].file] == UINT32_MAX) continue;
+
+        entry[nentries] = entry[i];
+        entry[nentries++].file = file_index[entry[i].file];
+    }
+
+    for (uint32_t i = 0; i < h->nfiles; i++) {
+        if (file_index[i] != UINT32_MAX) file[file_index[i]] = file[i];
+    }
+
+    // The strings still named, moved down in the order they were in. An old offset is looked up among
+    // the sorted ones to find the new one at the same position.
+    uint32_t *offsets = malloc((nentries + nfiles + 1) * sizeof(uint32_t));
+    uint32_t *new_offsets = malloc((nentries + nfiles + 1) * sizeof(uint32_t));
+    assert(offsets != NULL && new_offsets != NULL);
+
+    for (uint32_t i = 0; i < nentries + nfiles; i++) {
+        offsets[i] = i < nentries ? entry[i].name : file[i - nentries].name;
+    }
+
+    qsort(offsets, nentries + nfiles, sizeof(uint32_t), cmp_offset);
+    uint32_t nstrings = 0, size = 0;
+
+    for (uint32_t i = 0; i < nentries + nfiles; i++) {
+        if (nstrings > 0 && offsets[nstrings - 1] == offsets[i]) continue;
+
+        uint32_t len = strlen(str + offsets[i]) + 1;
+        memmove(str + size, str + offsets[i], len);
+        offsets[nstrings] = offsets[i];
+        new_offsets[nstrings++] = size;
+        size += len;
+    }
+
+    for (uint32_t i = 0; i < nentries + nfiles; i++) {
+        uint32_t *name = i < nentries ? &entry[i].name : &file[i - nentries].name;
+        uint32_t *found = bsearch(name, offsets, nstrings, sizeof(uint32_t), cmp_offset);
+        *name = new_offsets[found - offsets];
+    }
+
+    h->nentries = nentries;
+    h->nfiles = nfiles;
+    h->strings_size = size;
+    rehash(db);
+
+    free(file_index);
+    free(offsets);
+    free(new_offsets);
+    return true;
+}
+
+// Makes room for that many more of each, dropping what was superseded first if there isn't. Growing moves
+// the sections up, the last one first so that nothing is overwritten before it moved. Both invalidate every
+// pointer into the mapping, and dropping changes the indices of the files.
+static void reserve(SymbolDb *db, uint32_t nentries, uint32_t nfiles, uint32_t nstrings) {
+    SymbolDbHeader *h = header(db);
+    bool full = h->entries_cap - h->nentries < nentries || h->files_cap - h->nfiles < nfiles ||
+                h->strings_cap - h->strings_size < nstrings;
+
+    if (full && compact(db)) h = header(db);
+
+    uint32_t entries_cap = h->entries_cap, files_cap = h->files_cap, strings_cap = h->strings_cap;
+
+    while (entries_cap - h->nentries < nentries) entries_cap *= 2;
+    while (files_cap - h->nfiles < nfiles) files_cap *= 2;
+    while (strings_cap - h->strings_size < nstrings) strings_cap *= 2;
+
+    if (entries_cap == h->entries_cap && files_cap == h->files_cap && strings_cap == h->strings_cap) return;
+
+    Layout from = layout(db), to = layout_of(entries_cap, files_cap, strings_cap);
+    munmap(db->map, db->size);
+
+    if (!extend_file(db, to.end) || !map_file(db, to.end)) {
+        fprintf(stderr, "symdb: cannot grow the symbol database to %zu bytes\n", to.end);
+        exit(EXIT_FAILURE);
+    }
+
+    h = header(db);
+    memmove(db->map + to.strings, db->map + from.strings, h->strings_size);
+    memmove(db->map + to.files, db->map + from.files, h->nfiles * sizeof(SymbolDbFile));
+    memmove(db->map + to.entries, db->map + from.entries, h->nentries * sizeof(SymbolDbEntry));
+
+    h->entries_cap = entries_cap;
+    h->files_cap = files_cap;
+    h->strings_cap = strings_cap;
+    rehash(db);
+}
+
+// Room must have been reserved
+static uint32_t add_string(SymbolDb *db, Span str) {
+    SymbolDbHeader *h = header(db);
+    uint32_t offset = h->strings_size;
+    uint32_t len = str.end - str.ptr;
+
+    char *dst = strings(db) + offset;
+    memcpy(dst, str.ptr, len);
+    dst[len] = '\0';
+    h->strings_size += len + 1;
+    return offset;
+}
+
+static bool is_global(uint32_t kind) {
+    return kind == GLOBAL_SYMBOL || kind == FUNCTION_SYMBOL || kind == TYPEDEF_SYMBOL || kind == STRUCT_SYMBOL ||
+           kind == MACRO_SYMBOL;
+}
+
+// Adds the definitions of ast that other files can refer to, in place of what filename had so far
+void symdb_add(SymbolDb *db, char *filename, Ast *ast) {
+    assert(db->writable);
+    Span fname = {(byte *) filename, (byte *) filename + strlen(filename)};
+    uint32_t fhash = name_hash(fname);
+
+    reserve(db, 0, 1, strlen(filename) + 1);
+    SymbolDbHeader *h = header(db);
+    SymbolDbFile *file = files(db);
+    uint32_t *fbucket = &file_buckets(db)[fhash & (h->files_cap - 1)];
+
+    for (uint32_t i = *fbucket; i != 0; i = file[i - 1].next) {
+        SymbolDbFile *f = &file[i - 1];
+        if (f->live && f->hash == fhash && strcmp(strings(db) + f->name, filename) == 0) f->live = false;
+    }
+
+    file[h->nfiles] = (SymbolDbFile) {fhash, *fbucket, add_string(db, fname), true};
+    *fbucket = ++h->nfiles;
+
+    for (uint32_t d = 0; d < ast->ndefs; d++) {
+        SymbolDef *def = &ast->defs[d];
+        if (!is_global(def->kind)) continue;
+
+        Token *t = ast->tokens[def->token];
+        uint32_t len = t->span.end - t->span.ptr;
+        uint32_t nhash = name_hash(t->span);
+
+        reserve(db, 1, 0, len + 1);
+        h = header(db);
+        uint32_t fileidx = h->nfiles - 1; // Still the newest file
+        SymbolDbEntry *entry = entries(db);
+        uint32_t *bucket = &buckets(db)[nhash & (h->entries_cap - 1)];
+
+        // The name is kept once for all of its entries
+        uint32_t name = UINT32_MAX;
+        for (uint32_t i = *bucket; i != 0 && name == UINT32_MAX; i = entry[i - 1].next) {
+            SymbolDbEntry *e = &entry[i - 1];
+            if (e->hash == nhash && e->name_len == len && memcmp(strings(db) + e->name, t->span.ptr, len) == 0) {
+                name = e->name;
+            }
+        }
+
+        if (name == UINT32_MAX) name = add_string(db, t->span);
+
+        entry[h->nentries] = (SymbolDbEntry) {nhash, *bucket, name, len, fileidx, t->line, t->column, def->kind};
+        *bucket = ++h->nentries;
+    }
+}
+
+// The first entry defining name after the one given, NULL to start from the newest. Entries of files
+// added again since are skipped.
+SymbolDbEntry *symdb_find(SymbolDb *db, Span name, SymbolDbEntry *after) {
+    SymbolDbHeader *h = header(db);
+    SymbolDbEntry *entry = entries(db);
+    SymbolDbFile *file = files(db);
+    char *str = strings(db);
+
+    uint32_t len = name.end - name.ptr;
+    uint32_t nhash = name_hash(name);
+
+    uint32_t i = after != NULL ? after->next : buckets(db)[nhash & (h->entries_cap - 1)];
+    for (; i != 0; i = entry[i - 1].next) {
+        SymbolDbEntry *e = &entry[i - 1];
+        if (e->hash == nhash && e->name_len == len && memcmp(str + e->name, name.ptr, len) == 0 &&
+            file[e->file].live) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+char *symdb_filename(SymbolDb *db, SymbolDbEntry *entry) {
+    return strings(db) + files(db)[entry->file].name;
+}
+
+void symdb_close(SymbolDb *db) {
+    if (db->map != MAP_FAILED) munmap(db->map, db->size);
+    fclose(db->file);
+    free(db);
+}
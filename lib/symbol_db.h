@@ -0,0 +1,35 @@
+#ifndef ZHABA_SYMBOL_DB_H
+#define ZHABA_SYMBOL_DB_H
+
+#include <stdio.h>
+#include "parser.h"
+
+// Where the globals, functions, typedefs, structs and macros of the files rendered are defined. The database is
+// a file used in place through a shared mapping, both while files are added and when it is looked up,
+// so it never gets read into the heap. Adding a file again supersedes what it had before, which is dropped
+// the next time the database would have to grow.
+typedef struct {
+    uint32_t hash;
+    uint32_t next;     // Index plus one of the next entry in the bucket, 0 at the end
+    uint32_t name;     // Offset into the strings, shared by the entries of a name
+    uint32_t name_len;
+    uint32_t file;     // Index into the files
+    uint32_t line;
+    uint32_t column;
+    uint32_t kind;     // SymbolKind
+} SymbolDbEntry;
+
+typedef struct {
+    FILE *file;
+    bool writable;
+    byte *map;
+    size_t size;
+} SymbolDb;
+
+SymbolDb *symdb_open(char *path, bool writable);
+void symdb_add(SymbolDb *, char *filename, Ast *);
+SymbolDbEntry *symdb_find(SymbolDb *, Span name, SymbolDbEntry *after);
+char *symdb_filename(SymbolDb *, SymbolDbEntry *);
+void symdb_close(SymbolDb *);
+
+#endif //ZHABA_SYMBOL_DB_H
@@ -0,0 +1,131 @@
+#include "symbols.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int def_cmp(const void *d1, const void *d2) {
+    TokenRef t1 = ((SymbolDef *) d1)->token, t2 = ((SymbolDef *) d2)->token;
+    return t1 < t2 ? -1 : t1 > t2;
+}
+
+static int use_cmp(const void *u1, const void *u2) {
+    TokenRef t1 = ((SymbolUse *) u1)->token, t2 = ((SymbolUse *) u2)->token;
+    return t1 < t2 ? -1 : t1 > t2;
+}
+
+// A copy of arr sorted with cmp, which a sequential parse leaves almost nothing to do for
+static void *sorted_copy(void *arr, uint32_t n, size_t size, int (*cmp)(const void *, const void *)) {
+    void *copy = malloc(n * size + 1);
+    assert(copy);
+    if (n == 0) return copy;
+
+    memcpy(copy, arr, n * size);
+
+    for (uint32_t i = 1; i < n; i++) {
+        if (cmp((char *) copy + (i - 1) * size, (char *) copy + i * size) > 0) {
+            qsort(copy, n, size, cmp);
+            break;
+        }
+    }
+
+    return copy;
+}
+
+static Span name_of(SymbolIndex *index, SymbolDef *def) {
+    return index->ast->tokens[def->token]->span;
+}
+
+SymbolIndex *symbols_index(Ast *ast) {
+    SymbolIndex *index = calloc(1, sizeof(SymbolIndex));
+    assert(index);
+    index->ast = ast;
+    index->ndefs = ast->ndefs;
+    index->nuses = ast->nuses;
+    index->defs = sorted_copy(ast->defs, ast->ndefs, sizeof(SymbolDef), def_cmp);
+    index->uses = sorted_copy(ast->uses, ast->nuses, sizeof(SymbolUse), use_cmp);
+
+    // What the uses refer to through a table by token, so that it all takes time linear in the tokens
+    uint32_t *def_at = calloc(ast->ntokens + 1, sizeof(uint32_t));
+    index->use_defs = malloc(index->nuses * sizeof(uint32_t) + 1);
+    assert(def_at && index->use_defs);
+
+    for (uint32_t d = 0; d < index->ndefs; d++) def_at[index->defs[d].token] = d + 1;
+
+    for (uint32_t i = 0; i < index->nuses; i++) {
+        assert(index->uses[i].def < ast->ntokens && def_at[index->uses[i].def] != 0);
+        index->use_defs[i] = def_at[index->uses[i].def] - 1;
+    }
+
+    free(def_at);
+
+    // Counted then placed, each group fills up in the order of the uses
+    index->use_starts = calloc(index->ndefs + 1, sizeof(uint32_t));
+    index->def_uses = malloc(index->nuses * sizeof(TokenRef) + 1);
+    assert(index->use_starts && index->def_uses);
+
+    for (uint32_t i = 0; i < index->nuses; i++) index->use_starts[index->use_defs[i] + 1]++;
+
+    for (uint32_t d = 0; d < index->ndefs; d++) index->use_starts[d + 1] += index->use_starts[d];
+
+    for (uint32_t i = 0; i < index->nuses; i++) {
+        uint32_t d = index->use_defs[i];
+        index->def_uses[index->use_starts[d]++] = index->uses[i].token;
+    }
+
+    for (uint32_t d = index->ndefs; d > 0; d--) index->use_starts[d] = index->use_starts[d - 1];
+    index->use_starts[0] = 0;
+
+    index->size = 16;
+    while (index->size < index->ndefs * 2) index->size *= 2;
+    index->buckets = calloc(index->size, sizeof(uint32_t));
+    index->next = malloc(index->ndefs * sizeof(uint32_t) + 1);
+    assert(index->buckets && index->next);
+
+    for (uint32_t d = index->ndefs; d > 0; d--) { // Chained in source order
+        uint h = hash(name_of(index, &index->defs[d - 1]), index->size);
+        index->next[d - 1] = index->buckets[h];
+        index->buckets[h] = d;
+    }
+
+    return index;
+}
+
+void symbols_free(SymbolIndex *index) {
+    free(index->defs);
+    free(index->uses);
+    free(index->use_defs);
+    free(index->use_starts);
+    free(index->def_uses);
+    free(index->buckets);
+    free(index->next);
+    free(index);
+}
+
+// The definition the identifier at t is, NULL if it is none
+SymbolDef *symbols_def_at(SymbolIndex *index, TokenRef t) {
+    SymbolDef key = {t};
+    return bsearch(&key, index->defs, index->ndefs, sizeof(SymbolDef), def_cmp);
+}
+
+// The use the identifier at t is, NULL if it is none
+SymbolUse *symbols_use_at(SymbolIndex *index, TokenRef t) {
+    SymbolUse key = {t};
+    return bsearch(&key, index->uses, index->nuses, sizeof(SymbolUse), use_cmp);
+}
+
+// The definitions of name in source order, the first with after NULL
+SymbolDef *symbols_find(SymbolIndex *index, Span name, SymbolDef *after) {
+    uint32_t d = after != NULL ? index->next[after - index->defs] : index->buckets[hash(name, index->size)];
+
+    for (; d != 0; d = index->next[d - 1]) {
+        if (spancmp(name_of(index, &index->defs[d - 1]), name) == 0) return &index->defs[d - 1];
+    }
+
+    return NULL;
+}
+
+TokenRef *symbols_uses_of(SymbolIndex *index, SymbolDef *def, uint32_t *count) {
+    uint32_t d = def - index->defs;
+    *count = index->use_starts[d + 1] - index->use_starts[d];
+    return index->def_uses + index->use_starts[d];
+}
@@ -0,0 +1,29 @@
+#ifndef ZHABA_SYMBOLS_H
+#define ZHABA_SYMBOLS_H
+
+#include "parser.h"
+
+// The symbols an Ast recorded, ordered for lookups: by token for what is at a token, grouped by
+// definition for its uses and hashed by name for the definitions of a name
+typedef struct {
+    Ast *ast;
+    SymbolDef *defs;      // By token
+    uint32_t ndefs;
+    SymbolUse *uses;      // By token
+    uint32_t nuses;
+    uint32_t *use_defs;   // Index into defs of what each of uses refers to
+    uint32_t *use_starts; // Where the uses of each of defs start in def_uses, one more for the end
+    TokenRef *def_uses;   // Each group in source order
+    uint32_t *buckets;    // Index into defs plus one, 0 for none, chained through next
+    uint32_t *next;
+    uint32_t size;
+} SymbolIndex;
+
+SymbolIndex *symbols_index(Ast *);
+void symbols_free(SymbolIndex *);
+SymbolDef *symbols_def_at(SymbolIndex *, TokenRef);
+SymbolUse *symbols_use_at(SymbolIndex *, TokenRef);
+SymbolDef *symbols_find(SymbolIndex *, Span name, SymbolDef *after);
+TokenRef *symbols_uses_of(SymbolIndex *, SymbolDef *, uint32_t *count);
+
+#endif //ZHABA_SYMBOLS_H
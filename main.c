@@ -2,10 +2,14 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <stdarg.h>
+#include <string.h>
+#include "lib/ast_cache.h"
 #include "lib/lexer.h"
 #include "lib/lib.h"
 #include "lib/parser.h"
 
+#define MAX_MEM (32 * 1024 * 1024)
+
 void throwerr(char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
@@ -18,7 +22,13 @@ void throwerr(char *fmt, ...) {
 
 int main(int argc, char** argv) {
     if (argc <= 1) {
-        throwerr("Usage: %s src-file [out-dir]\n", argv[0]);
+        throwerr("Usage: %s [-c cache-dir] src-file [out-dir [symbol-db]]\n", argv[0]);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "-c") == 0) { // Parses kept by source, rendering them again skips parsing
+        ast_cache_dir_set(argv[2]);
+        argv += 2;
+        argc -= 2;
     }
 
     char *outdir = ".";
@@ -26,10 +36,24 @@ int main(int argc, char** argv) {
         outdir = argv[2];
     }
 
+    // Accumulates over the runs, each file rendered replaces its own definitions
+    SymbolDb *symbol_db = NULL;
+    if (argc >= 4) {
+        symbol_db = symdb_open(argv[3], true);
+        if (symbol_db == NULL) exit(EXIT_FAILURE);
+    }
+
+    if (pool_init(MAX_MEM) < 0) {
+        throwerr("Unable to allocate memory\n");
+    }
+
     RenderError err;
     lexer_init();
     parser_init();
+    parser_recovery_set(true);
+    render_symbols_set(symbol_db);
     RenderErrorType res = render(argv[1], outdir, &err);
+    if (symbol_db != NULL) symdb_close(symbol_db);
 
     if (res < 0) {
         switch (res) {
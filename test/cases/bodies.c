@@ -0,0 +1,19 @@
+int before(int a) {
+    T * x + 1;
+    return a;
+}
+
+typedef int T;
+
+int after(T a) {
+    T * y;
+    {
+        int T = 2;
+        T * a;
+    }
+    return a;
+}
+
+int last(int b) {
+    return b * 2;
+}
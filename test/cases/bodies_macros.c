@@ -0,0 +1,15 @@
+int early(int a) {
+    return a + LIMIT;
+}
+
+#define LIMIT 10
+
+int middle(int b) {
+    return b + LIMIT;
+}
+
+#define LIMIT 20
+
+int late(int c) {
+    return c * LIMIT;
+}
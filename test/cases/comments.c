@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 // Top-level comment
+/*a<b&&c>d,a_clean_run_longer_than_sixteen_bytes<br>and_another_one_past_the_lanes&*/
 
 int main() {
     // Comment above
@@ -0,0 +1,23 @@
+#ifndef DIRECTIVES_H
+#define DIRECTIVES_H
+
+#pragma pack(push, \
+        1)
+
+int main(int argc) {
+    int a = 1;
+#ifdef DEBUG
+    a = 2;
+#endif
+    a = 3;
+    if (argc > 1) {
+#if 0
+        a = 4
+#else
+        a = 5;
+#endif
+    }
+    return a;
+}
+
+#endif
@@ -0,0 +1,14 @@
+struct node {
+    int value;
+};
+
+int main(int argc, char **argv) {
+    int x = 1 + 2 * 3 - 4 / 2 % 3;
+    int y = (x + 1) * (x - 1) << 2 | x & 7 ^ ~x;
+    x += y > 3 && y <= 10 || !x ? -x : x++;
+    y = x = sizeof(int) + sizeof x;
+    argv[argc - 1][0] = (char) 'a';
+    --x, y--;
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#ifdef NOPE
+#error not reached
+#endif
+#warning  careful here  
+int a;
+#error stop
+int b;
+#ident "unknown"
+int c;
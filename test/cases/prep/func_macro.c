@@ -0,0 +1,32 @@
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define STR(x) #x
+#define XSTR(x) STR(x)
+#define CAT(a, b) a ## b
+#define LOG(fmt, ...) printf(fmt, ## __VA_ARGS__)
+#define LIMIT 10
+#define SELF SELF + 1
+#define f(a) a*g
+#define g(a) f(a)
+#define EMPTY
+#define CALL(fn) fn (LIMIT)
+
+int main() {
+    int x = MAX(1, LIMIT);
+    int y = MAX(x,
+                MAX(2, 3));
+    char *s = STR(a  "b\n" + 1);
+    char *t = XSTR(LIMIT);
+    int CAT(var, 1) = CAT(LIM, IT);
+    LOG("%d\n", x);
+    LOG("plain\n");
+    int z = SELF;
+    int w = f(2)(9);
+    int v = MAX EMPTY;
+    CALL(STR);
+    int d = STR(1,  2);
+    int e = MAX( 1 ,2 , 3 );
+    return 0;
+}
+#if MAX(LIMIT, 2) == 10 && defined(STR)
+int func_in_if();
+#endif
@@ -0,0 +1,18 @@
+
+int main() {
+    int x = ((1) > (10) ? (1) : (10));
+    int y = ((x) > (((2) > (3) ? (2) : (3))) ? (x) : (((2) > (3) ? (2) : (3))));
+    char *s = "a \"b\\n\" + 1";
+    char *t = "10";
+    int var1 = 10;
+    printf("%d\n", x);
+    printf("plain\n");
+    int z = SELF + 1;
+    int w = 2*9*g;
+    int v = MAX ;
+    "LIMIT";
+    int d = STR(1,  2);
+    int e = MAX( 1 ,2 , 3 );
+    return 0;
+}
+int func_in_if();
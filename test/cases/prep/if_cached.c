@@ -0,0 +1,6 @@
+#define LEVEL 1
+#include "if_level.h"
+#undef LEVEL
+#define LEVEL 2
+#include "if_level.h"
+#include "if_level.h"
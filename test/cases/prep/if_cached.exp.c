@@ -0,0 +1,3 @@
+int low();
+int high();
+int high();
@@ -0,0 +1,27 @@
+#define VERSION 3
+#define HALF (VERSION / 2)
+#define ENABLED VERSION > 2 && !defined(DISABLED)
+
+#if VERSION * 2 + 1 == 7 && HALF == 1
+int arith();
+#endif
+#if defined(DISABLED) || VERSION << 2 != 12
+int wrong1();
+#elif ENABLED
+int elif();
+#else
+int wrong2();
+#endif
+#if -1 < 0u
+int wrong3();
+#else
+int unsigned_cmp();
+#endif
+#if (1 ? -1 : 0u) > 0
+int unsigned_cond();
+#endif
+#if VERSION >= 3 ? UNDEFINED_ID + 1 : 0
+#if 0x10 % 3 == 1 && '\n' == 10
+int nested();
+#endif
+#endif
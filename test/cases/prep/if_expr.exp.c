@@ -0,0 +1,6 @@
+
+int arith();
+int elif();
+int unsigned_cmp();
+int unsigned_cond();
+int nested();
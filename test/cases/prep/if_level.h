@@ -0,0 +1,5 @@
+#if LEVEL > 1
+int high();
+#else
+int low();
+#endif
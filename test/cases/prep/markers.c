@@ -0,0 +1,8 @@
+#include "markers.h"
+int a = ONE;
+#ifdef NOPE
+int nope;
+#endif
+int b = ADD(1,
+            2);
+int c;
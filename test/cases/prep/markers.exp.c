@@ -0,0 +1,5 @@
+int h;
+int a = 1;
+
+int b = ((1) + (2));
+int c;
@@ -0,0 +1,3 @@
+#define ONE 1
+#define ADD(x, y) ((x) + (y))
+int h;
@@ -0,0 +1,9 @@
+#line 3 "markers.h"
+int h;
+#line 2 "markers.c"
+int a = 1;
+#line 5 "markers.c"
+
+int b = ((1) + (2));
+#line 8 "markers.c"
+int c;
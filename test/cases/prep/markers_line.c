@@ -0,0 +1,7 @@
+int a;
+#line 100
+int b;
+#line 200 "renamed.c"
+int c;
+
+int d;
@@ -0,0 +1,8 @@
+#line 1 "markers_line.c"
+int a;
+#line 100 "markers_line.c"
+int b;
+#line 200 "renamed.c"
+int c;
+
+int d;
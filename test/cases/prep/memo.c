@@ -0,0 +1,11 @@
+#define SCALE 2
+#define HOT (SCALE * 8)
+#define TWICE HOT + HOT
+#define LATE_CALL TWICE_OF
+
+int a = HOT, b = TWICE;
+#undef SCALE
+#define SCALE 3
+int c = HOT, d = TWICE;
+#define TWICE_OF(x) (x + x)
+int e = LATE_CALL(c);
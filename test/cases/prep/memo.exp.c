@@ -0,0 +1,4 @@
+
+int a = (2 * 8), b = (2 * 8) + (2 * 8);
+int c = (3 * 8), d = (3 * 8) + (3 * 8);
+int e = (c + c);
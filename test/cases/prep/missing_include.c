@@ -0,0 +1,3 @@
+#include <no_such_header.h>
+#include "no_such_file.h"
+int a;
@@ -0,0 +1,5 @@
+#pragma pack(push, 1)
+#include "pragma_once.h"
+#include "pragma_once.h"
+int a = ONCE;
+#pragma pack(pop)
@@ -0,0 +1,4 @@
+#pragma pack(push, 1)
+int once_decl;
+int a = 1;
+#pragma pack(pop)
@@ -0,0 +1,3 @@
+#pragma once
+#define ONCE 1
+int once_decl;
@@ -0,0 +1,7 @@
+#define UNUSED 0
+#include "snapshot.h"
+#define BASE TWICE(2)
+int a = BASE;
+#undef LIMIT
+#define TWICE(x) (2 * (x))
+int b = TWICE(LIMIT);
@@ -0,0 +1,2 @@
+int a = ((2) + /* again */ (2));
+int b = (2 * (LIMIT));
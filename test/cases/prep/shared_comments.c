@@ -0,0 +1,7 @@
+/*
+ * Starts like shared.c as far as the preprocessor is concerned
+ */
+#define  UNUSED  0
+#include "snapshot.h" // Same header
+
+int c = TWICE(LIMIT);
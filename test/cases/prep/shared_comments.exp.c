@@ -0,0 +1,5 @@
+/*
+ * Starts like shared.c as far as the preprocessor is concerned
+ */
+
+int c = ((16) + /* again */ (16));
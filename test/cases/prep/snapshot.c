@@ -0,0 +1,8 @@
+#define LOCAL 1
+#include "header_prot.h"
+#include <include.h>
+#include "snapshot.h"
+#ifdef LOCAL
+int local;
+#endif
+int limit = TWICE(LIMIT);
@@ -0,0 +1,2 @@
+void some_func();extern void some(); //ZHABA_INCLUDE_H
+int limit = ((16) + /* again */ (16));
@@ -0,0 +1,3 @@
+#define TWICE(x) ((x) + /* again */ (x))
+#define LIMIT 16
+#undef LOCAL
@@ -0,0 +1,11 @@
+#define OPEN "/*"
+#define STR(x) #x
+#define E 0x1e+E
+#ifdef OPEN
+char *s = OPEN; /* #endif in a comment
+#else */
+char *t = STR(a /* b */ + '"');
+#else
+char *u = "#endif";
+#endif
+int c = '\'' + 1.5e+3 + E;
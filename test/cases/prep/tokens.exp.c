@@ -0,0 +1,4 @@
+char *s = "/*"; /* #endif in a comment
+#else */
+char *t = "a + '\"'";
+int c = '\'' + 1.5e+3 + 0x1e+E;
@@ -0,0 +1,3 @@
+#include "trace_a.h"
+#include "trace_b.h"
+int main_decl = A + B;
@@ -0,0 +1,4 @@
+int b_decl;
+int a_decl;
+int b_decl;
+int main_decl = 1 + 2;
@@ -0,0 +1,3 @@
+#define A 1
+#include "trace_b.h"
+int a_decl;
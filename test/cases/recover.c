@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+int sum(int *values, int n) {
+    int total = 0;
+    for (int i = 0; i < n; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+static int twice(int x) {
+    return x * 2;
+}
+
+int main() {
+    int n = 3;
+    do { n--; } while (n > 0);
+    printf("%d\n", sum(&n, 1));
+    return 0;
+}
+
+int level(int n) {
+    int l = n > 9 ? 2 :
+#ifdef SMALL
+        0;
+#else
+        1;
+#endif
+    return n;
+}
@@ -0,0 +1,18 @@
+#define LIMIT 10
+
+int count;
+int total = LIMIT;
+
+int add(int n) {
+    int count = n;
+    total = total + count;
+    return total;
+}
+
+int main() {
+    count = add(LIMIT);
+    if (count > 3) goto done;
+    add(count);
+done:
+    return count;
+}
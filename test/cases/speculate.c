@@ -0,0 +1,7 @@
+int read_all(char *path) {
+    FILE *f = fopen(path, "r");
+    size_t *count;
+    total * scale + 1;
+    total * (scale - 1);
+    return f != 0;
+}
@@ -0,0 +1,19 @@
+typedef int T;
+typedef struct point {
+    int x;
+} Point;
+typedef struct {
+    T y;
+} Anon;
+
+int f(T a, Point *p) {
+    T * x;
+    T b = (T) a + sizeof(T);
+    {
+        int T = 3;
+        T * b;
+    }
+    T * c;
+    va_list ap;
+    return 0;
+}
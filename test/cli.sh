@@ -0,0 +1,26 @@
+#!/bin/sh
+# Usage: cli.sh zhaba cases-dir out-dir
+# Renders a case through the command line into one symbol database, again and with a parse cache
+set -e
+zhaba=$1
+cases=$2
+out=$3
+
+rm -rf "$out"
+mkdir -p "$out"
+
+"$zhaba" "$cases/bodies.c" "$out" "$out/symbols.db"
+cp "$out/bodies.html" "$out/bodies.first.html"
+"$zhaba" "$cases/bodies.c" "$out" "$out/symbols.db"
+cmp "$out/bodies.first.html" "$out/bodies.html"
+test -s "$out/symbols.db"
+
+# The second run reads the parse the first one cached
+"$zhaba" -c "$out/cache" "$cases/bodies.c" "$out" "$out/symbols.db"
+test -n "$(ls "$out/cache")"
+"$zhaba" -c "$out/cache" "$cases/bodies.c" "$out" "$out/symbols.db"
+cmp "$out/bodies.first.html" "$out/bodies.html"
+
+# Caching is skipped when the directory can't be made
+"$zhaba" -c "$out/missing/cache" "$cases/bodies.c" "$out" "$out/symbols.db" 2>/dev/null
+cmp "$out/bodies.first.html" "$out/bodies.html"
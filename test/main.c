@@ -8,10 +8,14 @@
 #include <sys/stat.h>
 
 #include "html_reader.h"
+#include "../lib/ast_cache.h"
+#include "../lib/ast_cursor.h"
+#include "../lib/html_render.h"
 #include "../lib/lexer.h"
 #include "../lib/lib.h"
 #include "../lib/parser.h"
 #include "../lib/prep.h"
+#include "../lib/symbol_db.h"
 
 static char *path_joinm(char *p1, char *p2);
 static char *path_replace_ext(char *p, char *ext);
@@ -23,6 +27,13 @@ static void write_escape_invisible(char, FILE *);
 static void assert_equal(char *expfile, char *actual_str, char *testname);
 
 static void run_prep_tests(char *dir);
+static void run_snapshot_test(char *dir, char *name, char *exp_filepath);
+static void run_shared_test(char *dir, char *name, char *exp_filepath);
+static void check_source_map(char *dir, char *name);
+static void run_line_markers_test(char *dir, char *name);
+static void run_trace_test(char *dir, char *name);
+static void check_parse_modes(char *srcpath, char *name);
+static void check_symbol_db(char *dir, char *dbpath);
 
 #define SOURCE_MAX_LEN 8096
 static char source[SOURCE_MAX_LEN];
@@ -58,6 +69,13 @@ int main(int argc, char *argv[]) {
 
     lexer_init();
     parser_init();
+    parser_recovery_set(true);
+
+    char *dbpath = path_joinm(outdir, "symbols.db");
+    remove(dbpath);
+    SymbolDb *symbol_db = symdb_open(dbpath, true);
+    assert(symbol_db != NULL);
+    render_symbols_set(symbol_db);
 
     while ((ent = readdir(dir)) != NULL) {
         if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
@@ -118,9 +136,13 @@ int main(int argc, char *argv[]) {
 
             char *exp_filepath = path_joinm(argv[1], htmlfilename);
             assert_equal(exp_filepath, decoded_source, ent->d_name);
+            check_parse_modes(srcpath, ent->d_name);
         }
     }
 
+    render_symbols_set(NULL);
+    symdb_close(symbol_db);
+    check_symbol_db(argv[1], dbpath);
     return 0;
 }
 
@@ -134,6 +156,7 @@ static void run_prep_tests(char *dir) {
 
     struct dirent *ent;
     char *ext_include = path_joinm(dir, "external");
+    prep_prefetch_set(2); // Output must not depend on it
     while ((ent = readdir(dirp)) != NULL) {
         if (endswith(ent->d_name, ".c") && !endswith(ent->d_name, ".exp.c")) {
             int outsz = 2 * 1024;
@@ -145,8 +168,440 @@ static void run_prep_tests(char *dir) {
             *srcend = '\0';
             char *exp_filepath = path_joinm(dir, path_replace_ext(ent->d_name, ".exp.c"));
             assert_equal(exp_filepath, expanded_src, ent->d_name);
+
+            if (strncmp(ent->d_name, "snapshot", 8) == 0) {
+                run_snapshot_test(dir, ent->d_name, exp_filepath);
+            }
+
+            if (strncmp(ent->d_name, "shared", 6) == 0) {
+                run_shared_test(dir, ent->d_name, exp_filepath);
+            }
+
+            if (strncmp(ent->d_name, "markers", 7) == 0) {
+                run_line_markers_test(dir, ent->d_name);
+            }
+
+            if (strncmp(ent->d_name, "trace", 5) == 0) {
+                run_trace_test(dir, ent->d_name);
+            }
+
+            check_source_map(dir, ent->d_name);
+        }
+    }
+}
+
+static char *render_ast(Ast *ast, char *name, int nlines) {
+    char *html;
+    size_t size;
+    FILE *f = open_memstream(&html, &size);
+    gen_html(ast, name, nlines, f);
+    fclose(f);
+    return html;
+}
+
+static void expect_same_ast(Ast *expected, Ast *actual, char *name, char *mode, int nlines) {
+    for (int type = 0; type < NODE_TYPE_COUNT; type++) {
+        if (expected->nodes[type].size != actual->nodes[type].size) {
+            fprintf(stderr, "Case %s failed. %s parse has %u nodes of type %d instead of %u\n", name, mode,
+                    actual->nodes[type].size, type, expected->nodes[type].size);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (expected->nerrors != actual->nerrors) {
+        fprintf(stderr, "Case %s failed. %s parse has %u errors instead of %u\n", name, mode, actual->nerrors,
+                expected->nerrors);
+        exit(EXIT_FAILURE);
+    }
+
+    if (expected->ndefs != actual->ndefs || expected->nuses != actual->nuses) {
+        fprintf(stderr, "Case %s failed. %s parse has %u symbols used %u times instead of %u used %u times\n", name,
+                mode, actual->ndefs, actual->nuses, expected->ndefs, expected->nuses);
+        exit(EXIT_FAILURE);
+    }
+
+    char *expected_html = render_ast(expected, name, nlines);
+    char *actual_html = render_ast(actual, name, nlines);
+
+    if (strcmp(expected_html, actual_html) != 0) {
+        fprintf(stderr, "Case %s failed. %s parse renders differently\n", name, mode);
+        exit(EXIT_FAILURE);
+    }
+
+    free(expected_html);
+    free(actual_html);
+}
+
+// The arrays of the node types hold what is in the tree and nothing else, and every call is found by name
+static void expect_indexed(Ast *ast, char *name) {
+    uint32_t counts[NODE_TYPE_COUNT] = {0};
+    AstCursor c;
+    cursor_init(&c, ast, ast->first_element);
+
+    while (cursor_next(&c)) {
+        if (c.event != CURSOR_ENTER) continue;
+
+        counts[NODE_REF_TYPE(c.node)]++;
+        if (NODE_REF_TYPE(c.node) != FUNC_INVOKE) continue;
+
+        NodeRef callee = ((FuncInvoke *) ast_node(ast, c.node))->callee;
+        if (NODE_REF_TYPE(callee) == DEFINE_REFERENCE) callee = ((DefineReference *) ast_node(ast, callee))->expr;
+        if (NODE_REF_TYPE(callee) != VAR_REFERENCE) continue;
+
+        Span callee_name = ast->tokens[((VarReference *) ast_node(ast, callee))->id]->span;
+        NodeRef call = ast_next_call(ast, callee_name, 0);
+        while (call != 0 && call != c.node) call = ast_next_call(ast, callee_name, call);
+
+        if (call == 0) {
+            fprintf(stderr, "Case %s failed. Call of %.*s not found\n", name, (int) (callee_name.end - callee_name.ptr),
+                    callee_name.ptr);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cursor_free(&c);
+
+    for (int type = 1; type < NODE_TYPE_COUNT; type++) {
+        if (counts[type] != ast_count(ast, type)) {
+            fprintf(stderr, "Case %s failed. %u nodes of type %d in the tree, %u in its array\n", name, counts[type],
+                    type, ast_count(ast, type));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+// An outline parse with every body parsed on demand, and a parse of the bodies on threads, must come
+// out as the sequential parse
+static void check_parse_modes(char *srcpath, char *name) {
+    FILE *f = fopen(srcpath, "r");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    byte *src = pool_alloc(len, byte);
+    fread(src, 1, len, f);
+    fclose(f);
+
+    int nlines;
+    LexerError err;
+    Token *tokens = tokenize(src, len, &nlines, &err);
+    Parser *full = parse(tokens);
+    Parser *outline = parse_outline(tokens);
+    parser_threads_set(3);
+    Parser *parallel = parse(tokens);
+    parser_threads_set(1);
+
+    for (NodeRef node = outline->ast.first_element; node != 0; node = ast_header(&outline->ast, node)->next) {
+        if (NODE_REF_TYPE(node) != FUNC_DEF) continue;
+
+        FuncDef *def = ast_node(&outline->ast, node);
+        if (def->parsed) {
+            fprintf(stderr, "Case %s failed. Outline parse parsed a body\n", name);
+            exit(EXIT_FAILURE);
+        }
+
+        parse_body(outline, node);
+    }
+
+    expect_indexed(&full->ast, name);
+    expect_same_ast(&full->ast, &outline->ast, name, "Outline", nlines);
+    expect_same_ast(&full->ast, &parallel->ast, name, "Parallel", nlines);
+
+    // What the cache gives back is the parse stored, parses with errors are not kept
+    ast_cache_dir_set(path_joinm("temp", "cache"));
+    ast_cache_store(src, len, nlines, &full->ast);
+    CachedAst *cached = ast_cache_load(src, len);
+    ast_cache_dir_set(NULL);
+
+    if ((cached != NULL) != (full->ast.nerrors == 0)) {
+        fprintf(stderr, "Case %s failed. Cache %s the parse\n", name, cached != NULL ? "kept" : "lost");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cached != NULL) {
+        expect_same_ast(&full->ast, &cached->ast, name, "Cached", nlines);
+        if (cached->nlines != nlines) {
+            fprintf(stderr, "Case %s failed. Cached parse has %d lines instead of %d\n", name, cached->nlines, nlines);
+            exit(EXIT_FAILURE);
+        }
+
+        ast_cache_close(cached);
+    }
+
+    ast_free(&full->ast);
+    ast_free(&outline->ast);
+    ast_free(&parallel->ast);
+}
+
+static Ast *parse_case(char *srcpath) {
+    FILE *f = fopen(srcpath, "r");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    byte *src = pool_alloc(len, byte);
+    fread(src, 1, len, f);
+    fclose(f);
+
+    int nlines;
+    LexerError err;
+    return &parse(tokenize(src, len, &nlines, &err))->ast;
+}
+
+static void add_cases(SymbolDb *db, DIR *dirp, char *dir) {
+    struct dirent *ent;
+    rewinddir(dirp);
+
+    while ((ent = readdir(dirp)) != NULL) {
+        if (endswith(ent->d_name, ".c")) {
+            char *srcpath = path_joinm(dir, ent->d_name);
+            Ast *ast = parse_case(srcpath);
+            symdb_add(db, srcpath, ast);
+            ast_free(ast);
+        }
+    }
+}
+
+#define SYMBOL_DB_READDS 8
+
+// Adds every case a few more times to the database the render left, which supersedes what they had. It
+// must stay as small as a new database the cases were added to twice. Then looks up each of their global
+// definitions in a read only mapping of it.
+static void check_symbol_db(char *dir, char *dbpath) {
+    DIR *dirp = opendir(dir);
+    assert(dirp != NULL);
+
+    char *fresh_path = path_joinm("temp", "symbols_fresh.db");
+    remove(fresh_path);
+    SymbolDb *fresh = symdb_open(fresh_path, true);
+    assert(fresh != NULL);
+    add_cases(fresh, dirp, dir);
+    add_cases(fresh, dirp, dir);
+    size_t fresh_size = fresh->size;
+    symdb_close(fresh);
+
+    SymbolDb *db = symdb_open(dbpath, true);
+    assert(db != NULL);
+
+    for (int i = 0; i < SYMBOL_DB_READDS; i++) {
+        add_cases(db, dirp, dir);
+    }
+
+    if (db->size > fresh_size) {
+        fprintf(stderr, "Symbol database grew to %zu bytes adding the cases again, twice them take %zu\n", db->size,
+                fresh_size);
+        exit(EXIT_FAILURE);
+    }
+
+    symdb_close(db);
+    db = symdb_open(dbpath, false);
+    assert(db != NULL);
+    rewinddir(dirp);
+    struct dirent *ent;
+
+    while ((ent = readdir(dirp)) != NULL) {
+        if (!endswith(ent->d_name, ".c")) continue;
+
+        char *srcpath = path_joinm(dir, ent->d_name);
+        Ast *ast = parse_case(srcpath);
+
+        for (uint32_t d = 0; d < ast->ndefs; d++) {
+            uint32_t kind = ast->defs[d].kind;
+            if (kind != GLOBAL_SYMBOL && kind != FUNCTION_SYMBOL && kind != TYPEDEF_SYMBOL && kind != STRUCT_SYMBOL &&
+                kind != MACRO_SYMBOL) {
+                continue;
+            }
+
+            Token *t = ast->tokens[ast->defs[d].token];
+            int found = 0;
+
+            for (SymbolDbEntry *e = symdb_find(db, t->span, NULL); e != NULL; e = symdb_find(db, t->span, e)) {
+                found += strcmp(symdb_filename(db, e), srcpath) == 0 && e->line == t->line &&
+                         e->column == t->column && e->kind == kind;
+            }
+
+            if (found != 1) {
+                fprintf(stderr, "Case %s failed. Symbol database has %.*s at %d:%d %d times\n", ent->d_name,
+                        (int) (t->span.end - t->span.ptr), t->span.ptr, t->line, t->column, found);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        ast_free(ast);
+    }
+
+    symdb_close(db);
+    closedir(dirp);
+}
+
+// Expands name twice with settings that carry state over from one run to the next, both runs must give the
+// expected output. The tables they start with go to tables.
+static void expand_twice(char *dir, char *name, char *exp_filepath, DefineTable *tables[2]) {
+    for (int run = 0; run < 2; run++) {
+        int outsz = 2 * 1024;
+        char *expanded_src = pool_alloc(outsz, char);
+        tables[run] = prep_define_newtable();
+        char *srcend = prep_expand(path_joinm(dir, name), tables[run], expanded_src, &outsz);
+        *srcend = '\0';
+        assert_equal(exp_filepath, expanded_src, name);
+    }
+}
+
+// The first run saves a snapshot after the includes and the second one starts from it
+static void run_snapshot_test(char *dir, char *name, char *exp_filepath) {
+    char *snapshot = path_joinm("temp", path_replace_ext(name, ".snap"));
+    remove(snapshot);
+    prep_snapshot_set(snapshot, 1024);
+
+    DefineTable *tables[2];
+    int loads = prep_snapshot_loads();
+    expand_twice(dir, name, exp_filepath, tables);
+
+    if (!file_exists(snapshot) || prep_snapshot_loads() != loads + 1) {
+        fprintf(stderr, "Case %s failed. Snapshot loaded %d times instead of once\n", name, prep_snapshot_loads() - loads);
+        exit(EXIT_FAILURE);
+    }
+
+    prep_snapshot_set(NULL, 0);
+}
+
+// The second run forks the state after the includes that the first one built. Every shared*.c case starts
+// with the same includes and definitions, whatever their comments and the rest, so they all fork the same.
+static void run_shared_test(char *dir, char *name, char *exp_filepath) {
+    static DefineTable *shared;
+
+    prep_shared_prefix_set(1024);
+    DefineTable *tables[2];
+    expand_twice(dir, name, exp_filepath, tables);
+    prep_shared_prefix_set(0);
+
+    DefineTable *parent = prep_define_parent(tables[0]);
+    if (shared == NULL) shared = parent;
+
+    if (parent == NULL || parent != shared || prep_define_parent(tables[1]) != shared) {
+        fprintf(stderr, "Case %s failed. Macro state after the includes was not shared\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Every byte of the output that isn't from an invocation must be the byte the map points to
+static void check_source_map(char *dir, char *name) {
+    SourceMap *map = prep_source_map_new();
+    prep_source_map_set(map);
+
+    int outsz = 2 * 1024;
+    char *expanded_src = pool_alloc(outsz, char);
+    char *srcend = prep_expand(path_joinm(dir, name), prep_define_newtable(), expanded_src, &outsz);
+    prep_source_map_set(NULL);
+
+    for (char *cp = expanded_src; cp < srcend; cp++) {
+        SourcePos pos;
+        assert(prep_source_map_lookup(map, cp - expanded_src, &pos));
+        if (pos.path == NULL || pos.expanded) continue;
+
+        FILE *f = fopen(pos.path, "r");
+        assert(f != NULL);
+        fseek(f, (long) pos.offset, SEEK_SET);
+        int c = getc(f);
+        fclose(f);
+
+        if (c != *cp && !(c == '\\' && *cp == ' ')) { // Continuations are written as a space
+            fprintf(stderr, "%s: output offset %ld maps to %s:%d:%d\n", name, (long) (cp - expanded_src), pos.path, pos.line, pos.column);
+            exit(EXIT_FAILURE);
         }
     }
+
+    SourcePos pos;
+    assert(!prep_source_map_lookup(map, srcend - expanded_src, &pos));
+}
+
+// Compares to the .lines.exp.c file, with the directory left out of the marker paths
+static void run_line_markers_test(char *dir, char *name) {
+    prep_line_markers_set(true);
+
+    int outsz = 2 * 1024;
+    char *expanded_src = pool_alloc(outsz, char);
+    char *srcend = prep_expand(path_joinm(dir, name), prep_define_newtable(), expanded_src, &outsz);
+    *srcend = '\0';
+    prep_line_markers_set(false);
+
+    char *prefix = path_joinm(dir, "");
+    size_t prefix_len = strlen(prefix);
+    char *dst = expanded_src;
+
+    for (char *cp = expanded_src; *cp != '\0'; ) {
+        if (strncmp(cp, prefix, prefix_len) == 0) cp += prefix_len;
+        else *dst++ = *cp++;
+    }
+
+    *dst = '\0';
+    assert_equal(path_joinm(dir, path_replace_ext(name, ".lines.exp.c")), expanded_src, name);
+}
+
+static int cmp_lines(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+// Compares to the .trace.exp file: the include tree from the JSON events, nested by their times, then the
+// summary without the timings, sorted by file. Paths leave out the directory.
+static void run_trace_test(char *dir, char *name) {
+    prep_trace_set(true);
+    int outsz = 2 * 1024;
+    char *expanded_src = pool_alloc(outsz, char);
+    prep_expand(path_joinm(dir, name), prep_define_newtable(), expanded_src, &outsz);
+    prep_trace_set(false);
+
+    char *json, *summary;
+    size_t json_size, summary_size;
+    FILE *f = open_memstream(&json, &json_size);
+    prep_trace_write_json(f);
+    fclose(f);
+    f = open_memstream(&summary, &summary_size);
+    prep_trace_write_summary(f);
+    fclose(f);
+
+    char *actual;
+    size_t actual_size;
+    FILE *out = open_memstream(&actual, &actual_size);
+    size_t prefix_len = strlen(path_joinm(dir, ""));
+    double ends[16];
+    int depth = 0;
+
+    for (char *line = strtok(json, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        char path[256];
+        double ts, dur;
+        size_t bytes, defines;
+        if (sscanf(line, "{\"name\": \"%255[^\"]\"", path) != 1) continue;
+        assert(sscanf(strstr(line, "\"ts\""), "\"ts\": %lf, \"dur\": %lf", &ts, &dur) == 2);
+        assert(sscanf(strstr(line, "\"bytes\""), "\"bytes\": %zu, \"defines\": %zu", &bytes, &defines) == 2);
+
+        while (depth > 0 && ts >= ends[depth - 1]) depth--;
+        assert(depth < 16);
+        ends[depth++] = ts + dur;
+        fprintf(out, "%*s%s %zu %zu\n", 2 * (depth - 1), "", path + prefix_len, bytes, defines);
+    }
+
+    char *lines[64];
+    int nlines = 0;
+    strtok(summary, "\n"); // Header
+
+    for (char *line = strtok(NULL, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        int count;
+        size_t bytes, defines;
+        char path[256];
+        assert(nlines < 64);
+        assert(sscanf(line, "%*f %*f %*f %d %zu %zu %255s", &count, &bytes, &defines, path) == 4);
+        lines[nlines] = malloc(strlen(path) + 64);
+        assert(lines[nlines] != NULL);
+        sprintf(lines[nlines++], "%d %zu %zu %s", count, bytes, defines, path + prefix_len);
+    }
+
+    qsort(lines, nlines, sizeof(char *), cmp_lines);
+    fprintf(out, "\n");
+    for (int i = 0; i < nlines; i++) fprintf(out, "%s\n", lines[i]);
+    fclose(out);
+
+    assert_equal(path_joinm(dir, path_replace_ext(name, ".trace.exp")), actual, name);
 }
 
 static void assert_equal(char *expfile, char *actual_str, char *testname) {